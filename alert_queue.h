@@ -0,0 +1,447 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * Asynchronous alert delivery.
+ *
+ * Detection threads publish compact AlertRecords instead of writing
+ * alert text themselves. Every sink (stdout, a file, syslog, a local
+ * datagram socket) owns a bounded lock-free queue and a thread that
+ * drains it, so a slow sink never stalls detection. It only fills its
+ * own queue, and the channel's backpressure policy then decides what
+ * happens:
+ *
+ *   block        The producer waits for room; nothing is lost.
+ *   drop-oldest  The oldest queued alert is discarded to make room.
+ *   sample       Once the queue is half full only one alert in N is
+ *                kept, and alerts that still find it full are dropped.
+ *
+ * The queue is the bounded MPMC array queue of D. Vyukov: each cell
+ * carries a sequence number that tells producers and consumers whether
+ * the cell is free for the current lap, so a push or pop is one CAS on
+ * the shared position plus one release store on the cell, and no thread
+ * ever waits on another's lock.
+ */
+
+#ifndef ALERT_QUEUE_H
+#define ALERT_QUEUE_H
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/** One alert as published by the detector. */
+struct AlertRecord {
+    uint32_t time = 0;   // Exact time of the line, seconds since Epoch
+    uint8_t reason = 0;  // processHelper reason code
+    std::string line;    // The alerting log line
+};
+
+/** @return An alert as the detector prints it, without the newline. */
+inline std::string formatAlert(const AlertRecord& alert) {
+    static const char* const reasons[] = {"", "banned IP", "frequency", "",
+        "IP frequency", "subnet frequency", "password spraying"};
+    return std::string("Hacking due to ") + (alert.reason < 7 ?
+            reasons[alert.reason] : "unknown reason") + ". Line: " +
+        alert.line;
+}
+
+/** A bounded multi-producer multi-consumer lock-free queue. */
+template <typename T>
+class MpmcQueue {
+public:
+    /** @param capacity Rounded up to a power of two, at least 2. */
+    explicit MpmcQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) {
+            size *= 2;
+        }
+        cells.reset(new Cell[size]);
+        mask = size - 1;
+        for (size_t i = 0; i < size; i++) {
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Moves item into the queue if there is room.
+     * @return Returns false, leaving item untouched, if the queue is full.
+     */
+    bool tryPush(T& item) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[pos & mask];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) -
+                static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1,
+                            std::memory_order_relaxed)) {
+                    cell.value = std::move(item);
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * Moves the oldest item out of the queue.
+     * @return Returns false if the queue is empty.
+     */
+    bool tryPop(T& item) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[pos & mask];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) -
+                static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1,
+                            std::memory_order_relaxed)) {
+                    item = std::move(cell.value);
+                    cell.seq.store(pos + mask + 1,
+                            std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /** @return The number of queued items; exact only when quiescent. */
+    size_t size() const {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t h = head.load(std::memory_order_relaxed);
+        return t > h ? t - h : 0;
+    }
+
+    size_t capacity() const { return mask + 1; }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask = 0;
+    // Producers and consumers each get their own cache line
+    alignas(64) std::atomic<size_t> tail{0};
+    alignas(64) std::atomic<size_t> head{0};
+};
+
+/** A destination for alerts, driven by one channel thread. */
+class AlertSink {
+public:
+    virtual ~AlertSink() {}
+    virtual void write(const AlertRecord& alert) = 0;
+    /** Called whenever the channel's queue runs empty. */
+    virtual void flush() {}
+    virtual std::string name() const = 0;
+};
+
+/** Writes alerts to a stream such as std::cout. */
+class StreamSink : public AlertSink {
+public:
+    StreamSink(std::ostream& os, const std::string& label) : os(os),
+        label(label) {}
+
+    void write(const AlertRecord& alert) override {
+        os << formatAlert(alert) + "\n";
+    }
+    void flush() override { os.flush(); }
+    std::string name() const override { return label; }
+
+private:
+    std::ostream& os;
+    std::string label;
+};
+
+/** Appends alerts to a file. */
+class FileSink : public AlertSink {
+public:
+    explicit FileSink(const std::string& path) : path(path),
+        out(path, std::ios::app) {
+        if (!out.good()) {
+            throw std::runtime_error("Error opening alert file " + path);
+        }
+    }
+
+    void write(const AlertRecord& alert) override {
+        out << formatAlert(alert) << '\n';
+    }
+    void flush() override { out.flush(); }
+    std::string name() const override { return "file:" + path; }
+
+private:
+    std::string path;
+    std::ofstream out;
+};
+
+/** Sends alerts to the system log as authpriv warnings. */
+class SyslogSink : public AlertSink {
+public:
+    SyslogSink() { openlog("hacking-detector", LOG_PID, LOG_AUTHPRIV); }
+    ~SyslogSink() { closelog(); }
+
+    void write(const AlertRecord& alert) override {
+        syslog(LOG_WARNING, "%s", formatAlert(alert).c_str());
+    }
+    std::string name() const override { return "syslog"; }
+};
+
+/**
+ * Sends each alert as one datagram to a local (AF_UNIX) socket. Alerts
+ * that cannot be delivered, e.g. because no one is listening, are
+ * counted rather than retried.
+ */
+class SocketSink : public AlertSink {
+public:
+    explicit SocketSink(const std::string& path) : path(path) {
+        if (path.size() >= sizeof(addr.sun_path)) {
+            throw std::runtime_error("Socket path too long: " + path);
+        }
+        fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw std::runtime_error("Error creating alert socket");
+        }
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        std::memcpy(addr.sun_path, path.c_str(), path.size());
+    }
+    ~SocketSink() { close(fd); }
+
+    void write(const AlertRecord& alert) override {
+        const std::string text = formatAlert(alert);
+        if (sendto(fd, text.data(), text.size(), 0,
+                    reinterpret_cast<const sockaddr*>(&addr),
+                    sizeof(addr)) < 0) {
+            failed++;
+        }
+    }
+    std::string name() const override {
+        return "socket:" + path + (failed ? " (" + std::to_string(failed) +
+                " undeliverable)" : "");
+    }
+
+private:
+    std::string path;
+    int fd = -1;
+    sockaddr_un addr;
+    uint64_t failed = 0;
+};
+
+/** What a producer does when a sink's queue is full. */
+enum class Backpressure { block, dropOldest, sample };
+
+/**
+ * One sink together with its queue and the thread draining it. Any
+ * number of threads may publish.
+ */
+class AlertChannel {
+public:
+    /**
+     * @param sink The destination, owned by the channel.
+     * @param capacity The number of alerts the queue holds.
+     * @param policy What publish() does when the queue is full.
+     * @param sampleEvery With Backpressure::sample, keep one alert in
+     * this many once the queue is half full.
+     */
+    AlertChannel(std::unique_ptr<AlertSink> sink, size_t capacity,
+            Backpressure policy, unsigned sampleEvery = 16) :
+        sink(std::move(sink)), queue(capacity), policy(policy),
+        sampleEvery(sampleEvery ? sampleEvery : 1),
+        worker([this] { run(); }) {}
+
+    /** Delivers every queued alert, then stops the thread. */
+    ~AlertChannel() {
+        stopping.store(true);
+        wake();
+        worker.join();
+    }
+
+    /** Queues an alert, applying the backpressure policy. */
+    void publish(AlertRecord&& alert) {
+        if (policy == Backpressure::sample &&
+            queue.size() * 2 >= queue.capacity() &&
+            sampled.fetch_add(1, std::memory_order_relaxed) %
+            sampleEvery != 0) {
+            rejected.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        while (!queue.tryPush(alert)) {
+            if (policy == Backpressure::block) {
+                wake();
+                std::this_thread::yield();
+                continue;
+            }
+            if (policy == Backpressure::sample) {
+                rejected.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            AlertRecord oldest;
+            if (queue.tryPop(oldest)) {
+                evicted.fetch_add(1, std::memory_order_release);
+            }
+        }
+        pushed.fetch_add(1, std::memory_order_release);
+        if (sleeping.load(std::memory_order_relaxed)) {
+            wake();
+        }
+    }
+
+    /** Waits until every alert published so far has been written and
+     * the sink flushed. */
+    void drain() {
+        while (flushed.load(std::memory_order_acquire) !=
+               pushed.load(std::memory_order_acquire)) {
+            wake();
+            std::this_thread::yield();
+        }
+    }
+
+    const AlertSink& destination() const { return *sink; }
+    uint64_t written() const { return done.load(); }
+    uint64_t drops() const { return evicted.load() + rejected.load(); }
+
+private:
+    void run() {
+        AlertRecord alert;
+        for (;;) {
+            if (queue.tryPop(alert)) {
+                sink->write(alert);
+                done.fetch_add(1, std::memory_order_release);
+                continue;
+            }
+            sink->flush();
+            flushed.store(done.load(std::memory_order_acquire) +
+                    evicted.load(std::memory_order_acquire),
+                    std::memory_order_release);
+            if (stopping.load() && queue.size() == 0) {
+                return;
+            }
+            // Sleep until a producer finds us idle; the timeout bounds
+            // the cost of a wake-up lost between the check and the wait
+            std::unique_lock<std::mutex> lock(mutex);
+            sleeping.store(true);
+            if (queue.size() == 0 && !stopping.load()) {
+                idle.wait_for(lock, std::chrono::milliseconds(1));
+            }
+            sleeping.store(false);
+        }
+    }
+
+    void wake() {
+        std::lock_guard<std::mutex> lock(mutex);
+        idle.notify_one();
+    }
+
+    std::unique_ptr<AlertSink> sink;
+    MpmcQueue<AlertRecord> queue;
+    Backpressure policy;
+    unsigned sampleEvery;
+    // pushed counts queued alerts, done those written and evicted those
+    // discarded by drop-oldest; flushed is done + evicted as of the last
+    // flush, and rejected counts alerts sampling never queued
+    std::atomic<uint64_t> pushed{0}, done{0}, evicted{0}, flushed{0};
+    std::atomic<uint64_t> rejected{0}, sampled{0};
+    std::atomic<bool> sleeping{false}, stopping{false};
+    std::mutex mutex;
+    std::condition_variable idle;
+    std::thread worker;
+};
+
+/** Fans every published alert out to each sink's channel. */
+class AlertBus {
+public:
+    void add(std::unique_ptr<AlertChannel> channel) {
+        channels.push_back(std::move(channel));
+    }
+
+    void publish(AlertRecord&& alert) {
+        for (size_t i = 0; i + 1 < channels.size(); i++) {
+            AlertRecord copy = alert;
+            channels[i]->publish(std::move(copy));
+        }
+        if (!channels.empty()) {
+            channels.back()->publish(std::move(alert));
+        }
+    }
+
+    /** Waits until every sink has written what was published so far. */
+    void drain() {
+        for (auto& channel : channels) {
+            channel->drain();
+        }
+    }
+
+    const std::vector<std::unique_ptr<AlertChannel>>& sinks() const {
+        return channels;
+    }
+
+private:
+    std::vector<std::unique_ptr<AlertChannel>> channels;
+};
+
+/**
+ * Creates a sink from its command-line name: "stdout", "file:<path>",
+ * "syslog" or "socket:<path>".
+ * @param spec The sink name.
+ * @param os The stream used by "stdout".
+ */
+inline std::unique_ptr<AlertSink> makeAlertSink(const std::string& spec,
+        std::ostream& os) {
+    if (spec == "stdout") {
+        return std::unique_ptr<AlertSink>(new StreamSink(os, spec));
+    } else if (spec == "syslog") {
+        return std::unique_ptr<AlertSink>(new SyslogSink());
+    } else if (spec.compare(0, 5, "file:") == 0) {
+        return std::unique_ptr<AlertSink>(new FileSink(spec.substr(5)));
+    } else if (spec.compare(0, 7, "socket:") == 0) {
+        return std::unique_ptr<AlertSink>(new SocketSink(spec.substr(7)));
+    }
+    throw std::runtime_error("Unknown alert sink " + spec);
+}
+
+/**
+ * Parses a backpressure policy: "block", "drop-oldest" or "sample[:N]".
+ * @param spec The policy name.
+ * @param sampleEvery Set to N for "sample:N".
+ */
+inline Backpressure parseBackpressure(const std::string& spec,
+        unsigned& sampleEvery) {
+    if (spec == "block") {
+        return Backpressure::block;
+    } else if (spec == "drop-oldest") {
+        return Backpressure::dropOldest;
+    } else if (spec.compare(0, 6, "sample") == 0) {
+        if (spec.size() > 7 && spec[6] == ':') {
+            sampleEvery = std::stoul(spec.substr(7));
+        }
+        return Backpressure::sample;
+    }
+    throw std::runtime_error("Unknown backpressure policy " + spec);
+}
+
+#endif  // ALERT_QUEUE_H
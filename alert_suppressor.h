@@ -0,0 +1,132 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * Per-key alert suppression windows.
+ *
+ * Once a key (an account under attack, a source address, a subnet)
+ * trips a rule, a sustained attack would otherwise raise an alert on
+ * nearly every following line. The first alert for a key opens a window
+ * of the configured length; later alerts for the same key inside that
+ * window are only counted, and when the window closes one summary with
+ * the count is reported. The next alert for the key then opens a new
+ * window, so output grows with the number of incidents rather than the
+ * number of lines. Windows are closed by the same TimingWheel that
+ * expires the rules' window state, and the number of open windows is
+ * capped; the oldest is closed early when the cap is reached.
+ */
+
+#ifndef ALERT_SUPPRESSOR_H
+#define ALERT_SUPPRESSOR_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include "flat_map.h"
+#include "rate_tracker.h"
+
+template <typename Key, typename Hash = std::hash<Key>>
+class AlertSuppressor {
+public:
+    /** An open suppression window. */
+    struct Window {
+        uint32_t opened = 0;      // Time of the alert that was reported
+        uint64_t suppressed = 0;  // Alerts counted since then
+        std::string last;         // The last suppressed alert's line
+    };
+
+    /**
+     * @param window How many seconds after a reported alert further
+     * alerts for the same key are suppressed.
+     * @param maxKeys The largest number of windows kept open at once.
+     */
+    AlertSuppressor(long window, size_t maxKeys) :
+        window(window > 0 ? window : 1), maxKeys(maxKeys ? maxKeys : 1),
+        wheel(this->window + 1) {}
+
+    /**
+     * Decides whether an alert for key is reported, first closing every
+     * window that has ended by now.
+     * @param key The key the alert is about.
+     * @param now The time of the alert in seconds.
+     * @param line The alerting line, kept if the alert is suppressed.
+     * @param report Called as report(key, window) for each closed window
+     * that suppressed at least one alert.
+     * @return Returns true if the alert opens a window and is reported.
+     */
+    template <typename Report>
+    bool admit(const Key& key, uint32_t now, const std::string& line,
+            Report report) {
+        advance(now, report);
+        Window* w = state.find(key);
+        if (w != nullptr) {
+            w->suppressed++;
+            w->last = line;
+            total++;
+            return false;
+        }
+        if (state.size() >= maxKeys) {
+            makeRoom(report);
+        }
+        w = &state.insert(key);
+        w->opened = now;
+        w->suppressed = 0;
+        w->last.clear();
+        wheel.schedule(key, now);
+        return true;
+    }
+
+    /** Closes every window that has ended by now. */
+    template <typename Report>
+    void advance(uint32_t now, Report& report) {
+        newest = now > newest ? now : newest;
+        wheel.advance(now, [this, now, &report](const Key& key) {
+            close(key, now, report);
+        });
+    }
+
+    /** Closes every open window, e.g. at the end of the input. */
+    template <typename Report>
+    void flush(Report report) {
+        advance(newest + window + 1, report);
+    }
+
+    /** @return The number of alerts suppressed so far. */
+    uint64_t suppressed() const { return total; }
+
+    /** @return The window length in seconds. */
+    long length() const { return window; }
+
+private:
+    template <typename Report>
+    void close(const Key& key, uint32_t now, Report& report) {
+        const Window* w = state.find(key);
+        if (w != nullptr && static_cast<long>(w->opened) + window <= now) {
+            if (w->suppressed > 0) {
+                report(key, *w);
+            }
+            state.erase(key);
+        }
+    }
+
+    template <typename Report>
+    void makeRoom(Report& report) {
+        wheel.evictOldest([this, &report](const Key& key, size_t idx) {
+            const Window* w = state.find(key);
+            if (w != nullptr && w->opened % wheel.size() == idx) {
+                if (w->suppressed > 0) {
+                    report(key, *w);
+                }
+                state.erase(key);
+            }
+            return state.size() < maxKeys;
+        });
+    }
+
+    long window;
+    size_t maxKeys;
+    uint32_t newest = 0;
+    uint64_t total = 0;
+    FlatMap<Key, Window, Hash> state;
+    TimingWheel<Key> wheel;
+};
+
+#endif  // ALERT_SUPPRESSOR_H
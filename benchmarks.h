@@ -0,0 +1,1105 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * Built-in benchmarks run with "--bench <name>". Each benchmark builds a
+ * synthetic sshd workload in memory first so that only the code being
+ * measured is timed.
+ */
+
+#ifndef BENCHMARKS_H
+#define BENCHMARKS_H
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <ostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "line_scanner.h"
+#include "lookup_store.h"
+#include "rate_tracker.h"
+#include "count_min.h"
+#include "frequency_rule.h"
+#include "ingest.h"
+#include "merge.h"
+#include "uring_reader.h"
+#include "alert_queue.h"
+
+/** One already-parsed login attempt used to drive the benchmarks. */
+struct SyntheticEvent {
+    std::string user;
+    uint32_t ip;
+    uint32_t time;
+    bool failed;
+};
+
+/**
+ * Generates a credential-stuffing flood: a handful of attackers retrying
+ * every second or two, hidden among a very large number of keys that
+ * appear only a few times.
+ * @param count The number of events to generate.
+ * @param keys The number of distinct background keys.
+ * @param attackers The number of keys that retry rapidly.
+ * @param perSecond The number of events per second of log time.
+ * @param seed The random seed, so every run sees the same workload.
+ */
+inline std::vector<SyntheticEvent> makeSyntheticEvents(size_t count,
+        size_t keys, size_t attackers, size_t perSecond, unsigned seed = 42) {
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<size_t> background(0, keys - 1);
+    std::uniform_int_distribution<size_t> attacker(0, attackers - 1);
+    std::uniform_int_distribution<int> percent(0, 99);
+    std::vector<SyntheticEvent> events;
+    events.reserve(count);
+    const uint32_t start = 1630249261;  // Aug 29 11:01:01 2021
+    for (size_t i = 0; i < count; i++) {
+        bool attack = attackers > 0 && percent(rng) < 10;
+        size_t id = attack ? attacker(rng) : attackers + background(rng);
+        uint32_t ip = attack ? (0x2d010100u | (id & 0xff)) :
+            static_cast<uint32_t>(rng());
+        events.push_back({std::to_string(100000 + id), ip,
+                    start + static_cast<uint32_t>(i / perSecond),
+                    attack || percent(rng) < 70});
+    }
+    return events;
+}
+
+/**
+ * Formats a synthetic event as an sshd line in auth.log format, e.g.
+ * "Aug 29 11:01:01 ubuntu sshd[12345]: Failed password for ...".
+ */
+inline std::string syntheticLine(const SyntheticEvent& e) {
+    char stamp[32];
+    time_t t = e.time;
+    struct tm parts;
+    strftime(stamp, sizeof(stamp), "%b %d %H:%M:%S", localtime_r(&t, &parts));
+    std::string ip = std::to_string(e.ip >> 24) + "." +
+        std::to_string((e.ip >> 16) & 255) + "." +
+        std::to_string((e.ip >> 8) & 255) + "." + std::to_string(e.ip & 255);
+    return std::string(stamp) + " ubuntu sshd[" +
+        std::to_string(10000 + std::hash<std::string>()(e.user) % 90000) +
+        "]: " + (e.failed ? "Failed" : "Accepted") + " password for " +
+        e.user + " from " + ip + " port 22 ssh2";
+}
+
+/**
+ * Writes a reproducible auth.log workload: the synthetic sshd traffic of
+ * makeSyntheticEvents with a sudo or CRON line after every fourth sshd
+ * line, as real logs carry. It trains the profile-guided build and is
+ * what the build configurations are compared on.
+ * @param fileName The log file to be written.
+ * @param lines The number of sshd lines.
+ * @param seed The random seed; the same seed gives the same log.
+ */
+inline void writeSyntheticLog(const std::string& fileName, size_t lines,
+        unsigned seed) {
+    std::ofstream out(fileName);
+    size_t i = 0;
+    for (const auto& e : makeSyntheticEvents(lines, lines / 2 + 1, 100,
+                1000, seed)) {
+        const std::string line = syntheticLine(e);
+        out << line << '\n';
+        if (++i % 4 == 0) {
+            out << line.substr(0, 15) << (i % 8 ? " ubuntu sudo:   "
+                    "admin : TTY=pts/0 ; PWD=/root ; USER=root ; "
+                    "COMMAND=/usr/bin/tail /var/log/auth.log" :
+                    " ubuntu CRON[4242]: pam_unix(cron:session): "
+                    "session closed for user root") << '\n';
+        }
+    }
+    out.close();
+    if (!out) {
+        throw std::runtime_error("Error writing file " + fileName);
+    }
+}
+
+/** @return The seconds taken to run the supplied function once. */
+template <typename Func>
+double timeIt(Func func) {
+    auto start = std::chrono::steady_clock::now();
+    func();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+/**
+ * Compares the exact per-key window state with the Count-Min Sketch
+ * mode under a flood of one million distinct keys, reporting throughput,
+ * memory and how closely the approximate alerts match the exact ones.
+ */
+inline void benchCountMin(std::ostream& os) {
+    const size_t count = 2000000, keys = 1000000, attackers = 200;
+    auto events = makeSyntheticEvents(count, keys, attackers, 5000);
+    std::vector<char> exact(count), approx(count);
+    RateTracker<std::string> tracker(20, 3, SIZE_MAX);
+    size_t peakKeys = 0;
+    double exactSec = timeIt([&] {
+        for (size_t i = 0; i < count; i++) {
+            exact[i] = tracker.record(events[i].user, events[i].time);
+            peakKeys = std::max(peakKeys, tracker.size());
+        }
+    });
+    SketchRateRule rule(20, 3, 8 << 20, 1 << 16);
+    double approxSec = timeIt([&] {
+        for (size_t i = 0; i < count; i++) {
+            approx[i] = rule.record(events[i].user, events[i].time);
+        }
+    });
+    size_t tp = 0, fp = 0, fn = 0;
+    for (size_t i = 0; i < count; i++) {
+        tp += exact[i] && approx[i];
+        fp += !exact[i] && approx[i];
+        fn += exact[i] && !approx[i];
+    }
+    os << std::fixed << std::setprecision(2)
+       << "events: " << count << ", distinct keys: ~" << keys << "\n"
+       << "exact:  " << count / exactSec / 1e6 << " M events/s, peak keys "
+       << peakKeys << "\n"
+       << "sketch: " << count / approxSec / 1e6 << " M events/s, "
+       << rule.sketchBytes() / (1 << 20) << " MB sketch, "
+       << rule.promotions() << " promotions\n"
+       << "alerts: exact " << tp + fn << ", sketch " << tp + fp
+       << ", false positives " << fp << ", missed " << fn << "\n";
+}
+
+/** A latency histogram with fixed-width buckets, 10 ns up to 1 ms. */
+struct LatencyHistogram {
+    explicit LatencyHistogram(uint64_t bucketNs = 10, size_t count = 100000)
+        : width(bucketNs), buckets(count + 1, 0) {}
+
+    void add(uint64_t ns) {
+        buckets[std::min<uint64_t>(ns / width, buckets.size() - 1)]++;
+        total++;
+    }
+
+    /** @return The latency in ns below which the given fraction falls. */
+    uint64_t percentile(double fraction) const {
+        uint64_t seen = 0, want = fraction * total;
+        for (size_t i = 0; i < buckets.size(); i++) {
+            seen += buckets[i];
+            if (seen > want) {
+                return i * width;
+            }
+        }
+        return buckets.size() * width;
+    }
+
+    uint64_t width;
+    std::vector<uint64_t> buckets;
+    uint64_t total = 0;
+};
+
+/** Writes count random IPv4 addresses, one per line, into fileName. */
+inline void writeBanList(const std::string& fileName, size_t count,
+        unsigned seed) {
+    std::mt19937 rng(seed);
+    std::ofstream out(fileName);
+    for (size_t i = 0; i < count; i++) {
+        uint32_t ip = rng();
+        out << (ip >> 24) << '.' << ((ip >> 16) & 255) << '.'
+            << ((ip >> 8) & 255) << '.' << (ip & 255) << '\n';
+    }
+}
+
+/** The largest p99 line latency --bench reload accepts during a reload. */
+constexpr uint64_t kReloadP99LimitMs = 10;
+
+/**
+ * Feeds lines at a steady 50k lines/s, as a busy log source would,
+ * through a bounded queue to a thread that checks them against the
+ * lookups, while the inotify watcher replaces a 1M-entry ban list. A
+ * line that finds the queue full is dropped, so a detector stalled by
+ * the reload loses input. Reports the lines fed, checked and dropped,
+ * the reload time, and the latency from each line's arrival until it
+ * was checked, outside and during the reload.
+ * @throws std::runtime_error if a line was dropped, or if the p99
+ * latency during the reload exceeds kReloadP99LimitMs.
+ */
+inline void benchReload(std::ostream& os) {
+    using Clock = std::chrono::steady_clock;
+    char dirTemplate[] = "/tmp/lookup_benchXXXXXX";
+    const std::string dir = mkdtemp(dirTemplate);
+    const std::string banFile = dir + "/banned_ips.txt";
+    std::ofstream(dir + "/authorized_users.txt") << "apache\nmysql\n";
+    writeBanList(banFile, 1000000, 1);
+    LookupStore store([dir, banFile] {
+        return std::unique_ptr<Lookups>(new Lookups{
+                loadLookup(dir + "/authorized_users.txt"),
+                loadLookup(banFile)});
+    });
+    store.watch(dir, {"authorized_users.txt", "banned_ips.txt"});
+
+    std::vector<std::string> lines;
+    for (const auto& e : makeSyntheticEvents(100000, 50000, 100, 1000)) {
+        lines.push_back(syntheticLine(e));
+    }
+    struct Arrival {
+        size_t line = 0;
+        Clock::time_point at;
+    };
+    const size_t perMs = 50;
+    // Room for 100 ms of input, about what a socket buffer would hold
+    MpmcQueue<Arrival> queue(perMs * 100);
+    std::atomic<bool> stop{false}, feeding{true}, reloading{false};
+    uint64_t fed = 0, overflowed = 0, checked = 0, hits = 0;
+    LatencyHistogram steady(1000, 1000000), during(1000, 1000000);
+    std::thread feeder([&] {
+        Clock::time_point tick = Clock::now();
+        for (size_t i = 0; !stop.load();) {
+            for (size_t n = 0; n < perMs; n++) {
+                Arrival arrival;
+                arrival.line = i;
+                arrival.at = Clock::now();
+                i = (i + 1) % lines.size();
+                fed++;
+                overflowed += !queue.tryPush(arrival);
+            }
+            tick += std::chrono::milliseconds(1);
+            std::this_thread::sleep_until(tick);
+        }
+        feeding = false;
+    });
+    std::thread detector([&] {
+        LookupStore::Reader reader(store);
+        Arrival arrival;
+        for (;;) {
+            // Read before popping: once it is false, an empty queue is
+            // final
+            bool done = !feeding.load();
+            if (!queue.tryPop(arrival)) {
+                if (done) {
+                    break;
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                continue;
+            }
+            reader.quiescent();
+            const Lookups& lk = reader.get();
+            const std::string& line = lines[arrival.line];
+            hits += !containsKey(line, lk.authUser) &&
+                containsKey(line, lk.banIP);
+            checked++;
+            uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>
+                (Clock::now() - arrival.at).count();
+            (reloading.load() ? during : steady).add(ns);
+        }
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    writeBanList(banFile + ".new", 1000000, 2);
+    reloading = true;
+    auto start = Clock::now();
+    std::rename((banFile + ".new").c_str(), banFile.c_str());
+    const auto deadline = start + std::chrono::seconds(60);
+    while (store.reloads() == 0 && Clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::chrono::duration<double> reloadSec = Clock::now() - start;
+    reloading = false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    stop = true;
+    feeder.join();
+    detector.join();
+    store.stopWatching();
+    std::remove(banFile.c_str());
+    std::remove((dir + "/authorized_users.txt").c_str());
+    rmdir(dir.c_str());
+
+    const uint64_t p99 = during.percentile(0.99);
+    os << std::fixed << std::setprecision(2)
+       << "lines fed: " << fed << ", checked: " << checked
+       << ", dropped: " << fed - checked << " (" << overflowed
+       << " found the queue full), ban hits: " << hits << "\n"
+       << "reloads: " << store.reloads() << ", reload of 1M entries took "
+       << reloadSec.count() << " s\n"
+       << "latency outside reload: p50 " << steady.percentile(0.5) / 1e3
+       << " us, p99 " << steady.percentile(0.99) / 1e3 << " us\n"
+       << "latency during reload:  p50 " << during.percentile(0.5) / 1e3
+       << " us, p99 " << p99 / 1e3 << " us (" << during.total
+       << " lines, limit " << kReloadP99LimitMs << " ms)\n";
+    if (store.reloads() == 0) {
+        throw std::runtime_error("The ban list was never reloaded");
+    }
+    if (checked != fed) {
+        throw std::runtime_error("The reload dropped " +
+                std::to_string(fed - checked) + " lines");
+    }
+    if (p99 > kReloadP99LimitMs * 1000000) {
+        throw std::runtime_error("p99 latency during the reload exceeds " +
+                std::to_string(kReloadP99LimitMs) + " ms");
+    }
+}
+
+/**
+ * Compares the generic RingWindow with the FixedRingWindow<20, 3>
+ * specialization, first on rings indexed directly by key (isolating the
+ * comparison itself) and then through the complete UserRule objects
+ * that makeUserRule hands to process().
+ */
+inline void benchFixedRule(std::ostream& os) {
+    const size_t count = 20000000, keys = 4096;
+    auto events = makeSyntheticEvents(count, keys, 64, 1000);
+    std::vector<uint32_t> ids(count);
+    for (size_t i = 0; i < count; i++) {
+        ids[i] = std::stoul(events[i].user) % keys;
+    }
+    size_t genericHits = 0, fixedHits = 0;
+    std::vector<RingWindow> generic(keys);
+    double genericSec = timeIt([&] {
+        for (size_t i = 0; i < count; i++) {
+            genericHits += generic[ids[i]].record(events[i].time, 20, 3);
+        }
+    });
+    std::vector<FixedRingWindow<20, 3>> fixed(keys);
+    double fixedSec = timeIt([&] {
+        for (size_t i = 0; i < count; i++) {
+            fixedHits += fixed[ids[i]].record(events[i].time, 20, 3);
+        }
+    });
+    const size_t ruleCount = count / 4;
+    size_t ruleHits[2] = {0, 0};
+    double ruleSec[2];
+    std::unique_ptr<UserRule> rules[2] = {
+        std::unique_ptr<UserRule>(new TrackedUserRule<RingWindow>(20, 3,
+                    1 << 20, "generic")),
+        makeUserRule(20, 3, 1 << 20)};
+    for (int r = 0; r < 2; r++) {
+        ruleSec[r] = timeIt([&] {
+            for (size_t i = 0; i < ruleCount; i++) {
+                ruleHits[r] += rules[r]->record(events[i].user,
+                        events[i].time);
+            }
+        });
+    }
+    os << std::fixed << std::setprecision(1)
+       << "ring only (" << count << " events): generic "
+       << count / genericSec / 1e6 << " M/s, fixed "
+       << count / fixedSec / 1e6 << " M/s, speedup "
+       << std::setprecision(2) << genericSec / fixedSec << "x, hits "
+       << genericHits << "/" << fixedHits << "\n" << std::setprecision(1)
+       << "full rule (" << ruleCount << " events): generic "
+       << ruleCount / ruleSec[0] / 1e6 << " M/s, " << rules[1]->name()
+       << " " << ruleCount / ruleSec[1] / 1e6 << " M/s, speedup "
+       << std::setprecision(2) << ruleSec[0] / ruleSec[1] << "x, hits "
+       << ruleHits[0] << "/" << ruleHits[1] << "\n";
+}
+
+/**
+ * Measures line splitting and field location over ~100 MB of synthetic
+ * sshd text: std::getline plus find calls (the original loop) against
+ * scanLines with each block mask implementation this CPU supports.
+ */
+inline void benchScan(std::ostream& os) {
+    std::string text;
+    for (const auto& e : makeSyntheticEvents(1000000, 500000, 100, 1000)) {
+        text += syntheticLine(e);
+        text += '\n';
+    }
+    const double mb = text.size() / 1e6;
+    size_t baseline = 0;
+    double baseSec = timeIt([&] {
+        std::istringstream is(text);
+        for (std::string line; std::getline(is, line);) {
+            baseline += line.find("sshd") + line.find("Failed") +
+                line.find(" from ") + line.find(" port ");
+        }
+    });
+    os << std::fixed << std::setprecision(2) << "getline+find: "
+       << mb / baseSec / 1e3 << " GB/s\n";
+    std::vector<ScannerImpl> impls = {{"scalar", blockMaskScalar}};
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        impls.push_back({"sse4.2", blockMaskSse});
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        impls.push_back({"avx2", blockMaskAvx2});
+    }
+    std::vector<LineFields> fields;
+    fields.reserve(1100000);
+    for (const auto& impl : impls) {
+        fields.clear();
+        double sec = timeIt([&] {
+            scanLines(text.data(), text.size(), fields, impl.mask);
+        });
+        os << "scanLines " << impl.name << ": " << mb / sec / 1e3
+           << " GB/s (" << fields.size() << " lines)\n";
+    }
+    os << "selected at run time: " << bestScanner().name << "\n";
+}
+
+/** @return The resident set size of this process in MB. */
+inline double residentMB() {
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * sysconf(_SC_PAGESIZE) / 1048576.0;
+}
+
+/**
+ * Compares start-up time, memory and lookup speed of a 5M-entry ban list
+ * loaded from text into a LookupMap with the same list compiled into a
+ * memory-mapped image. The image's resident pages are page cache that
+ * other processes mapping the same file share.
+ */
+inline void benchImage(std::ostream& os) {
+    char dirTemplate[] = "/tmp/image_benchXXXXXX";
+    const std::string dir = mkdtemp(dirTemplate);
+    const std::string authFile = dir + "/authorized_users.txt";
+    const std::string banFile = dir + "/banned_ips.txt";
+    const std::string imageFile = dir + "/lookups.img";
+    const size_t entries = 5000000;
+    std::ofstream(authFile) << "apache\nmysql\n";
+    writeBanList(banFile, entries, 1);
+    std::vector<std::string> lines;
+    for (const auto& e : makeSyntheticEvents(200000, 100000, 100, 1000)) {
+        lines.push_back(syntheticLine(e));
+    }
+    size_t textHits = 0, imageHits = 0;
+    double before = residentMB(), textMB = 0, imageMB = 0;
+    double compileSec = timeIt([&] {
+        compileLookupImage(authFile, banFile, imageFile);
+    });
+    double textLoad = 0, textScan = 0;
+    {
+        LookupMap ban;
+        textLoad = timeIt([&] { ban = loadLookup(banFile); });
+        textMB = residentMB() - before;
+        textScan = timeIt([&] {
+            for (const auto& line : lines) {
+                textHits += containsKey(line, ban);
+            }
+        });
+    }
+    before = residentMB();
+    std::unique_ptr<LookupImage> image;
+    double imageOpen = timeIt([&] {
+        image.reset(new LookupImage(imageFile));
+    });
+    double imageScan = timeIt([&] {
+        for (const auto& line : lines) {
+            imageHits += containsKey(line, *image, kBanSection);
+        }
+    });
+    imageMB = residentMB() - before;
+    image.reset();
+    for (const auto& f : {authFile, banFile, imageFile}) {
+        std::remove(f.c_str());
+    }
+    rmdir(dir.c_str());
+
+    os << std::fixed << std::setprecision(3)
+       << "entries: " << entries << ", lines: " << lines.size() << "\n"
+       << "text:  load " << textLoad << " s, +" << textMB << " MB, scan "
+       << lines.size() / textScan / 1e6 << " M lines/s, hits " << textHits
+       << "\n"
+       << "image: compile " << compileSec << " s (offline), open "
+       << imageOpen * 1e3 << " ms, +" << imageMB << " MB shared, scan "
+       << lines.size() / imageScan / 1e6 << " M lines/s, hits "
+       << imageHits << "\n";
+}
+
+/**
+ * Checks lines against a 10M-entry ban list with and without the Bloom
+ * filter in front, at several filter sizes. One line in 100 comes from a
+ * banned address. The false-positive rate is measured over 1M addresses
+ * that are not banned.
+ */
+inline void benchBloom(std::ostream& os) {
+    const size_t entries = 10000000;
+    std::mt19937 rng(1);
+    auto format = [](uint32_t ip) {
+        return std::to_string(ip >> 24) + "." +
+            std::to_string((ip >> 16) & 255) + "." +
+            std::to_string((ip >> 8) & 255) + "." + std::to_string(ip & 255);
+    };
+    LookupMap auth = {{"apache", true}, {"mysql", true}};
+    LookupMap ban;
+    ban.reserve(entries);
+    std::vector<uint32_t> banned;
+    for (size_t i = 0; i < entries; i++) {
+        banned.push_back(rng());
+        ban[format(banned.back())] = true;
+    }
+    std::vector<std::string> lines;
+    auto events = makeSyntheticEvents(1000000, 500000, 100, 1000);
+    for (size_t i = 0; i < events.size(); i++) {
+        if (i % 100 == 0) {
+            events[i].ip = banned[rng() % entries];
+        }
+        lines.push_back(syntheticLine(events[i]));
+    }
+    std::vector<std::string> absent;
+    while (absent.size() < 1000000) {
+        std::string word = format(rng());
+        if (ban.find(word) == ban.end()) {
+            absent.push_back(word);
+        }
+    }
+    size_t exactHits = 0;
+    double exactSec = timeIt([&] {
+        for (const auto& line : lines) {
+            exactHits += !containsKey(line, auth) && containsKey(line, ban);
+        }
+    });
+    os << std::fixed << std::setprecision(3) << "entries: " << entries
+       << ", lines: " << lines.size() << "\n"
+       << "exact:            " << lines.size() / exactSec / 1e6
+       << " M lines/s, hits " << exactHits << "\n";
+    for (double bits : {8.0, 10.0, 16.0}) {
+        std::shared_ptr<const BlockedBloom> filter;
+        double buildSec = timeIt([&] {
+            filter = buildLookupFilter(auth, ban, bits);
+        });
+        size_t positives = 0;
+        for (const auto& word : absent) {
+            positives += filter->mayContain(wordHash(word.data(),
+                        word.size()));
+        }
+        size_t hits = 0;
+        double sec = timeIt([&] {
+            for (const auto& line : lines) {
+                hits += !containsKey(line, auth, *filter) &&
+                    containsKey(line, ban, *filter);
+            }
+        });
+        os << "filter " << std::setw(2) << static_cast<int>(bits)
+           << " bits/key: " << lines.size() / sec / 1e6 << " M lines/s ("
+           << exactSec / sec << "x), hits " << hits << ", "
+           << filter->bytes() / 1048576.0 << " MB, build " << buildSec
+           << " s, false positives " << 100.0 * positives / absent.size()
+           << "%, " << filter->probeName() << " probe\n";
+    }
+}
+
+/**
+ * Compares the exact user rule keyed by the PID string, as parsed from
+ * the line, with the same rule indexed by the numeric PID. 50k sshd
+ * processes are live at a time and new ones take PIDs in order, as the
+ * kernel hands them out, wrapping at kPidLimit. The resident growth of
+ * the PID index is the pages of the PID range the run covers; PIDs
+ * scattered over the whole range would touch all of it.
+ */
+inline void benchPid(std::ostream& os) {
+    const size_t count = 5000000, live = 50000;
+    std::mt19937 rng(7);
+    uint32_t next = 300000;
+    auto spawn = [&next] {
+        next = next + 1 < kPidLimit ? next + 1 : 300;
+        return next;
+    };
+    std::vector<uint32_t> pids(live);
+    for (auto& pid : pids) {
+        pid = spawn();
+    }
+    std::vector<uint32_t> pid(count), time(count);
+    std::vector<std::string> key(count);
+    for (size_t i = 0; i < count; i++) {
+        // Now and then a process ends and a new one starts
+        if (i % 16 == 0) {
+            pids[rng() % live] = spawn();
+        }
+        pid[i] = pids[rng() % live];
+        time[i] = 1630249261 + i / 5000;
+        key[i] = std::to_string(pid[i]);
+    }
+    for (bool fixed : {false, true}) {
+        auto rule = fixed ? makeUserRule(20, 3, 1 << 20) :
+            std::unique_ptr<UserRule>(new TrackedUserRule<RingWindow>(20,
+                        3, 1 << 20, "generic"));
+        size_t hits[2] = {0, 0};
+        double before = residentMB();
+        double stringSec = timeIt([&] {
+            for (size_t i = 0; i < count; i++) {
+                hits[0] += rule->record(key[i], time[i]);
+            }
+        });
+        double stringMB = residentMB() - before;
+        before = residentMB();
+        double pidSec = timeIt([&] {
+            for (size_t i = 0; i < count; i++) {
+                hits[1] += rule->recordPid(pid[i], time[i]);
+            }
+        });
+        os << std::fixed << std::setprecision(1) << rule->name()
+           << ": string key " << count / stringSec / 1e6 << " M/s (+"
+           << stringMB << " MB), PID index " << count / pidSec / 1e6
+           << " M/s (+" << residentMB() - before << " MB), speedup "
+           << std::setprecision(2) << stringSec / pidSec << "x, hits "
+           << hits[0] << "/" << hits[1] << "\n";
+    }
+}
+
+/**
+ * Measures the user frequency rule over 10M tracked users, where nearly
+ * every record() misses in cache, with the batch loop's prefetching at
+ * several distances. A 10k-user run checks that prefetching costs little
+ * when the state already fits in cache.
+ */
+inline void benchPrefetch(std::ostream& os) {
+    const size_t lookups = 10000000;
+    const std::vector<size_t> distances = {0, 2, 4, 8, 16, 32};
+    for (size_t users : {size_t(10000), size_t(10000000)}) {
+        std::vector<std::string> keys(users);
+        for (size_t i = 0; i < users; i++) {
+            keys[i] = std::to_string(100000000 + i);
+        }
+        std::unique_ptr<UserRule> rule = makeUserRule(20, 3, SIZE_MAX);
+        const uint32_t start = 1630249261;
+        // Insert every user first so the timed loops only probe
+        for (const auto& key : keys) {
+            rule->record(key, start);
+        }
+        std::mt19937 rng(7);
+        std::uniform_int_distribution<size_t> pick(0, users - 1);
+        // Keys are copied into the rows, as LineBatch holds them
+        std::vector<std::string> rows(lookups);
+        for (auto& row : rows) {
+            row = keys[pick(rng)];
+        }
+        os << users << " users, " << rule->name() << ":";
+        double baseSec = 0;
+        for (size_t ahead : distances) {
+            size_t hits = 0;
+            double sec = timeIt([&] {
+                for (size_t i = 0; i < lookups; i++) {
+                    if (ahead > 0 && i + ahead < lookups) {
+                        rule->prefetch(rows[i + ahead], start);
+                    }
+                    hits += rule->record(rows[i], start);
+                }
+            });
+            baseSec = ahead == 0 ? sec : baseSec;
+            os << std::fixed << std::setprecision(1) << " d=" << ahead
+               << " " << lookups / sec / 1e6 << " M/s";
+            if (ahead > 0) {
+                os << std::setprecision(2) << " (" << baseSec / sec << "x)";
+            }
+        }
+        os << "\n";
+    }
+}
+
+/**
+ * A stand-in log server for the ingestion benchmark. It accepts one
+ * connection on a loopback port and sends body as an HTTP response,
+ * optionally in small pieces separated by pauses to imitate a slow host.
+ */
+class StandInServer {
+public:
+    StandInServer(const std::string& body, size_t piece,
+            std::chrono::milliseconds pause) : acceptor(io,
+                boost::asio::ip::tcp::endpoint(
+                    boost::asio::ip::address_v4::loopback(), 0)) {
+        thread = std::thread([this, body, piece, pause] {
+            serve(body, piece, pause);
+        });
+    }
+
+    ~StandInServer() { thread.join(); }
+
+    std::string url() const {
+        return "http://127.0.0.1:" +
+            std::to_string(acceptor.local_endpoint().port()) + "/auth.log";
+    }
+
+private:
+    void serve(const std::string& body, size_t piece,
+            std::chrono::milliseconds pause) {
+        boost::asio::ip::tcp::socket socket(io);
+        acceptor.accept(socket);
+        boost::asio::streambuf request;
+        boost::asio::read_until(socket, request, "\r\n\r\n");
+        const std::string header = "HTTP/1.1 200 OK\r\nContent-Length: " +
+            std::to_string(body.size()) + "\r\n\r\n";
+        boost::asio::write(socket, boost::asio::buffer(header));
+        for (size_t pos = 0; pos < body.size(); pos += piece) {
+            boost::asio::write(socket, boost::asio::buffer(body.data() + pos,
+                        std::min(piece, body.size() - pos)));
+            std::this_thread::sleep_for(pause);
+        }
+        socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both);
+    }
+
+    boost::asio::io_context io;
+    boost::asio::ip::tcp::acceptor acceptor;
+    std::thread thread;
+};
+
+/**
+ * Reads three fast stand-in hosts (30 MB each) concurrently, first alone
+ * and then alongside a slow host that trickles its log out over about two
+ * seconds. Reports when each fast host finished, its throughput, and
+ * Jain's fairness index over the fast hosts; the fast hosts should not
+ * wait for the slow one.
+ */
+inline void benchIngest(std::ostream& os) {
+    std::string fast, slow;
+    for (const auto& e : makeSyntheticEvents(330000, 100000, 100, 1000)) {
+        fast += syntheticLine(e) + "\n";
+    }
+    for (const auto& e : makeSyntheticEvents(2000, 1000, 10, 100, 7)) {
+        slow += syntheticLine(e) + "\n";
+    }
+    for (bool withSlow : {false, true}) {
+        std::vector<std::unique_ptr<StandInServer>> servers;
+        for (int i = 0; i < 3; i++) {
+            servers.emplace_back(new StandInServer(fast, 1 << 20,
+                        std::chrono::milliseconds(0)));
+        }
+        if (withSlow) {
+            servers.emplace_back(new StandInServer(slow, 2000,
+                        std::chrono::milliseconds(20)));
+        }
+        std::vector<std::string> urls;
+        for (const auto& server : servers) {
+            urls.push_back(server->url());
+        }
+        std::vector<size_t> lineCount(urls.size(), 0);
+        std::vector<double> finished(urls.size(), 0);
+        std::vector<std::unique_ptr<LineBuffer>> buffers;
+        for (size_t i = 0; i < urls.size(); i++) {
+            buffers.emplace_back(new LineBuffer(bestScanner().mask));
+        }
+        auto start = std::chrono::steady_clock::now();
+        double total = timeIt([&] {
+            fetchSources(urls, 2, [&](size_t id, const char* data,
+                        size_t len, bool eof, const std::string&) {
+                eof ? buffers[id]->finish() : buffers[id]->append(data, len);
+                std::string line;
+                LineFields fields;
+                while (buffers[id]->next(line, fields)) {
+                    lineCount[id]++;
+                }
+                if (eof) {
+                    std::chrono::duration<double> at =
+                        std::chrono::steady_clock::now() - start;
+                    finished[id] = at.count();
+                }
+            });
+        });
+        servers.clear();
+        double sum = 0, squares = 0;
+        os << std::fixed << std::setprecision(3)
+           << (withSlow ? "3 fast + 1 slow host" : "3 fast hosts") << ": "
+           << "all done in " << total << " s\n";
+        for (size_t i = 0; i < urls.size(); i++) {
+            double rate = fast.size() / finished[i] / 1e6;
+            if (i < 3) {
+                sum += rate;
+                squares += rate * rate;
+            }
+            os << "  " << (i < 3 ? "fast" : "slow") << " host " << i
+               << ": " << lineCount[i] << " lines, done at " << finished[i]
+               << " s";
+            if (i < 3) {
+                os << std::setprecision(1) << " (" << rate << " MB/s)"
+                   << std::setprecision(3);
+            }
+            os << "\n";
+        }
+        os << "  fast-host fairness (Jain): " << sum * sum / (3 * squares)
+           << "\n";
+    }
+}
+
+/** Hands out the lines of an in-memory vector, for the merge benchmark. */
+struct VectorLines {
+    const std::vector<std::string>* lines;
+    size_t index = 0;
+
+    bool next(std::string& line, LineFields& fields) {
+        if (index == lines->size()) {
+            return false;
+        }
+        line = (*lines)[index++];
+        fields = {0, 0, -1, -1, -1, -1};
+        return true;
+    }
+
+    uint64_t offset() const { return index; }
+};
+
+/**
+ * Merges 2M time-ordered synthetic lines split across k streams, for k
+ * from 2 to 1024, reporting merged lines per second. With a loser tree
+ * the cost per line should grow with log k rather than k.
+ */
+inline void benchMerge(std::ostream& os) {
+    const size_t count = 2000000;
+    std::vector<std::string> all;
+    for (const auto& e : makeSyntheticEvents(count, 500000, 100, 2000)) {
+        all.push_back(syntheticLine(e));
+    }
+    // Day and time of day only; keeps mktime out of the measurement
+    auto clock = [](const std::string& stamp) {
+        auto num = [&stamp](size_t pos) {
+            return (stamp[pos] - '0') * 10 + (stamp[pos + 1] - '0');
+        };
+        return static_cast<uint32_t>(num(4) * 86400 + num(7) * 3600 +
+                num(10) * 60 + num(13));
+    };
+    for (size_t k : {2, 8, 64, 1024}) {
+        std::vector<std::vector<std::string>> parts(k);
+        for (size_t i = 0; i < count; i++) {
+            parts[i % k].push_back(all[i]);
+        }
+        std::vector<VectorLines> readers;
+        for (const auto& part : parts) {
+            readers.push_back({&part});
+        }
+        std::vector<VectorLines*> inputs;
+        for (auto& reader : readers) {
+            inputs.push_back(&reader);
+        }
+        std::vector<std::string> out;
+        out.reserve(count);
+        double sec = timeIt([&] {
+            MergedLines<VectorLines> lines(inputs, clock, 64);
+            std::string line;
+            LineFields fields;
+            while (lines.next(line, fields)) {
+                out.push_back(std::move(line));
+            }
+        });
+        // Synthetic stamps share one month, so they sort as text
+        size_t merged = out.size(), inversions = 0;
+        for (size_t i = 1; i < merged; i++) {
+            inversions += out[i].compare(0, 15, out[i - 1], 0, 15) < 0;
+        }
+        os << std::fixed << std::setprecision(2) << "k=" << k << ": "
+           << merged / sec / 1e6 << " M lines/s, " << merged
+           << " lines, out of order " << inversions << "\n";
+    }
+}
+
+/**
+ * Reads a 256MB synthetic log through each file backend and splits it
+ * into lines: ifstream with BlockLineReader, mmap, one pread per block,
+ * and io_uring with registered buffers and four reads in flight, both
+ * copying each block into a LineBuffer and, as FileLineReader does,
+ * scanning it in place. Every backend runs once with the file evicted
+ * from the page cache (cold) and once with it cached (warm).
+ */
+inline void benchRead(std::ostream& os) {
+    char dirTemplate[] = "/tmp/read_benchXXXXXX";
+    const std::string dir = mkdtemp(dirTemplate);
+    const std::string logFile = dir + "/auth.log";
+    std::string text;
+    for (const auto& e : makeSyntheticEvents(100000, 50000, 100, 1000)) {
+        text += syntheticLine(e) + "\n";
+    }
+    const size_t target = 256 << 20;
+    size_t bytes = 0;
+    {
+        std::ofstream out(logFile, std::ios::binary);
+        for (; bytes < target; bytes += text.size()) {
+            out << text;
+        }
+    }
+    const size_t blockSize = 1 << 20;
+    auto evict = [&logFile] {
+        int fd = open(logFile.c_str(), O_RDONLY);
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    };
+    auto drain = [](LineBuffer& buffer) {
+        std::string line;
+        LineFields fields;
+        size_t count = 0;
+        while (buffer.next(line, fields)) {
+            count++;
+        }
+        return count;
+    };
+    const std::map<std::string, std::function<size_t()>> backends = {
+        {"1 ifstream", [&] {
+            std::ifstream is(logFile, std::ios::binary);
+            BlockLineReader lines(is, bestScanner().mask, blockSize);
+            std::string line;
+            LineFields fields;
+            size_t count = 0;
+            while (lines.next(line, fields)) {
+                count++;
+            }
+            return count;
+        }},
+        {"2 mmap", [&] {
+            int fd = open(logFile.c_str(), O_RDONLY);
+            void* map = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            madvise(map, bytes, MADV_SEQUENTIAL);
+            const char* data = static_cast<const char*>(map);
+            LineBuffer buffer(bestScanner().mask);
+            size_t count = 0;
+            for (size_t at = 0; at < bytes; at += blockSize) {
+                buffer.append(data + at, std::min(blockSize, bytes - at));
+                count += drain(buffer);
+            }
+            munmap(map, bytes);
+            buffer.finish();
+            return count + drain(buffer);
+        }},
+        {"3 pread", [&] {
+            UringFileReader file(logFile, blockSize, 4, false);
+            LineBuffer buffer(bestScanner().mask);
+            size_t count = 0;
+            for (FileBlock block; file.next(block); file.release(block)) {
+                buffer.append(block.data, block.len);
+                count += drain(buffer);
+            }
+            buffer.finish();
+            return count + drain(buffer);
+        }},
+        {"4 io_uring", [&] {
+            UringFileReader file(logFile, blockSize, 4);
+            LineBuffer buffer(bestScanner().mask);
+            size_t count = 0;
+            for (FileBlock block; file.next(block); file.release(block)) {
+                buffer.append(block.data, block.len);
+                count += drain(buffer);
+            }
+            buffer.finish();
+            return count + drain(buffer);
+        }},
+        {"5 io_uring in place", [&] {
+            FileLineReader lines(logFile, bestScanner().mask, blockSize);
+            std::string line;
+            LineFields fields;
+            size_t count = 0;
+            while (lines.next(line, fields)) {
+                count++;
+            }
+            return count;
+        }},
+    };
+    os << "file: " << bytes / (1 << 20) << " MB, backend "
+       << UringFileReader(logFile).backend() << " available\n";
+    for (const auto& backend : backends) {
+        for (bool cold : {true, false}) {
+            if (cold) {
+                evict();
+            }
+            size_t count = 0;
+            double sec = timeIt([&] { count = backend.second(); });
+            os << std::fixed << std::setprecision(2)
+               << backend.first.substr(2) << (cold ? " cold: " : " warm: ")
+               << bytes / sec / 1e9 << " GB/s, " << count << " lines\n";
+        }
+    }
+    std::remove(logFile.c_str());
+    rmdir(dir.c_str());
+}
+
+/** Counts alerts and throws them away; measures the queue alone. */
+class NullSink : public AlertSink {
+public:
+    void write(const AlertRecord& alert) override {
+        bytes += alert.line.size();
+    }
+    std::string name() const override { return "null"; }
+    size_t bytes = 0;
+};
+
+/**
+ * Publishes 2M alerts from 1 to 16 producer threads through one sink
+ * channel whose queue holds 16k alerts, reporting alerts per second and
+ * how many each backpressure policy dropped. The sink discards alerts,
+ * so the producers and the queue are what is measured.
+ */
+inline void benchAlerts(std::ostream& os) {
+    const size_t total = 2000000;
+    const std::string line = syntheticLine(makeSyntheticEvents(1, 1, 1,
+                1)[0]);
+    os << "cores: " << std::thread::hardware_concurrency() << "\n";
+    const std::vector<std::pair<std::string, Backpressure>> policies = {
+        {"block", Backpressure::block},
+        {"drop-oldest", Backpressure::dropOldest},
+        {"sample", Backpressure::sample},
+    };
+    for (const auto& policy : policies) {
+        for (size_t producers : {1, 2, 4, 8, 16}) {
+            uint64_t written = 0, dropped = 0;
+            double sec = timeIt([&] {
+                AlertChannel channel(std::unique_ptr<AlertSink>(
+                            new NullSink()), 1 << 14, policy.second);
+                std::vector<std::thread> threads;
+                for (size_t p = 0; p < producers; p++) {
+                    threads.emplace_back([&channel, &line, total,
+                                producers, p] {
+                        for (size_t i = p; i < total; i += producers) {
+                            channel.publish({static_cast<uint32_t>(i), 2,
+                                        line});
+                        }
+                    });
+                }
+                for (auto& t : threads) {
+                    t.join();
+                }
+                channel.drain();
+                written = channel.written();
+                dropped = channel.drops();
+            });
+            os << std::fixed << std::setprecision(2) << policy.first
+               << " producers=" << producers << ": " << total / sec / 1e6
+               << " M alerts/s, written " << written << ", dropped "
+               << dropped << "\n";
+        }
+    }
+}
+
+/**
+ * Runs the named benchmark and prints its report.
+ * @param name The benchmark to run, or anything else to list them.
+ * @param os The stream the report is written to.
+ * @return Returns 0 on success, and 1 if the name was not recognized or
+ * the benchmark's own check failed.
+ */
+inline int runBenchmark(const std::string& name, std::ostream& os) {
+    const std::map<std::string, std::function<void(std::ostream&)>> benches
+        = {
+        {"alerts", benchAlerts},
+        {"bloom", benchBloom},
+        {"cms", benchCountMin},
+        {"fixed", benchFixedRule},
+        {"image", benchImage},
+        {"ingest", benchIngest},
+        {"merge", benchMerge},
+        {"pid", benchPid},
+        {"prefetch", benchPrefetch},
+        {"read", benchRead},
+        {"reload", benchReload},
+        {"scan", benchScan},
+    };
+    auto it = benches.find(name);
+    if (it == benches.end()) {
+        os << "Unknown benchmark " << name << ". Available:";
+        for (const auto& entry : benches) {
+            os << " " << entry.first;
+        }
+        os << "\n";
+        return 1;
+    }
+    try {
+        it->second(os);
+    } catch (const std::runtime_error& e) {
+        os << "Benchmark " << name << " failed: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+#endif  // BENCHMARKS_H
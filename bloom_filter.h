@@ -0,0 +1,132 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * A blocked Bloom filter placed in front of the exact lookups.
+ *
+ * Almost every word of almost every line is in neither lookup, yet each
+ * word used to cost a probe of a large hash table. The filter answers
+ * "certainly absent" for most of them from a single cache line. Each key
+ * selects one 64-byte block by its hash, and sets 8 bits in it, one in
+ * each of eight 32-bit lanes; a hash bit per lane picks whether that
+ * lane's bit goes in the first or the second half of the block. With
+ * AVX2 a probe computes all 8 bit positions with one multiply and one
+ * variable shift and tests both halves with two vptest instructions; a
+ * scalar loop does the same elsewhere. The layout follows the split
+ * block Bloom filters of Impala and Parquet, widened to a cache line.
+ */
+
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+#include <immintrin.h>
+#include <stdlib.h>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+
+class BlockedBloom {
+public:
+    /**
+     * @param keys The number of keys that will be added.
+     * @param bitsPerKey The filter size; 10 bits per key gives roughly a
+     * 1% false-positive rate.
+     */
+    explicit BlockedBloom(size_t keys, double bitsPerKey = 10) {
+        blocks = static_cast<size_t>(keys * bitsPerKey / 512) + 1;
+        void* p = nullptr;
+        if (posix_memalign(&p, 64, blocks * sizeof(Block)) != 0) {
+            throw std::bad_alloc();
+        }
+        std::memset(p, 0, blocks * sizeof(Block));
+        data.reset(static_cast<Block*>(p));
+        __builtin_cpu_init();
+        probe = __builtin_cpu_supports("avx2") ? probeAvx2 : probeScalar;
+    }
+
+    /** Adds a key by its 64-bit hash. */
+    void add(uint64_t hash) {
+        Block& block = data[blockOf(hash)];
+        const uint32_t key = hash;
+        const uint32_t upper = hash >> 24;
+        for (int i = 0; i < 8; i++) {
+            block.words[i + 8 * ((upper >> i) & 1)] |= bit(key, i);
+        }
+    }
+
+    /** @return Returns false only if the key was certainly not added. */
+    bool mayContain(uint64_t hash) const {
+        return probe(data[blockOf(hash)], hash);
+    }
+
+    /** @return The size of the filter in bytes. */
+    size_t bytes() const { return blocks * sizeof(Block); }
+
+    /** @return "avx2" or "scalar", whichever probe is in use. */
+    const char* probeName() const {
+        return probe == probeAvx2 ? "avx2" : "scalar";
+    }
+
+private:
+    struct alignas(64) Block {
+        uint32_t words[16];
+    };
+
+    struct Free {
+        void operator()(Block* p) const { free(p); }
+    };
+
+    /** Odd constants that spread one key over the eight lanes. */
+    static constexpr uint32_t kSalt[8] = {0x47b6137bU, 0x44974d91U,
+        0x8824ad5bU, 0xa2b7289dU, 0x705495c7U, 0x2df1424bU, 0x9efc4947U,
+        0x5c6bfb31U};
+
+    static uint32_t bit(uint32_t key, int lane) {
+        return 1U << ((key * kSalt[lane]) >> 27);
+    }
+
+    /** Maps the high half of the hash onto the blocks without a divide. */
+    size_t blockOf(uint64_t hash) const {
+        return ((hash >> 32) * blocks) >> 32;
+    }
+
+    static bool probeScalar(const Block& block, uint64_t hash) {
+        const uint32_t key = hash;
+        const uint32_t upper = hash >> 24;
+        for (int i = 0; i < 8; i++) {
+            uint32_t word = block.words[i + 8 * ((upper >> i) & 1)];
+            if ((word & bit(key, i)) == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    __attribute__((target("avx2")))
+    static bool probeAvx2(const Block& block, uint64_t hash) {
+        const __m256i salt = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(kSalt));
+        __m256i shift = _mm256_srli_epi32(_mm256_mullo_epi32(
+                    _mm256_set1_epi32(static_cast<uint32_t>(hash)), salt),
+                27);
+        __m256i bits = _mm256_sllv_epi32(_mm256_set1_epi32(1), shift);
+        // Lane i goes to the second half when bit i of upper is set
+        const __m256i laneBit = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64,
+                128);
+        __m256i upper = _mm256_set1_epi32(static_cast<uint32_t>(hash >> 24));
+        __m256i high = _mm256_cmpeq_epi32(_mm256_and_si256(upper, laneBit),
+                laneBit);
+        const __m256i* words = reinterpret_cast<const __m256i*>(block.words);
+        return _mm256_testc_si256(_mm256_load_si256(words),
+                _mm256_andnot_si256(high, bits)) &&
+            _mm256_testc_si256(_mm256_load_si256(words + 1),
+                _mm256_and_si256(high, bits));
+    }
+
+    size_t blocks = 0;
+    std::unique_ptr<Block[], Free> data;
+    bool (*probe)(const Block&, uint64_t) = probeScalar;
+};
+
+constexpr uint32_t BlockedBloom::kSalt[8];
+
+#endif  // BLOOM_FILTER_H
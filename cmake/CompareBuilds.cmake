@@ -0,0 +1,80 @@
+# Copyright [2021] <Copyright Strauchler>
+#
+# Times every build configuration on the same synthetic workload (run
+# with cmake -P; see CMakeLists.txt). The workload uses another seed
+# than the PGO training run, so the profiled build is not measured on
+# the data it was trained on. Every configuration must print the same
+# output; the fastest of RUNS runs is reported with its speedup over the
+# first configuration.
+#
+# BUILDS      A list of name=binary pairs; the first is the baseline.
+# LOOKUP_DIR  Where authorized_users.txt and banned_ips.txt live.
+# WORK_DIR    Where the workload and the outputs go.
+# LINES       sshd lines in the workload.
+# RUNS        Runs per configuration.
+
+foreach(var BUILDS LOOKUP_DIR WORK_DIR LINES RUNS)
+    if(NOT DEFINED ${var})
+        message(FATAL_ERROR "CompareBuilds.cmake needs -D${var}=...")
+    endif()
+endforeach()
+
+set(ENV{TZ} UTC)
+
+# Formats a count of thousandths as a decimal, e.g. 1234 as "1.234"
+function(format_thousandths out value)
+    math(EXPR whole "${value} / 1000")
+    math(EXPR frac "${value} % 1000 + 1000")
+    string(SUBSTRING ${frac} 1 3 frac)
+    set(${out} "${whole}.${frac}" PARENT_SCOPE)
+endfunction()
+
+# Sets out to the current time in microseconds
+function(now_us out)
+    string(TIMESTAMP stamp "%s%f")
+    set(${out} ${stamp} PARENT_SCOPE)
+endfunction()
+
+file(MAKE_DIRECTORY ${WORK_DIR})
+set(log ${WORK_DIR}/compare.log)
+list(GET BUILDS 0 first)
+string(REGEX REPLACE "^[^=]*=" "" first_binary "${first}")
+execute_process(COMMAND ${first_binary} --synthesize ${log} ${LINES} 2
+    COMMAND_ERROR_IS_FATAL ANY)
+
+message(STATUS "${LINES} sshd lines, fastest of ${RUNS} runs")
+unset(baseline)
+unset(expected)
+foreach(build ${BUILDS})
+    string(REGEX REPLACE "=.*$" "" name "${build}")
+    string(REGEX REPLACE "^[^=]*=" "" binary "${build}")
+    set(best 0)
+    foreach(run RANGE 1 ${RUNS})
+        now_us(start)
+        execute_process(COMMAND ${binary} ${log}
+            WORKING_DIRECTORY ${LOOKUP_DIR}
+            OUTPUT_FILE ${WORK_DIR}/${name}.out
+            COMMAND_ERROR_IS_FATAL ANY)
+        now_us(end)
+        math(EXPR elapsed "${end} - ${start}")
+        if(best EQUAL 0 OR elapsed LESS best)
+            set(best ${elapsed})
+        endif()
+    endforeach()
+    file(SHA256 ${WORK_DIR}/${name}.out digest)
+    if(NOT DEFINED expected)
+        set(expected ${digest})
+        set(baseline ${best})
+    elseif(NOT digest STREQUAL expected)
+        message(FATAL_ERROR "${name} printed different output; compare "
+            "${WORK_DIR}/${name}.out with the first build's")
+    endif()
+    math(EXPR ms "${best} / 1000")
+    math(EXPR rate "${LINES} * 1000 / ${best}")
+    math(EXPR speedup "${baseline} * 1000 / ${best}")
+    format_thousandths(seconds ${ms})
+    format_thousandths(rate ${rate})
+    format_thousandths(speedup ${speedup})
+    message(STATUS "${name}: ${seconds} s, ${rate} M sshd lines/s, "
+        "${speedup}x")
+endforeach()
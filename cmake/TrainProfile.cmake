@@ -0,0 +1,48 @@
+# Copyright [2021] <Copyright Strauchler>
+#
+# Records the profile for the PGO build (run with cmake -P; see
+# CMakeLists.txt). The instrumented detector is run over a synthetic
+# workload in the modes production uses most, writing the profile the
+# second stage reads.
+#
+# DETECTOR     The instrumented binary.
+# SYNTHESIZER  A normal binary, used to write the workload.
+# PROFILE      The profile both stages name; written by DETECTOR.
+# LOOKUP_DIR   Where authorized_users.txt and banned_ips.txt live.
+# WORK_DIR     Where the workload and the training output go.
+# LINES        sshd lines in the workload.
+# STAMP        Touched once the profile is in place.
+
+foreach(var DETECTOR SYNTHESIZER PROFILE LOOKUP_DIR WORK_DIR LINES STAMP)
+    if(NOT DEFINED ${var})
+        message(FATAL_ERROR "TrainProfile.cmake needs -D${var}=...")
+    endif()
+endforeach()
+
+# The workload's timestamps are formatted in local time
+set(ENV{TZ} UTC)
+
+# Counts from an earlier build of the source would be merged in
+file(REMOVE ${PROFILE})
+
+file(MAKE_DIRECTORY ${WORK_DIR})
+set(log ${WORK_DIR}/train.log)
+execute_process(COMMAND ${SYNTHESIZER} --synthesize ${log} ${LINES} 1
+    COMMAND_ERROR_IS_FATAL ANY)
+
+set(run 0)
+foreach(mode "" "--time-merge;${log}"
+        "--ring-frequency;--suppress;60;--learn-bans;300"
+        "--source-rules;--spray;--top;10" "--lateness;5")
+    math(EXPR run "${run} + 1")
+    execute_process(COMMAND ${DETECTOR} ${mode} ${log}
+        WORKING_DIRECTORY ${LOOKUP_DIR}
+        OUTPUT_FILE ${WORK_DIR}/train-${run}.out
+        COMMAND_ERROR_IS_FATAL ANY)
+endforeach()
+
+if(NOT EXISTS ${PROFILE})
+    message(FATAL_ERROR "The training runs wrote no profile to "
+        "${PROFILE}")
+endif()
+file(TOUCH ${STAMP})
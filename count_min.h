@@ -0,0 +1,242 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * A windowed Count-Min Sketch for estimating how many attempts each key
+ * made during the last few seconds in a fixed amount of memory.
+ *
+ * The window is split into one sub-sketch per second of 8-bit counters
+ * (a key rarely makes 255 attempts in one second); the rare counter that
+ * fills up carries the rest of its second in a small overflow table. A
+ * running total sketch holds the sum of all live sub-sketches so that an
+ * estimate costs one read per row, and when a second falls out of the
+ * window its sub-sketch and overflow are subtracted from the total and
+ * cleared. Estimates never undercount; they can overcount when keys
+ * collide in every row.
+ */
+
+#ifndef COUNT_MIN_H
+#define COUNT_MIN_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "rate_tracker.h"
+
+class WindowedCountMin {
+public:
+    /**
+     * @param window The length of the sliding window in seconds.
+     * @param memoryBytes The memory budget for all counters.
+     * @param depth The number of hash rows (independent estimates).
+     */
+    WindowedCountMin(long window, size_t memoryBytes, int depth = 4) :
+        slots(window > 0 ? window : 1), depth(depth > 0 ? depth : 1) {
+        size_t perColumn = this->depth * (slots * sizeof(uint8_t) +
+                sizeof(uint32_t));
+        width = std::max<size_t>(memoryBytes / perColumn, 1);
+        sub.assign(slots * this->depth * width, 0);
+        total.assign(this->depth * width, 0);
+        overflow.resize(slots);
+    }
+
+    /**
+     * Counts one attempt for key at time now.
+     * @return The estimated number of attempts by key in the window,
+     * including this one.
+     */
+    uint32_t add(const std::string& key, uint32_t now) {
+        rotate(now);
+        if (now + slots <= current) {
+            return estimate(key);  // Too old to fall inside the window
+        }
+        uint64_t h = hash(key);
+        uint8_t* slot = &sub[(now % slots) * depth * width];
+        uint32_t best = UINT32_MAX;
+        for (size_t row = 0; row < depth; row++) {
+            size_t idx = row * width + column(h, row);
+            if (slot[idx] != UINT8_MAX) {
+                slot[idx]++;
+            } else {
+                overflow[now % slots][idx]++;
+            }
+            total[idx]++;
+            best = std::min(best, total[idx]);
+        }
+        return best;
+    }
+
+    /** Starts loading the counters that add(key, now) will update. */
+    void prefetch(const std::string& key, uint32_t now) const {
+        uint64_t h = hash(key);
+        const uint8_t* slot = &sub[(now % slots) * depth * width];
+        for (size_t row = 0; row < depth; row++) {
+            size_t idx = row * width + column(h, row);
+            __builtin_prefetch(slot + idx, 1);
+            __builtin_prefetch(&total[idx], 1);
+        }
+    }
+
+    /** @return The estimated number of attempts by key in the window. */
+    uint32_t estimate(const std::string& key) const {
+        uint64_t h = hash(key);
+        uint32_t best = UINT32_MAX;
+        for (size_t row = 0; row < depth; row++) {
+            best = std::min(best, total[row * width + column(h, row)]);
+        }
+        return best;
+    }
+
+    /**
+     * Computes a tighter estimate by taking the minimum over rows for
+     * each second separately. This costs one read per row per second, so
+     * it is only used to confirm keys whose cheap estimate crossed a
+     * threshold.
+     * @return Estimated attempts per second, oldest second first. Entry i
+     * belongs to second current - (window - 1) + i.
+     */
+    std::vector<uint32_t> perSecond(const std::string& key) const {
+        uint64_t h = hash(key);
+        std::vector<uint32_t> counts(slots, 0);
+        for (size_t i = 0; i < slots; i++) {
+            uint32_t t = current - (slots - 1) + i;
+            const uint8_t* slot = &sub[(t % slots) * depth * width];
+            const auto& extra = overflow[t % slots];
+            uint32_t best = UINT32_MAX;
+            for (size_t row = 0; row < depth; row++) {
+                size_t idx = row * width + column(h, row);
+                uint32_t count = slot[idx];
+                if (count == UINT8_MAX && !extra.empty()) {
+                    auto it = extra.find(idx);
+                    count += it == extra.end() ? 0 : it->second;
+                }
+                best = std::min(best, count);
+            }
+            counts[i] = best;
+        }
+        return counts;
+    }
+
+    /** @return The most recent second that has been counted. */
+    uint32_t now() const { return current; }
+
+    /** @return The bytes used by the counters. */
+    size_t memoryBytes() const {
+        return sub.size() * sizeof(uint8_t) +
+            total.size() * sizeof(uint32_t);
+    }
+
+private:
+    /** Clears every second that has fallen out of the window. */
+    void rotate(uint32_t now) {
+        if (current == 0) {
+            current = now;
+            return;
+        }
+        if (now <= current) {
+            return;
+        }
+        uint32_t from = (now - current > slots) ? now - slots : current;
+        for (uint32_t t = from + 1; t <= now; t++) {
+            uint8_t* slot = &sub[(t % slots) * depth * width];
+            for (size_t i = 0; i < depth * width; i++) {
+                total[i] -= slot[i];
+            }
+            std::fill(slot, slot + depth * width, 0);
+            for (const auto& extra : overflow[t % slots]) {
+                total[extra.first] -= extra.second;
+            }
+            overflow[t % slots].clear();
+        }
+        current = now;
+    }
+
+    static uint64_t hash(const std::string& key) {
+        // Mix the standard hash so both halves are usable as row seeds
+        uint64_t h = std::hash<std::string>()(key);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    size_t column(uint64_t h, size_t row) const {
+        // Kirsch-Mitzenmacher: row i uses h1 + i * h2, then the 32-bit
+        // result is scaled into [0, width) without a division
+        uint32_t h1 = h, h2 = (h >> 32) | 1;
+        uint32_t mixed = h1 + row * h2;
+        return (static_cast<uint64_t>(mixed) * width) >> 32;
+    }
+
+    size_t slots;
+    size_t depth;
+    size_t width;
+    std::vector<uint8_t> sub;
+    std::vector<uint32_t> total;
+    // Per second: attempts past UINT8_MAX, by counter index
+    std::vector<std::unordered_map<size_t, uint32_t>> overflow;
+    uint32_t current = 0;
+};
+
+/**
+ * The frequency rule backed by a WindowedCountMin. Every attempt is
+ * counted in the sketch; a key whose estimate exceeds the threshold is
+ * promoted into exact window state, seeded from the sketch's per-second
+ * estimates, and all later attempts by a promoted key are decided exactly.
+ * Memory is the sketch budget plus at most maxConfirmed exact entries.
+ */
+class SketchRateRule {
+public:
+    SketchRateRule(long window, int threshold, size_t sketchBytes,
+            size_t maxConfirmed) :
+        sketch(window, sketchBytes), confirmed(window, threshold,
+                maxConfirmed), threshold(threshold) {}
+
+    /**
+     * Records an attempt for key.
+     * @return Returns true if key made more than threshold attempts
+     * inside the window.
+     */
+    bool record(const std::string& key, uint32_t now) {
+        if (confirmed.contains(key)) {
+            return confirmed.record(key, now);
+        }
+        if (sketch.add(key, now) <= static_cast<uint32_t>(threshold)) {
+            return false;
+        }
+        // Replay the per-second estimates into exact state; the last
+        // record call includes this attempt.
+        std::vector<uint32_t> counts = sketch.perSecond(key);
+        uint32_t first = sketch.now() - (counts.size() - 1);
+        bool hit = false;
+        for (size_t i = 0; i < counts.size(); i++) {
+            uint32_t n = std::min<uint32_t>(counts[i], kMaxRing);
+            for (uint32_t c = 0; c < n; c++) {
+                hit = confirmed.record(key, first + i);
+            }
+        }
+        promoted++;
+        return hit;
+    }
+
+    /** Starts loading the sketch counters that record() will update. */
+    void prefetch(const std::string& key, uint32_t now) const {
+        sketch.prefetch(key, now);
+    }
+
+    /** @return The number of keys that were promoted to exact state. */
+    size_t promotions() const { return promoted; }
+
+    /** @return The bytes used by the sketch counters. */
+    size_t sketchBytes() const { return sketch.memoryBytes(); }
+
+private:
+    WindowedCountMin sketch;
+    RateTracker<std::string> confirmed;
+    int threshold;
+    size_t promoted = 0;
+};
+
+#endif  // COUNT_MIN_H
@@ -0,0 +1,367 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * A compact columnar archive of parsed sshd events, so that months of
+ * logs can be kept cheaply and replayed through the detector without
+ * scanning and parsing their text again.
+ *
+ * Events are written in blocks. Each block stores its event count, the
+ * smallest and largest event time, and one byte string per column:
+ *
+ *   time     zigzag varint deltas from the previous event's time
+ *   pid      varint id into the string dictionary ("sshd[NNNNN]" key)
+ *   account  varint id into the string dictionary; 0 for none
+ *   address  varint id into the address dictionary; 0 for none
+ *   outcome  two bits per event (other, failed, accepted)
+ *
+ * The string and address dictionaries follow the last block, and a fixed
+ * footer at the end of the file locates them. A reader maps the file,
+ * loads the dictionaries and decodes one block at a time; blocks whose
+ * time range lies outside the requested range are skipped using their
+ * min/max stats without decoding any column.
+ */
+
+#ifndef EVENT_ARCHIVE_H
+#define EVENT_ARCHIVE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "flat_map.h"
+#include "varint.h"
+
+constexpr char kArchiveMagic[8] = {'H', 'D', 'E', 'V', 'T', 'A', 'R', 'C'};
+constexpr uint32_t kArchiveVersion = 1;
+
+/** The columns of a block, in file order. */
+enum ArchiveColumn {
+    kTimeColumn, kPidColumn, kAccountColumn, kAddressColumn,
+    kOutcomeColumn, kArchiveColumns
+};
+
+/** The outcome of an attempt, as stored in the outcome column. */
+enum ArchiveOutcome { kOutcomeOther = 0, kOutcomeFailed = 1,
+    kOutcomeAccepted = 2 };
+
+/** Precedes the columns of every block. */
+struct ArchiveBlockHeader {
+    uint32_t count;
+    uint32_t minTime;
+    uint32_t maxTime;
+    uint32_t columnBytes[kArchiveColumns];
+};
+
+/** The fixed footer at the end of every archive. */
+struct ArchiveFooter {
+    uint64_t blockCount;
+    uint64_t eventCount;
+    uint64_t blocksEnd;     // Offset of the string dictionary
+    uint64_t stringCount;   // Varint length followed by the bytes
+    uint64_t addressesOffset;
+    uint64_t addressCount;  // uint32_t addresses
+    uint32_t version;
+    char magic[8];
+};
+
+/** Appends events to an archive; call close() to finish it. */
+class ArchiveWriter {
+public:
+    /**
+     * @param fileName The archive to be created or replaced by close().
+     * @param blockSize The number of events per block.
+     */
+    explicit ArchiveWriter(const std::string& fileName,
+            uint32_t blockSize = 1 << 16) : fileName(fileName),
+        blockSize(std::max(blockSize, 1u)), os(fileName + ".tmp",
+                std::ios::binary) {
+        if (!os.good()) {
+            throw std::runtime_error("Error opening file " + fileName +
+                    ".tmp");
+        }
+        // Id 0 stands for an absent account or address
+        strings.push_back("");
+        addresses.push_back(0);
+    }
+
+    /**
+     * Adds one event.
+     * @param time The event time in seconds.
+     * @param pid The sshd process key of the line.
+     * @param account The account named by the line, or "".
+     * @param ip The source address; ignored unless hasIP is set.
+     * @param outcome One of the ArchiveOutcome values.
+     */
+    void add(uint32_t time, const std::string& pid,
+            const std::string& account, uint32_t ip, bool hasIP,
+            uint8_t outcome) {
+        if (count == 0) {
+            minTime = maxTime = lastTime = time;
+            putVarint(cols[kTimeColumn], time);
+        } else {
+            minTime = std::min(minTime, time);
+            maxTime = std::max(maxTime, time);
+            putVarint(cols[kTimeColumn],
+                    zigzag(static_cast<int64_t>(time) - lastTime));
+            lastTime = time;
+        }
+        putVarint(cols[kPidColumn], stringId(pid));
+        putVarint(cols[kAccountColumn], account.empty() ? 0 :
+                stringId(account));
+        putVarint(cols[kAddressColumn], hasIP ? addressId(ip) : 0);
+        if (count % 4 == 0) {
+            cols[kOutcomeColumn].push_back(0);
+        }
+        cols[kOutcomeColumn].back() |= (outcome & 3) << (2 * (count % 4));
+        events++;
+        if (++count == blockSize) {
+            flushBlock();
+        }
+    }
+
+    /** @return The number of events added so far. */
+    uint64_t size() const { return events; }
+
+    /**
+     * Writes the last block, the dictionaries and the footer, and renames
+     * the archive into place.
+     * @return The size of the archive in bytes.
+     */
+    uint64_t close() {
+        flushBlock();
+        ArchiveFooter footer = {};
+        footer.blockCount = blocks;
+        footer.eventCount = events;
+        footer.blocksEnd = os.tellp();
+        footer.stringCount = strings.size();
+        std::vector<uint8_t> dict;
+        for (const std::string& s : strings) {
+            putVarint(dict, s.size());
+            dict.insert(dict.end(), s.begin(), s.end());
+        }
+        os.write(reinterpret_cast<const char*>(dict.data()), dict.size());
+        footer.addressesOffset = os.tellp();
+        footer.addressCount = addresses.size();
+        os.write(reinterpret_cast<const char*>(addresses.data()),
+                addresses.size() * sizeof(uint32_t));
+        footer.version = kArchiveVersion;
+        std::memcpy(footer.magic, kArchiveMagic, sizeof(kArchiveMagic));
+        os.write(reinterpret_cast<const char*>(&footer), sizeof(footer));
+        uint64_t bytes = os.tellp();
+        const std::string tmp = fileName + ".tmp";
+        if (os.close(), !os) {
+            throw std::runtime_error("Error writing file " + tmp);
+        }
+        if (std::rename(tmp.c_str(), fileName.c_str()) != 0) {
+            throw std::runtime_error("Error renaming " + tmp);
+        }
+        return bytes;
+    }
+
+private:
+    void flushBlock() {
+        if (count == 0) {
+            return;
+        }
+        ArchiveBlockHeader header = {count, minTime, maxTime, {}};
+        for (int c = 0; c < kArchiveColumns; c++) {
+            header.columnBytes[c] = cols[c].size();
+        }
+        os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (auto& col : cols) {
+            os.write(reinterpret_cast<const char*>(col.data()), col.size());
+            col.clear();
+        }
+        count = 0;
+        blocks++;
+    }
+
+    uint32_t stringId(const std::string& s) {
+        if (const uint32_t* id = stringIds.find(s)) {
+            return *id;
+        }
+        strings.push_back(s);
+        return stringIds.insert(s) = strings.size() - 1;
+    }
+
+    uint32_t addressId(uint32_t ip) {
+        if (const uint32_t* id = addressIds.find(ip)) {
+            return *id;
+        }
+        addresses.push_back(ip);
+        return addressIds.insert(ip) = addresses.size() - 1;
+    }
+
+    std::string fileName;
+    uint32_t blockSize;
+    std::ofstream os;
+    std::vector<uint8_t> cols[kArchiveColumns];
+    uint32_t count = 0, minTime = 0, maxTime = 0, lastTime = 0;
+    uint64_t events = 0, blocks = 0;
+    FlatMap<std::string, uint32_t> stringIds;
+    FlatMap<uint32_t, uint32_t> addressIds;
+    std::vector<std::string> strings;
+    std::vector<uint32_t> addresses;
+};
+
+/** The decoded columns of one block. */
+struct ArchiveBlock {
+    uint32_t count = 0;
+    std::vector<uint32_t> time;
+    std::vector<uint32_t> pid;      // String dictionary ids
+    std::vector<uint32_t> account;  // String dictionary ids; 0 for none
+    std::vector<uint32_t> address;  // Address dictionary ids; 0 for none
+    std::vector<uint8_t> outcome;
+};
+
+/** Reads an archive written by ArchiveWriter, a block at a time. */
+class ArchiveReader {
+public:
+    /** Maps the archive and loads its dictionaries. */
+    explicit ArchiveReader(const std::string& fileName) {
+        int fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            throw std::runtime_error("Error opening file " + fileName);
+        }
+        size = st.st_size;
+        void* p = size >= sizeof(ArchiveFooter) ?
+            mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            throw std::runtime_error("Error mapping file " + fileName);
+        }
+        base = static_cast<const uint8_t*>(p);
+        std::memcpy(&footer, base + size - sizeof(footer), sizeof(footer));
+        if (std::memcmp(footer.magic, kArchiveMagic, sizeof(kArchiveMagic))
+            || footer.version != kArchiveVersion ||
+            footer.addressesOffset + footer.addressCount * sizeof(uint32_t)
+            > size - sizeof(footer) || footer.blocksEnd >
+            footer.addressesOffset) {
+            munmap(const_cast<uint8_t*>(base), size);
+            throw std::runtime_error("Invalid event archive " + fileName);
+        }
+        const uint8_t* d = base + footer.blocksEnd;
+        const uint8_t* dEnd = base + footer.addressesOffset;
+        for (uint64_t i = 0; i < footer.stringCount && d < dEnd; i++) {
+            uint64_t len = std::min<uint64_t>(getVarint(d, dEnd), dEnd - d);
+            strings.emplace_back(reinterpret_cast<const char*>(d), len);
+            d += len;
+        }
+        addresses.resize(footer.addressCount);
+        std::memcpy(addresses.data(), base + footer.addressesOffset,
+                addresses.size() * sizeof(uint32_t));
+    }
+
+    ~ArchiveReader() { munmap(const_cast<uint8_t*>(base), size); }
+    ArchiveReader(const ArchiveReader&) = delete;
+    ArchiveReader& operator=(const ArchiveReader&) = delete;
+
+    /**
+     * Decodes the next block that may hold events in [from, to]. Blocks
+     * outside the range are skipped by their min/max stats alone.
+     * @return Returns false once every block has been read.
+     */
+    bool next(ArchiveBlock& b, uint32_t from = 0,
+            uint32_t to = UINT32_MAX) {
+        ArchiveBlockHeader header;
+        for (;;) {
+            if (pos + sizeof(header) > footer.blocksEnd) {
+                return false;
+            }
+            std::memcpy(&header, base + pos, sizeof(header));
+            pos += sizeof(header);
+            uint64_t bytes = 0;
+            for (uint32_t n : header.columnBytes) {
+                bytes += n;
+            }
+            if (pos + bytes > footer.blocksEnd) {
+                throw std::runtime_error("Truncated event archive");
+            }
+            if (header.maxTime >= from && header.minTime <= to) {
+                break;
+            }
+            pos += bytes;
+            skippedBlocks++;
+        }
+        b.count = header.count;
+        b.time.resize(b.count);
+        b.pid.resize(b.count);
+        b.account.resize(b.count);
+        b.address.resize(b.count);
+        b.outcome.resize(b.count);
+        const uint8_t* col[kArchiveColumns];
+        const uint8_t* end[kArchiveColumns];
+        for (int c = 0; c < kArchiveColumns; c++) {
+            col[c] = base + pos;
+            pos += header.columnBytes[c];
+            end[c] = base + pos;
+        }
+        int64_t time = 0;
+        for (uint32_t i = 0; i < b.count; i++) {
+            time = i == 0 ? getVarint(col[kTimeColumn], end[kTimeColumn]) :
+                time + unzigzag(getVarint(col[kTimeColumn],
+                            end[kTimeColumn]));
+            b.time[i] = time;
+        }
+        decodeIds(col[kPidColumn], end[kPidColumn], b.pid, strings.size());
+        decodeIds(col[kAccountColumn], end[kAccountColumn], b.account,
+                strings.size());
+        decodeIds(col[kAddressColumn], end[kAddressColumn], b.address,
+                addresses.size());
+        for (uint32_t i = 0; i < b.count; i++) {
+            size_t byte = i / 4;
+            b.outcome[i] = byte < header.columnBytes[kOutcomeColumn] ?
+                (col[kOutcomeColumn][byte] >> (2 * (i % 4))) & 3 : 0;
+        }
+        return true;
+    }
+
+    /** @return The dictionary string with the given id. */
+    const std::string& string(uint32_t id) const { return strings[id]; }
+
+    /** @return The address with the given id. */
+    uint32_t address(uint32_t id) const { return addresses[id]; }
+
+    /** @return The number of entries in the string dictionary. */
+    size_t stringCount() const { return strings.size(); }
+
+    /** @return The number of entries in the address dictionary. */
+    size_t addressCount() const { return addresses.size(); }
+
+    /** @return The number of events in the archive. */
+    uint64_t eventCount() const { return footer.eventCount; }
+
+    /** @return The number of blocks skipped by their time stats. */
+    uint64_t skipped() const { return skippedBlocks; }
+
+private:
+    /** Decodes varint ids, replacing any out of range with 0. */
+    static void decodeIds(const uint8_t* p, const uint8_t* end,
+            std::vector<uint32_t>& out, size_t limit) {
+        for (uint32_t& id : out) {
+            uint64_t v = getVarint(p, end);
+            id = v < limit ? v : 0;
+        }
+    }
+
+    const uint8_t* base = nullptr;
+    size_t size = 0;
+    ArchiveFooter footer;
+    uint64_t pos = 0;
+    uint64_t skippedBlocks = 0;
+    std::vector<std::string> strings;
+    std::vector<uint32_t> addresses;
+};
+
+#endif  // EVENT_ARCHIVE_H
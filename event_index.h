@@ -0,0 +1,480 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * An on-disk index of log lines by target user and by source IP, for
+ * retrospective questions such as "who tried to log in as root between
+ * 02:00 and 03:00".
+ *
+ * While a log is processed, every line is posted under its keys as the
+ * varint-encoded change in time and in byte offset from the key's
+ * previous line. Postings are gathered per period of bucketSeconds and
+ * written out as soon as event time moves past the period, so only the
+ * current period is held in memory. A key with enough postings in a
+ * period gets a bucket of its own there; the postings of the other keys
+ * go into the period's shared bucket, tagged with the key's FNV-1a hash,
+ * so the many addresses and accounts seen once or twice cost a few bytes
+ * each rather than a key and a bucket. Every bucket records its time
+ * bounds and the time and offset its deltas start from, so it can be
+ * decoded on its own. The finished index is one file: the postings, a
+ * table of the keys that own buckets sorted by hash, the buckets of each
+ * key followed by the shared buckets, and the key text. A query maps the
+ * file, binary searches the key and the buckets covering the time range,
+ * and decodes only those postings; the matching lines are then read from
+ * the original log at their offsets.
+ */
+
+#ifndef EVENT_INDEX_H
+#define EVENT_INDEX_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "flat_map.h"
+#include "lookup_image.h"
+#include "varint.h"
+
+constexpr char kIndexMagic[8] = {'H', 'D', 'E', 'V', 'T', 'I', 'D', 'X'};
+constexpr uint32_t kIndexVersion = 2;
+
+/** The fixed header at the start of every index file. */
+struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t bucketSeconds;
+    uint64_t keyCount;
+    uint64_t keysOffset;      // keyCount IndexKey entries
+    uint64_t bucketsOffset;   // IndexBucket entries, grouped by key
+    uint64_t bucketCount;     // Including the shared buckets
+    uint64_t sharedBucket;    // Index of the first shared bucket
+    uint64_t stringsOffset;   // Key text
+    uint64_t stringsSize;
+    uint64_t postingsOffset;  // Varint postings
+    uint64_t postingsSize;
+};
+
+/** One key of an index, in hash order. */
+struct IndexKey {
+    uint64_t hash;
+    uint64_t stringOffset;
+    uint32_t stringLength;
+    uint32_t bucketCount;
+    uint64_t firstBucket;
+};
+
+/**
+ * A run of consecutive postings of one key, or the shared postings of
+ * one period. low and high bound the times of this and every later
+ * bucket, and of this and every earlier bucket, so both are monotonic
+ * and can be binary searched even when lines arrived slightly out of
+ * order.
+ */
+struct IndexBucket {
+    uint32_t low;
+    uint32_t high;
+    uint32_t count;     // Postings, or keys in a shared bucket
+    uint32_t baseTime;  // Time the first posting's delta is taken from
+    uint64_t baseOffset;
+    uint64_t postingsOffset;
+};
+
+/**
+ * Collects postings while a log is processed, writing each period's
+ * postings as event time moves past it, and finishes the index.
+ */
+class EventIndexWriter {
+public:
+    /**
+     * @param fileName The index to be created or replaced by write().
+     * @param bucketSeconds The length of a period; a key gets at most one
+     * bucket of its own per period.
+     */
+    EventIndexWriter(const std::string& fileName, uint32_t bucketSeconds)
+        : fileName(fileName), bucketSeconds(std::max(bucketSeconds, 1u)),
+        os(fileName + ".tmp", std::ios::binary) {
+        if (!os.good()) {
+            throw std::runtime_error("Error opening file " + fileName +
+                    ".tmp");
+        }
+        // The header is filled in by write(); the postings follow it
+        IndexHeader header = {};
+        os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    }
+
+    /** @return The id of key, which is added if it is new. */
+    uint32_t intern(const std::string& key) {
+        if (const uint32_t* id = ids.find(key)) {
+            return *id;
+        }
+        ids.insert(key) = keys.size();
+        keys.emplace_back();
+        keys.back().name = key;
+        keys.back().hash = imageHash(key.data(), key.size());
+        return keys.size() - 1;
+    }
+
+    /**
+     * Posts the line at offset, seen at time, under the key with the
+     * given id. Each posting is the change in time and in offset from the
+     * key's previous posting, so runs of nearby lines take 2-4 bytes. A
+     * line late enough to belong to a written period joins the current
+     * one; the bucket bounds cover its time.
+     */
+    void add(uint32_t id, uint32_t time, uint64_t offset) {
+        if (time / bucketSeconds > period) {
+            flush();
+            period = time / bucketSeconds;
+        }
+        Postings& p = keys[id];
+        if (p.open.count == 0) {
+            // Earlier postings never need decoding to reach this one
+            p.open = {time, time, 0, time, offset, 0};
+            p.lastTime = time;
+            p.lastOffset = offset;
+            active.push_back(id);
+        }
+        IndexBucket& b = p.open;
+        b.low = std::min(b.low, time);
+        b.high = std::max(b.high, time);
+        b.count++;
+        putVarint(p.bytes, zigzag(static_cast<int64_t>(time) - p.lastTime));
+        putVarint(p.bytes, zigzag(static_cast<int64_t>(offset -
+                        p.lastOffset)));
+        p.lastTime = time;
+        p.lastOffset = offset;
+        postings++;
+    }
+
+    /** Posts a line under key; see add(uint32_t, uint32_t, uint64_t). */
+    void add(const std::string& key, uint32_t time, uint64_t offset) {
+        add(intern(key), time, offset);
+    }
+
+    /** @return The number of postings added so far. */
+    uint64_t size() const { return postings; }
+
+    /**
+     * Writes the last period and the tables, and renames the index into
+     * place.
+     * @return The size of the index in bytes.
+     */
+    uint64_t write() {
+        flush();
+        std::vector<std::pair<uint64_t, uint32_t>> order;
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (!keys[i].buckets.empty()) {
+                order.emplace_back(keys[i].hash, i);
+            }
+        }
+        std::sort(order.begin(), order.end());
+        IndexHeader header = {};
+        std::memcpy(header.magic, kIndexMagic, sizeof(kIndexMagic));
+        header.version = kIndexVersion;
+        header.bucketSeconds = bucketSeconds;
+        header.postingsOffset = sizeof(header);
+        header.postingsSize = written;
+        header.keyCount = order.size();
+        std::vector<IndexKey> keyTable;
+        for (const auto& entry : order) {
+            Postings& p = keys[entry.second];
+            keyTable.push_back({entry.first, header.stringsSize,
+                    static_cast<uint32_t>(p.name.size()),
+                    static_cast<uint32_t>(p.buckets.size()),
+                    header.bucketCount});
+            header.stringsSize += p.name.size();
+            header.bucketCount += p.buckets.size();
+            bound(p.buckets);
+        }
+        header.sharedBucket = header.bucketCount;
+        header.bucketCount += shared.size();
+        bound(shared);
+        header.keysOffset = header.postingsOffset + header.postingsSize;
+        header.bucketsOffset = header.keysOffset +
+            keyTable.size() * sizeof(IndexKey);
+        header.stringsOffset = header.bucketsOffset +
+            header.bucketCount * sizeof(IndexBucket);
+        os.write(reinterpret_cast<const char*>(keyTable.data()),
+                keyTable.size() * sizeof(IndexKey));
+        for (const auto& entry : order) {
+            const std::vector<IndexBucket>& b = keys[entry.second].buckets;
+            os.write(reinterpret_cast<const char*>(b.data()),
+                    b.size() * sizeof(IndexBucket));
+        }
+        os.write(reinterpret_cast<const char*>(shared.data()),
+                shared.size() * sizeof(IndexBucket));
+        for (const auto& entry : order) {
+            os << keys[entry.second].name;
+        }
+        os.seekp(0);
+        os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        const std::string tmp = fileName + ".tmp";
+        if (os.close(), !os) {
+            throw std::runtime_error("Error writing file " + tmp);
+        }
+        if (std::rename(tmp.c_str(), fileName.c_str()) != 0) {
+            throw std::runtime_error("Error renaming " + tmp);
+        }
+        return header.stringsOffset + header.stringsSize;
+    }
+
+private:
+    // Postings a key needs within one period to get a bucket of its own
+    // there; a bucket costs more than the shared postings of a few lines
+    static constexpr uint32_t kMinBucketPostings = 16;
+
+    struct Postings {
+        std::string name;
+        uint64_t hash = 0;
+        std::vector<IndexBucket> buckets;  // Written buckets
+        IndexBucket open = {};             // This period's, if count > 0
+        std::vector<uint8_t> bytes;        // The open bucket's postings
+        uint32_t lastTime = 0;
+        uint64_t lastOffset = 0;
+    };
+
+    /**
+     * Writes the postings of every key seen in the current period: its
+     * own bucket if it has enough of them, otherwise a group of the
+     * shared bucket. A group is the key's hash, its posting count and
+     * its postings re-encoded as deltas from the previous group's last
+     * posting.
+     */
+    void flush() {
+        std::vector<uint8_t> out;
+        IndexBucket s = {UINT32_MAX, 0, 0, period * bucketSeconds, 0, 0};
+        int64_t time = s.baseTime;
+        uint64_t offset = s.baseOffset;
+        for (uint32_t id : active) {
+            Postings& p = keys[id];
+            if (p.open.count >= kMinBucketPostings) {
+                p.open.postingsOffset = written;
+                append(p.bytes);
+                p.buckets.push_back(p.open);
+            } else {
+                s.low = std::min(s.low, p.open.low);
+                s.high = std::max(s.high, p.open.high);
+                s.count++;
+                const uint8_t* hash = reinterpret_cast<const uint8_t*>(
+                        &p.hash);
+                out.insert(out.end(), hash, hash + sizeof(p.hash));
+                putVarint(out, p.open.count);
+                const uint8_t* in = p.bytes.data();
+                const uint8_t* end = in + p.bytes.size();
+                int64_t t = p.open.baseTime;
+                uint64_t o = p.open.baseOffset;
+                for (uint32_t i = 0; i < p.open.count; i++) {
+                    t += unzigzag(getVarint(in, end));
+                    o += unzigzag(getVarint(in, end));
+                    putVarint(out, zigzag(t - time));
+                    putVarint(out, zigzag(static_cast<int64_t>(o - offset)));
+                    time = t;
+                    offset = o;
+                }
+            }
+            p.open.count = 0;
+            p.bytes.clear();
+        }
+        active.clear();
+        if (s.count > 0) {
+            s.postingsOffset = written;
+            append(out);
+            shared.push_back(s);
+        }
+    }
+
+    void append(const std::vector<uint8_t>& bytes) {
+        os.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+        written += bytes.size();
+    }
+
+    /** Makes the bounds of a run of buckets monotonic. */
+    static void bound(std::vector<IndexBucket>& buckets) {
+        for (size_t i = 1; i < buckets.size(); i++) {
+            buckets[i].high = std::max(buckets[i].high, buckets[i - 1].high);
+        }
+        for (size_t i = buckets.size(); i-- > 1;) {
+            buckets[i - 1].low = std::min(buckets[i - 1].low, buckets[i].low);
+        }
+    }
+
+    std::string fileName;
+    uint32_t bucketSeconds;
+    std::ofstream os;
+    FlatMap<std::string, uint32_t> ids;
+    std::vector<Postings> keys;
+    std::vector<uint32_t> active;      // Keys posted to this period
+    std::vector<IndexBucket> shared;   // Written shared buckets
+    uint32_t period = 0;
+    uint64_t written = 0;              // Bytes of postings so far
+    uint64_t postings = 0;
+};
+
+/** A read-only view of an index file mapped into memory. */
+class EventIndex {
+public:
+    /** Maps the index; throws if it is missing or malformed. */
+    explicit EventIndex(const std::string& fileName) {
+        int fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            throw std::runtime_error("Error opening file " + fileName);
+        }
+        size = st.st_size;
+        void* p = size >= sizeof(IndexHeader) ?
+            mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (p == MAP_FAILED) {
+            throw std::runtime_error("Error mapping file " + fileName);
+        }
+        base = static_cast<const char*>(p);
+        std::memcpy(&header, base, sizeof(header));
+        if (std::memcmp(header.magic, kIndexMagic, sizeof(kIndexMagic)) ||
+            header.version != kIndexVersion ||
+            header.postingsOffset + header.postingsSize > size ||
+            header.stringsOffset + header.stringsSize > size ||
+            header.bucketsOffset + header.bucketCount * sizeof(IndexBucket)
+            > size || header.sharedBucket > header.bucketCount ||
+            header.keysOffset + header.keyCount * sizeof(IndexKey)
+            > size) {
+            munmap(const_cast<char*>(base), size);
+            throw std::runtime_error("Invalid event index " + fileName);
+        }
+    }
+
+    ~EventIndex() { munmap(const_cast<char*>(base), size); }
+    EventIndex(const EventIndex&) = delete;
+    EventIndex& operator=(const EventIndex&) = delete;
+
+    /**
+     * Calls found(offset, time) for every line posted under key with a
+     * time in [from, to]: those in the key's own buckets first, then
+     * those in the shared buckets, each in the order they were posted.
+     * @return The number of lines found.
+     */
+    template <typename Found>
+    size_t find(const std::string& key, uint32_t from, uint32_t to,
+            Found found) const {
+        const IndexKey* keys = reinterpret_cast<const IndexKey*>(
+                base + header.keysOffset);
+        const IndexKey* end = keys + header.keyCount;
+        const uint64_t h = imageHash(key.data(), key.size());
+        const IndexKey* k = std::lower_bound(keys, end, h, [](
+                    const IndexKey& entry, uint64_t hash) {
+            return entry.hash < hash;
+        });
+        size_t hits = 0;
+        for (; k != end && k->hash == h; ++k) {
+            if (k->stringLength == key.size() && std::memcmp(base +
+                        header.stringsOffset + k->stringOffset, key.data(),
+                        key.size()) == 0) {
+                hits = scan(buckets() + k->firstBucket, k->bucketCount,
+                        from, to, found);
+                break;
+            }
+        }
+        return hits + scanShared(h, from, to, found);
+    }
+
+    /** @return The number of keys with buckets of their own. */
+    size_t keyCount() const { return header.keyCount; }
+
+private:
+    const IndexBucket* buckets() const {
+        return reinterpret_cast<const IndexBucket*>(base +
+                header.bucketsOffset);
+    }
+
+    /** @return The first of count buckets that may hold from or later. */
+    static const IndexBucket* seek(const IndexBucket* first, size_t count,
+            uint32_t from) {
+        // Buckets before the result hold only earlier times
+        return std::lower_bound(first, first + count, from, [](
+                    const IndexBucket& entry, uint32_t time) {
+            return entry.high < time;
+        });
+    }
+
+    /** Decodes only the buckets of a key that may overlap [from, to]. */
+    template <typename Found>
+    size_t scan(const IndexBucket* first, size_t count, uint32_t from,
+            uint32_t to, Found& found) const {
+        const IndexBucket* last = first + count;
+        const uint8_t* end = postingsEnd();
+        size_t hits = 0;
+        // Buckets from the first with low > to on hold only later times
+        for (const IndexBucket* b = seek(first, count, from);
+             b != last && b->low <= to; ++b) {
+            const uint8_t* p = postings(*b);
+            int64_t time = b->baseTime;
+            uint64_t offset = b->baseOffset;
+            for (uint32_t i = 0; i < b->count; i++) {
+                time += unzigzag(getVarint(p, end));
+                offset += unzigzag(getVarint(p, end));
+                if (time >= from && time <= to) {
+                    found(offset, static_cast<uint32_t>(time));
+                    hits++;
+                }
+            }
+        }
+        return hits;
+    }
+
+    /**
+     * Decodes the shared buckets that may overlap [from, to], reporting
+     * the postings of the groups tagged with hash.
+     */
+    template <typename Found>
+    size_t scanShared(uint64_t hash, uint32_t from, uint32_t to,
+            Found& found) const {
+        const IndexBucket* first = buckets() + header.sharedBucket;
+        const IndexBucket* last = buckets() + header.bucketCount;
+        const uint8_t* end = postingsEnd();
+        size_t hits = 0;
+        for (const IndexBucket* b = seek(first, last - first, from);
+             b != last && b->low <= to; ++b) {
+            const uint8_t* p = postings(*b);
+            int64_t time = b->baseTime;
+            uint64_t offset = b->baseOffset;
+            for (uint32_t g = 0; g < b->count && p + 8 <= end; g++) {
+                uint64_t tag;  // The key's hash
+                std::memcpy(&tag, p, sizeof(tag));
+                p += sizeof(tag);
+                for (uint64_t n = getVarint(p, end); n > 0 && p < end; n--) {
+                    time += unzigzag(getVarint(p, end));
+                    offset += unzigzag(getVarint(p, end));
+                    if (tag == hash && time >= from && time <= to) {
+                        found(offset, static_cast<uint32_t>(time));
+                        hits++;
+                    }
+                }
+            }
+        }
+        return hits;
+    }
+
+    const uint8_t* postings(const IndexBucket& b) const {
+        return reinterpret_cast<const uint8_t*>(base +
+                header.postingsOffset + b.postingsOffset);
+    }
+
+    const uint8_t* postingsEnd() const {
+        return reinterpret_cast<const uint8_t*>(base +
+                header.postingsOffset + header.postingsSize);
+    }
+
+    const char* base = nullptr;
+    size_t size = 0;
+    IndexHeader header;
+};
+
+#endif  // EVENT_INDEX_H
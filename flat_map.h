@@ -0,0 +1,153 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * An open-addressing hash map used for per-key window state.
+ *
+ * Keys and values are stored inline in one array of slots and collisions
+ * are resolved by linear probing, so the slot for a key is found from its
+ * hash alone. That makes prefetching possible: the address of a key's
+ * slot can be computed, and its cache line requested, without the chain
+ * of dependent loads (bucket, previous node, node) that std::unordered_map
+ * needs. Deletion shifts later entries back instead of leaving tombstones,
+ * so probe sequences stay short under constant insert/expire churn.
+ */
+
+#ifndef FLAT_MAP_H
+#define FLAT_MAP_H
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <utility>
+#include <vector>
+
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class FlatMap {
+public:
+    /** @param capacity The number of entries to make room for up front. */
+    explicit FlatMap(size_t capacity = 0) {
+        int bits = 4;
+        while ((size_t(1) << bits) * 3 < capacity * 4) {
+            bits++;
+        }
+        resize(bits);
+    }
+
+    /** @return The value stored for key, or nullptr if key is absent. */
+    Value* find(const Key& key) {
+        uint64_t tag = tagOf(key);
+        for (size_t i = home(tag);; i = (i + 1) & mask) {
+            Slot& slot = slots[i];
+            if (slot.tag == 0) {
+                return nullptr;
+            }
+            if (slot.tag == tag && slot.key == key) {
+                return &slot.value;
+            }
+        }
+    }
+
+    const Value* find(const Key& key) const {
+        return const_cast<FlatMap*>(this)->find(key);
+    }
+
+    /**
+     * Adds key with a default-constructed value. The key must not already
+     * be present. References returned earlier may be invalidated.
+     * @return The new value.
+     */
+    Value& insert(const Key& key) {
+        if ((count + 1) * 4 > slots.size() * 3) {
+            resize(64 - shift + 1);
+        }
+        uint64_t tag = tagOf(key);
+        size_t i = home(tag);
+        while (slots[i].tag != 0) {
+            i = (i + 1) & mask;
+        }
+        slots[i].tag = tag;
+        slots[i].key = key;
+        count++;
+        return slots[i].value;
+    }
+
+    /** Removes key if it is present. */
+    void erase(const Key& key) {
+        uint64_t tag = tagOf(key);
+        size_t hole = home(tag);
+        for (;; hole = (hole + 1) & mask) {
+            if (slots[hole].tag == 0) {
+                return;
+            }
+            if (slots[hole].tag == tag && slots[hole].key == key) {
+                break;
+            }
+        }
+        // Pull back any later entry whose home is at or before the hole
+        for (size_t j = (hole + 1) & mask; slots[j].tag != 0;
+             j = (j + 1) & mask) {
+            size_t distHole = (hole - home(slots[j].tag)) & mask;
+            size_t distJ = (j - home(slots[j].tag)) & mask;
+            if (distHole <= distJ) {
+                slots[hole] = std::move(slots[j]);
+                hole = j;
+            }
+        }
+        slots[hole] = Slot();
+        count--;
+    }
+
+    /**
+     * Requests the cache lines holding key's slot. The slot address only
+     * depends on the hash, so this never waits on memory.
+     */
+    void prefetch(const Key& key) const {
+        const Slot* slot = &slots[home(tagOf(key))];
+        __builtin_prefetch(slot, 1);
+        __builtin_prefetch(reinterpret_cast<const char*>(slot + 1) - 1, 1);
+    }
+
+    /** @return The number of keys stored. */
+    size_t size() const { return count; }
+
+private:
+    struct Slot {
+        uint64_t tag = 0;  // Mixed hash with the low bit set; 0 if empty
+        Key key = Key();
+        Value value = Value();
+    };
+
+    /** Spreads the hash so the top bits pick the home slot. */
+    static uint64_t tagOf(const Key& key) {
+        uint64_t h = Hash()(key);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h | 1;
+    }
+
+    size_t home(uint64_t tag) const { return tag >> shift; }
+
+    /** Moves every entry into a table of 2^bits slots. */
+    void resize(int bits) {
+        std::vector<Slot> old(size_t(1) << bits);
+        old.swap(slots);
+        mask = slots.size() - 1;
+        shift = 64 - bits;
+        for (Slot& slot : old) {
+            if (slot.tag != 0) {
+                size_t i = home(slot.tag);
+                while (slots[i].tag != 0) {
+                    i = (i + 1) & mask;
+                }
+                slots[i] = std::move(slot);
+            }
+        }
+    }
+
+    std::vector<Slot> slots;
+    size_t mask = 0;
+    int shift = 64;
+    size_t count = 0;
+};
+
+#endif  // FLAT_MAP_H
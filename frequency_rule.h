@@ -0,0 +1,138 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * The per-user frequency rule ("more than N attempts in W seconds") and
+ * the dispatcher that picks its implementation from the configuration.
+ *
+ * The default window/threshold pair (3 in 20 seconds) is compiled as a
+ * FixedRingWindow instantiation so the ring comparison is fully
+ * unrolled; any other pair uses the generic RingWindow, which is only a
+ * few percent slower, and approximate mode wraps the Count-Min Sketch
+ * rule. The choice is made once per run, so the per-line cost of the
+ * indirection is a single virtual call. The exact rules keep the state
+ * of numeric keys (sshd PIDs) in a table indexed by PID and only hash
+ * the keys that are not numbers.
+ */
+
+#ifndef FREQUENCY_RULE_H
+#define FREQUENCY_RULE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include "count_min.h"
+#include "rate_tracker.h"
+
+/** Interface shared by every implementation of the user frequency rule. */
+class UserRule {
+public:
+    virtual ~UserRule() {}
+
+    /**
+     * Records an attempt by user at time now.
+     * @return Returns true if user made more attempts than allowed.
+     */
+    virtual bool record(const std::string& user, uint32_t now) = 0;
+
+    /**
+     * Hints that record(user, now) will be called soon, so the state it
+     * touches can be loaded into cache ahead of time.
+     */
+    virtual void prefetch(const std::string& user, uint32_t now) const = 0;
+
+    /**
+     * Records an attempt by the sshd process pid, a PID that
+     * PidTable::covers. Rules without state indexed by PID look its
+     * decimal form up instead.
+     */
+    virtual bool recordPid(uint32_t pid, uint32_t now) {
+        return record(std::to_string(pid), now);
+    }
+
+    /** The prefetch() hint for recordPid(pid, now). */
+    virtual void prefetchPid(uint32_t, uint32_t) const {}
+
+    /** @return A short description of the selected implementation. */
+    virtual std::string name() const = 0;
+};
+
+/** The exact rule over a RateTracker using the given ring type. */
+template <typename Ring>
+class TrackedUserRule : public UserRule {
+public:
+    TrackedUserRule(long window, int threshold, size_t maxKeys,
+            std::string label) : tracker(window, threshold, maxKeys),
+        pids(window, threshold), label(label) {}
+
+    bool record(const std::string& user, uint32_t now) override {
+        return tracker.record(user, now);
+    }
+
+    void prefetch(const std::string& user, uint32_t) const override {
+        tracker.prefetch(user);
+    }
+
+    bool recordPid(uint32_t pid, uint32_t now) override {
+        return pids.record(pid, now);
+    }
+
+    void prefetchPid(uint32_t pid, uint32_t) const override {
+        pids.prefetch(pid);
+    }
+
+    std::string name() const override { return label; }
+
+private:
+    RateTracker<std::string, Ring> tracker;
+    PidRateTracker<Ring> pids;
+    std::string label;
+};
+
+/** The approximate rule backed by a windowed Count-Min Sketch. */
+class SketchUserRule : public UserRule {
+public:
+    SketchUserRule(long window, int threshold, size_t sketchBytes,
+            size_t maxConfirmed) : rule(window, threshold, sketchBytes,
+                    maxConfirmed) {}
+
+    bool record(const std::string& user, uint32_t now) override {
+        return rule.record(user, now);
+    }
+
+    void prefetch(const std::string& user, uint32_t now) const override {
+        rule.prefetch(user, now);
+    }
+
+    std::string name() const override { return "count-min sketch"; }
+
+private:
+    SketchRateRule rule;
+};
+
+/** Builds the exact rule specialized for Window and Threshold. */
+template <long Window, int Threshold>
+std::unique_ptr<UserRule> makeFixedRule(size_t maxKeys) {
+    return std::unique_ptr<UserRule>(
+            new TrackedUserRule<FixedRingWindow<Window, Threshold>>(Window,
+                    Threshold, maxKeys, "fixed " + std::to_string(Threshold)
+                    + " in " + std::to_string(Window) + "s"));
+}
+
+/**
+ * Picks the exact rule implementation for the given parameters: the
+ * compiled specialization for the default pair, otherwise the generic
+ * ring.
+ * @param window The length of the sliding window in seconds.
+ * @param threshold The number of attempts allowed inside a window.
+ * @param maxKeys The largest number of users tracked at once.
+ */
+inline std::unique_ptr<UserRule> makeUserRule(long window, int threshold,
+        size_t maxKeys) {
+    if (window == 20 && threshold == 3) {
+        return makeFixedRule<20, 3>(maxKeys);
+    }
+    return std::unique_ptr<UserRule>(new TrackedUserRule<RingWindow>(window,
+                threshold, maxKeys, "generic"));
+}
+
+#endif  // FREQUENCY_RULE_H
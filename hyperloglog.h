@@ -0,0 +1,249 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * Distinct-source estimation per target account for detecting password
+ * spraying, where one account is attacked from many different IPs.
+ *
+ * Each account owns a small HyperLogLog sketch. While only a few sources
+ * have been seen the sketch stores their 32-bit hashes directly (sparse
+ * form, exact up to hash collisions); past that it switches to 128 dense
+ * 8-bit registers. Either form stays at or under 128 bytes.
+ */
+
+#ifndef HYPERLOGLOG_H
+#define HYPERLOGLOG_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "flat_map.h"
+#include "rate_tracker.h"
+
+/** A HyperLogLog sketch with 2^7 registers and a sparse small-set form. */
+class SparseHLL {
+public:
+    static constexpr int kPrecision = 7;
+    static constexpr size_t kRegisters = 1 << kPrecision;
+    // Beyond this many hashes the dense form is smaller
+    static constexpr size_t kSparseLimit = kRegisters / sizeof(uint32_t);
+
+    /** Adds an already hashed item to the sketch. */
+    void add(uint64_t hash) {
+        if (registers.empty()) {
+            uint32_t h = hash >> 32;
+            if (std::find(sparse.begin(), sparse.end(), h) != sparse.end()) {
+                return;
+            }
+            if (sparse.size() < kSparseLimit) {
+                sparse.push_back(h);
+                return;
+            }
+            toDense();
+        }
+        addDense(registers.data(), hash);
+    }
+
+    /** @return The estimated number of distinct items added. */
+    double estimate() const {
+        if (registers.empty()) {
+            return sparse.size();
+        }
+        return estimateDense(registers.data());
+    }
+
+    /**
+     * @return The estimated number of distinct items added to either this
+     * sketch or other, without modifying either.
+     */
+    double estimateUnion(const SparseHLL& other) const {
+        if (registers.empty() && other.registers.empty()) {
+            size_t shared = 0;
+            for (uint32_t h : other.sparse) {
+                shared += std::find(sparse.begin(), sparse.end(), h) !=
+                    sparse.end();
+            }
+            return sparse.size() + other.sparse.size() - shared;
+        }
+        // Called per attempt once a sketch is dense; stays off the heap
+        std::array<uint8_t, kRegisters> merged = {};
+        mergeInto(merged.data());
+        other.mergeInto(merged.data());
+        return estimateDense(merged.data());
+    }
+
+    /** Empties the sketch and releases its memory. */
+    void clear() {
+        std::vector<uint32_t>().swap(sparse);
+        std::vector<uint8_t>().swap(registers);
+    }
+
+    /** @return The bytes held by the sketch's representation. */
+    size_t memoryBytes() const {
+        return sparse.capacity() * sizeof(uint32_t) + registers.capacity();
+    }
+
+private:
+    static void addDense(uint8_t* regs, uint64_t hash) {
+        size_t idx = hash >> (64 - kPrecision);
+        uint64_t rest = (hash << kPrecision) | (1ULL << (kPrecision - 1));
+        uint8_t rho = __builtin_clzll(rest) + 1;
+        regs[idx] = std::max(regs[idx], rho);
+    }
+
+    /** Sparse entries keep the top 32 hash bits, enough for a register. */
+    static uint64_t widen(uint32_t h) {
+        return (static_cast<uint64_t>(h) << 32) | 0xffffffffULL;
+    }
+
+    static double estimateDense(const uint8_t* regs) {
+        const double m = kRegisters;
+        double sum = 0;
+        size_t zeros = 0;
+        for (size_t i = 0; i < kRegisters; i++) {
+            sum += std::ldexp(1.0, -regs[i]);
+            zeros += regs[i] == 0;
+        }
+        double e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+        if (e <= 2.5 * m && zeros > 0) {
+            e = m * std::log(m / zeros);  // Linear counting for small sets
+        }
+        return e;
+    }
+
+    void toDense() {
+        registers.assign(kRegisters, 0);
+        for (uint32_t h : sparse) {
+            addDense(registers.data(), widen(h));
+        }
+        std::vector<uint32_t>().swap(sparse);
+    }
+
+    void mergeInto(uint8_t* regs) const {
+        if (registers.empty()) {
+            for (uint32_t h : sparse) {
+                addDense(regs, widen(h));
+            }
+            return;
+        }
+        for (size_t i = 0; i < kRegisters; i++) {
+            regs[i] = std::max(regs[i], registers[i]);
+        }
+    }
+
+    std::vector<uint32_t> sparse;
+    std::vector<uint8_t> registers;
+};
+
+/**
+ * Flags an account once attempts against it come from more than a
+ * threshold of distinct IPs inside a window. Each account keeps one
+ * sketch for the current window-length epoch and one for the previous
+ * epoch; their union covers between one and two windows of history.
+ * Idle accounts expire through a timing wheel and the number of tracked
+ * accounts is capped. Accounts are keyed by a 64-bit hash of their name,
+ * so neither the table nor the wheel copies strings; a collision merges
+ * two accounts' sketches.
+ */
+class SprayDetector {
+public:
+    /**
+     * @param window The length of an epoch in seconds.
+     * @param threshold The number of distinct sources allowed.
+     * @param maxUsers The largest number of accounts tracked at once.
+     */
+    SprayDetector(long window, int threshold, size_t maxUsers) :
+        window(window > 0 ? window : 1), threshold(threshold),
+        maxUsers(maxUsers ? maxUsers : 1), wheel(2 * this->window + 1) {}
+
+    /**
+     * Records an attempt against user from ip.
+     * @return Returns true if the estimated number of distinct sources
+     * for user exceeds the threshold.
+     */
+    bool record(const std::string& user, uint32_t ip, uint32_t now) {
+        wheel.advance(now, [this, now](uint64_t key) {
+            Entry* entry = state.find(key);
+            if (entry && entry->lastSeen + 2 * window <= now) {
+                state.erase(key);
+            }
+        });
+        const uint64_t key = hash(user);
+        Entry* found = state.find(key);
+        if (!found) {
+            if (state.size() >= maxUsers) {
+                makeRoom();
+            }
+            found = &state.insert(key);
+            found->epoch = now / window;
+        }
+        Entry& entry = *found;
+        if (entry.lastSeen != now) {
+            wheel.schedule(key, now);
+            entry.lastSeen = now;
+        }
+        // Rotate epochs; a gap of two or more epochs forgets everything
+        uint32_t epoch = now / window;
+        if (epoch > entry.epoch) {
+            if (epoch == entry.epoch + 1) {
+                std::swap(entry.previous, entry.current);
+            } else {
+                entry.previous.clear();
+            }
+            entry.current.clear();
+            entry.epoch = epoch;
+        }
+        entry.current.add(mix(ip));
+        return entry.current.estimateUnion(entry.previous) > threshold;
+    }
+
+    /** @return The number of accounts currently tracked. */
+    size_t size() const { return state.size(); }
+
+private:
+    struct Entry {
+        SparseHLL current;
+        SparseHLL previous;
+        uint32_t epoch = 0;
+        uint32_t lastSeen = 0;
+    };
+
+    /** A 64-bit finalizer so that nearby IPs land in unrelated registers. */
+    static uint64_t mix(uint64_t x) {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ULL;
+        x ^= x >> 33;
+        return x;
+    }
+
+    /** 64-bit FNV-1a over the account name. */
+    static uint64_t hash(const std::string& user) {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (unsigned char c : user) {
+            h = (h ^ c) * 0x100000001b3ULL;
+        }
+        return h;
+    }
+
+    void makeRoom() {
+        wheel.evictOldest([this](uint64_t key, size_t idx) {
+            Entry* entry = state.find(key);
+            if (entry && entry->lastSeen % wheel.size() == idx) {
+                state.erase(key);
+            }
+            return state.size() < maxUsers;
+        });
+    }
+
+    long window;
+    int threshold;
+    size_t maxUsers;
+    FlatMap<uint64_t, Entry> state;
+    TimingWheel<uint64_t> wheel;
+};
+
+#endif  // HYPERLOGLOG_H
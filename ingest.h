@@ -0,0 +1,220 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * Concurrent ingestion of many log sources (HTTP URLs or local files) on
+ * an Asio thread pool.
+ *
+ * Network sources are read with asynchronous socket operations, so a host
+ * that sends slowly only ever holds a pending read and never a thread.
+ * Files are read in chunks with UringFileReader, which keeps the next
+ * reads in flight while a chunk is processed, and each chunk re-posts the
+ * next read to the pool so that one large file cannot starve the other
+ * sources. Chunks of
+ * one source are delivered in order and never concurrently; chunks of
+ * different sources may be delivered on different threads at once.
+ */
+
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <boost/asio.hpp>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "uring_reader.h"
+
+/**
+ * @param url A string containing a valid URL. The port number in URL
+ * is always optional.  The default port number is assumed to be 80.
+ *
+ * @return This method returns a std::tuple with 3 strings. The 3
+ * strings are in the order: hostname, port, and path.  Here we use
+ * std::tuple because a method can return only 1 value.  The
+ * std::tuple is a convenient class to encapsulate multiple return
+ * values into a single return value.
+ */
+inline std::tuple<std::string, std::string, std::string>
+breakDownURL(const std::string& url) {
+    // The values to be returned.
+    std::string hostName, port = "80", path = "/";
+    size_t n, m;
+    n = url.find("/") + 2;
+    if (url.find(":", n) != std::string::npos) {
+        m = url.find(":", n);
+        port = url.substr(m + 1, url.find("/", m) - (m+1));
+        path = url.substr(url.find("/", m));
+    } else {
+        m = url.find("/", n);
+        path = url.substr(m);
+    }
+    hostName = url.substr(n, m - n);
+    // Return 3-values encapsulated into 1-tuple.
+    return {hostName, port, path};
+}
+
+/** @return Returns true if source names a URL rather than a file. */
+inline bool isURL(const std::string& source) {
+    return source.find("://") != std::string::npos;
+}
+
+/**
+ * Receives the log text of one source, without any HTTP headers. Called
+ * with eof set exactly once, after the last chunk; error is then empty
+ * unless the source could not be read completely.
+ */
+using ChunkHandler = std::function<void(size_t source, const char* data,
+        size_t len, bool eof, const std::string& error)>;
+
+/** Fetches one URL with asynchronous socket operations. */
+class HttpFetch : public std::enable_shared_from_this<HttpFetch> {
+public:
+    HttpFetch(boost::asio::thread_pool& pool, size_t id,
+            const std::string& url, size_t chunkSize, ChunkHandler& handler)
+        : resolver(pool), socket(pool), id(id), buf(chunkSize),
+        handler(handler) {
+        std::tie(host, port, path) = breakDownURL(url);
+        request = "GET " + path + " HTTP/1.1\r\nHost: " + host +
+            "\r\nConnection: Close\r\n\r\n";
+    }
+
+    void start() {
+        auto self = shared_from_this();
+        resolver.async_resolve(host, port, [self](
+                    const boost::system::error_code& ec,
+                    boost::asio::ip::tcp::resolver::results_type results) {
+            if (ec) {
+                return self->done(ec);
+            }
+            boost::asio::async_connect(self->socket, results, [self](
+                        const boost::system::error_code& ec,
+                        const boost::asio::ip::tcp::endpoint&) {
+                if (ec) {
+                    return self->done(ec);
+                }
+                boost::asio::async_write(self->socket,
+                        boost::asio::buffer(self->request), [self](
+                            const boost::system::error_code& ec, size_t) {
+                    if (ec) {
+                        return self->done(ec);
+                    }
+                    self->read();
+                });
+            });
+        });
+    }
+
+private:
+    void read() {
+        auto self = shared_from_this();
+        socket.async_read_some(boost::asio::buffer(buf), [self](
+                    const boost::system::error_code& ec, size_t n) {
+            self->deliver(self->buf.data(), n);
+            if (ec) {
+                return self->done(ec == boost::asio::error::eof ?
+                        boost::system::error_code() : ec);
+            }
+            self->read();
+        });
+    }
+
+    /** Strips the response headers, then passes the body on. */
+    void deliver(const char* data, size_t len) {
+        if (inHeader) {
+            header.append(data, len);
+            size_t end = header.find("\r\n\r\n");
+            if (end == std::string::npos) {
+                return;
+            }
+            inHeader = false;
+            const std::string body = header.substr(end + 4);
+            header.clear();
+            handler(id, body.data(), body.size(), false, "");
+        } else if (len > 0) {
+            handler(id, data, len, false, "");
+        }
+    }
+
+    void done(const boost::system::error_code& ec) {
+        handler(id, nullptr, 0, true, ec ? ec.message() : "");
+    }
+
+    boost::asio::ip::tcp::resolver resolver;
+    boost::asio::ip::tcp::socket socket;
+    size_t id;
+    std::vector<char> buf;
+    ChunkHandler& handler;
+    std::string host, port, path, request, header;
+    bool inHeader = true;
+};
+
+/** Reads one file a chunk at a time, yielding the pool between chunks. */
+class FileFetch : public std::enable_shared_from_this<FileFetch> {
+public:
+    FileFetch(boost::asio::thread_pool& pool, size_t id,
+            const std::string& path, size_t chunkSize, ChunkHandler& handler)
+        : pool(pool), id(id), path(path), chunkSize(chunkSize),
+        handler(handler) {}
+
+    void start() {
+        try {
+            file.reset(new UringFileReader(path, chunkSize));
+        } catch (const std::exception& e) {
+            handler(id, nullptr, 0, true, e.what());
+            return;
+        }
+        step();
+    }
+
+private:
+    void step() {
+        FileBlock block;
+        try {
+            if (!file->next(block)) {
+                handler(id, nullptr, 0, true, "");
+                return;
+            }
+        } catch (const std::exception& e) {
+            handler(id, nullptr, 0, true, e.what());
+            return;
+        }
+        handler(id, block.data, block.len, false, "");
+        file->release(block);
+        auto self = shared_from_this();
+        boost::asio::post(pool, [self] { self->step(); });
+    }
+
+    boost::asio::thread_pool& pool;
+    size_t id;
+    std::string path;
+    size_t chunkSize;
+    ChunkHandler& handler;
+    std::unique_ptr<UringFileReader> file;
+};
+
+/**
+ * Reads every source concurrently and returns once all have finished.
+ * @param sources URLs ("http://host[:port]/path") or file paths.
+ * @param threads The number of pool threads.
+ * @param handler Receives the text of each source, identified by its
+ * index in sources.
+ * @param chunkSize The largest number of bytes delivered per call.
+ */
+inline void fetchSources(const std::vector<std::string>& sources,
+        size_t threads, ChunkHandler handler, size_t chunkSize = 64 << 10) {
+    boost::asio::thread_pool pool(threads ? threads : 1);
+    for (size_t i = 0; i < sources.size(); i++) {
+        if (isURL(sources[i])) {
+            std::make_shared<HttpFetch>(pool, i, sources[i], chunkSize,
+                    handler)->start();
+        } else {
+            auto file = std::make_shared<FileFetch>(pool, i, sources[i],
+                    chunkSize, handler);
+            boost::asio::post(pool, [file] { file->start(); });
+        }
+    }
+    pool.join();
+}
+
+#endif  // INGEST_H
@@ -0,0 +1,198 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * Source addresses the detector has banned on its own.
+ *
+ * banned_ips.txt only holds addresses an operator listed. When a window
+ * rule catches an attacker, its address is added here with a time to
+ * live, so its following lines are decided by the cheap ban check in the
+ * lookup phase instead of running every window rule again. A new
+ * detection while banned extends the ban. Expired bans leave through a
+ * timing wheel, as window state does, and the number of bans is capped
+ * with the oldest dropped first. The set is saved as text, one
+ * "address expiry" pair per line, and loaded again at start-up so the
+ * learned bans survive a restart. Saves are also checkpointed while the
+ * detector runs, so a crash loses at most the bans of the last interval.
+ */
+
+#ifndef LEARNED_BANS_H
+#define LEARNED_BANS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include "flat_map.h"
+#include "rate_tracker.h"
+
+class LearnedBans {
+public:
+    /**
+     * @param ttl How many seconds a ban lasts after the last detection.
+     * @param maxBans The largest number of bans held at once.
+     */
+    LearnedBans(long ttl, size_t maxBans) : ttl(ttl > 0 ? ttl : 1),
+        maxBans(maxBans ? maxBans : 1), wheel(this->ttl + 1) {}
+
+    /**
+     * Takes the lock that every other call must be made under. Several
+     * detectors share one set, so callers hold it across a whole batch.
+     */
+    std::unique_lock<std::mutex> lock() {
+        return std::unique_lock<std::mutex>(mutex);
+    }
+
+    /** @return Returns true if ip is banned at time now. */
+    bool contains(uint32_t ip, uint32_t now) {
+        const uint32_t* since = bans.find(ip);
+        return since != nullptr && static_cast<long>(*since) + ttl > now;
+    }
+
+    /** Bans ip from now on, or extends its ban. */
+    void ban(uint32_t ip, uint32_t now) {
+        wheel.advance(now, [this, now](uint32_t key) { expire(key, now); });
+        uint32_t* since = bans.find(ip);
+        if (since == nullptr) {
+            if (bans.size() >= maxBans) {
+                makeRoom();
+            }
+            since = &bans.insert(ip);
+            learned++;
+            fresh++;
+        } else if (*since >= now) {
+            return;
+        }
+        *since = now;
+        wheel.schedule(ip, now);
+        dirty = true;
+        newest = std::max(newest, now);
+    }
+
+    /** Counts a line decided by a learned ban. */
+    void hit() { hits++; }
+
+    /** @return The number of bans held. */
+    size_t size() const { return bans.size(); }
+
+    /** @return A one-line account of the bans learned and used. */
+    std::string report() const {
+        return "Learned " + std::to_string(learned) + " bans (" +
+            std::to_string(bans.size()) + " held); " +
+            std::to_string(hits) + " lines stopped by them.";
+    }
+
+    /**
+     * Loads bans saved by save(). A missing file is not an error; there
+     * is nothing learned yet.
+     * @return The number of bans loaded.
+     */
+    size_t load(const std::string& fileName) {
+        std::ifstream is(fileName);
+        size_t loaded = 0;
+        std::string address;
+        for (long expiry; is >> address >> expiry;) {
+            uint32_t ip;
+            if (!parseIPv4(address, 0, ip) || expiry <= ttl) {
+                continue;
+            }
+            ban(ip, expiry - ttl);
+            loaded++;
+        }
+        learned = fresh = 0;
+        dirty = false;
+        return loaded;
+    }
+
+    /**
+     * Writes every ban with its expiry to a temporary file and renames
+     * it into place.
+     */
+    void save(const std::string& fileName) {
+        const std::string tmp = fileName + ".tmp";
+        std::ofstream os(tmp);
+        // Bans are found through the wheel, which holds every live key.
+        // A slot the wheel has not turned past since a ban was loaded
+        // with a later time may hold a key twice.
+        FlatMap<uint32_t, bool> written(bans.size());
+        for (size_t slot = 0; slot < wheel.size(); slot++) {
+            wheel.forEach(slot, [this, slot, &os, &written](uint32_t ip) {
+                const uint32_t* since = bans.find(ip);
+                if (since != nullptr && *since % wheel.size() == slot &&
+                    written.find(ip) == nullptr) {
+                    written.insert(ip);
+                    os << (ip >> 24) << '.' << ((ip >> 16) & 255) << '.'
+                       << ((ip >> 8) & 255) << '.' << (ip & 255) << ' '
+                       << *since + ttl << '\n';
+                }
+            });
+        }
+        os.close();
+        if (!os) {
+            throw std::runtime_error("Error writing file " + tmp);
+        }
+        if (std::rename(tmp.c_str(), fileName.c_str()) != 0) {
+            throw std::runtime_error("Error renaming " + tmp);
+        }
+        savedAt = newest;
+        fresh = 0;
+        dirty = false;
+    }
+
+    /**
+     * Saves the bans with save() if they changed and either every
+     * seconds of event time have passed since the last save or at least
+     * count bans were learned since.
+     * @param fileName Where the bans are saved.
+     * @param every Seconds of event time between saves; 0 = no limit.
+     * @param count New bans between saves; 0 = no limit.
+     * @return Returns true if the bans were saved.
+     */
+    bool checkpoint(const std::string& fileName, long every, size_t count) {
+        if (savedAt == 0) {
+            // The event clock starts with the first ban
+            savedAt = newest;
+        }
+        if (!dirty || !((every > 0 && static_cast<long>(newest) -
+                        static_cast<long>(savedAt) >= every) ||
+                    (count > 0 && fresh >= count))) {
+            return false;
+        }
+        save(fileName);
+        return true;
+    }
+
+private:
+    void expire(uint32_t ip, uint32_t now) {
+        const uint32_t* since = bans.find(ip);
+        if (since != nullptr && static_cast<long>(*since) + ttl <= now) {
+            bans.erase(ip);
+        }
+    }
+
+    void makeRoom() {
+        wheel.evictOldest([this](uint32_t ip, size_t idx) {
+            const uint32_t* since = bans.find(ip);
+            if (since != nullptr && *since % wheel.size() == idx) {
+                bans.erase(ip);
+            }
+            return bans.size() < maxBans;
+        });
+    }
+
+    long ttl;
+    size_t maxBans;
+    size_t learned = 0;
+    size_t hits = 0;
+    // Bans learned, and whether any ban changed, since the last save, and
+    // the event times of that save and of the latest ban
+    size_t fresh = 0;
+    bool dirty = false;
+    uint32_t savedAt = 0, newest = 0;
+    std::mutex mutex;
+    FlatMap<uint32_t, uint32_t> bans;  // Time of the latest detection
+    TimingWheel<uint32_t> wheel;
+};
+
+#endif  // LEARNED_BANS_H
@@ -0,0 +1,124 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * An early-reject filter for lines that were not written by sshd.
+ *
+ * A real auth.log is mostly sudo, cron, systemd and PAM noise, and only
+ * sshd lines can be login attempts. The line scanner already looks for
+ * "sshd[" in the same SIMD pass that splits the lines, so a line is kept
+ * or rejected by reading one field, before its timestamp is parsed or any
+ * column of it is filled. A line from another program is still offered to
+ * the caller's lookup check, since a PAM or sudo line naming a banned IP
+ * is flagged like any other, and kept if the check flags it. Rejected
+ * lines are counted by the program that wrote them, read from the syslog
+ * tag without copying it.
+ */
+
+#ifndef LINE_PREFILTER_H
+#define LINE_PREFILTER_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include "line_scanner.h"
+
+class LinePrefilter {
+public:
+    /** Why a line was rejected. */
+    enum Category {
+        kSudo, kCron, kSystemd, kKernel, kSshdNoPid, kOther, kNoTag,
+        kCategories
+    };
+
+    /**
+     * @param line A log line.
+     * @param f Its fields, as located by the line scanner.
+     * @param flagged Called with a line not written by sshd; returns true
+     * if the lookups flag it.
+     * @return Returns true if the line comes from sshd or is flagged, and
+     * is processed.
+     */
+    template <typename Flagged>
+    bool keep(const std::string& line, const LineFields& f,
+            Flagged flagged) {
+        if (f.sshd >= 0 || flagged(line)) {
+            return true;
+        }
+        counts[categorize(line)]++;
+        return false;
+    }
+
+    /** @return The number of lines rejected. */
+    uint64_t skipped() const {
+        uint64_t total = 0;
+        for (uint64_t n : counts) {
+            total += n;
+        }
+        return total;
+    }
+
+    /** @return The number of lines rejected for one reason. */
+    uint64_t skipped(Category c) const { return counts[c]; }
+
+    /** @return A one-line account of the rejected lines. */
+    std::string report() const {
+        static const char* const kNames[kCategories] = {"sudo", "cron",
+            "systemd", "kernel", "sshd without pid", "other programs",
+            "no program tag"};
+        std::string text = "Skipped " + std::to_string(skipped()) +
+            " non-sshd lines:";
+        const char* separator = " ";
+        for (int c = 0; c < kCategories; c++) {
+            if (counts[c] > 0) {
+                text.append(separator).append(kNames[c]).append(" ")
+                    .append(std::to_string(counts[c]));
+                separator = ", ";
+            }
+        }
+        return text + ".";
+    }
+
+private:
+    /**
+     * Reads the program tag of "Mmm dd hh:mm:ss host tag[pid]: ..." and
+     * files the line under it.
+     */
+    static Category categorize(const std::string& line) {
+        const size_t stamp = 15;
+        if (line.size() <= stamp || line[stamp] != ' ') {
+            return kNoTag;
+        }
+        size_t host = line.find(' ', stamp + 1);
+        if (host == std::string::npos) {
+            return kNoTag;
+        }
+        const char* tag = line.data() + host + 1;
+        size_t len = 0;
+        while (host + 1 + len < line.size() && tag[len] != '[' &&
+                tag[len] != ':' && tag[len] != ' ') {
+            len++;
+        }
+        auto is = [tag, len](const char* name) {
+            return len == std::strlen(name) &&
+                std::memcmp(tag, name, len) == 0;
+        };
+        if (len == 0) {
+            return kNoTag;
+        } else if (is("sudo")) {
+            return kSudo;
+        } else if (is("CRON") || is("cron") || is("crond") ||
+                is("anacron")) {
+            return kCron;
+        } else if (len >= 7 && std::memcmp(tag, "systemd", 7) == 0) {
+            return kSystemd;
+        } else if (is("kernel")) {
+            return kKernel;
+        } else if (is("sshd")) {
+            return kSshdNoPid;
+        }
+        return kOther;
+    }
+
+    uint64_t counts[kCategories] = {};
+};
+
+#endif  // LINE_PREFILTER_H
@@ -0,0 +1,362 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * A block scanner that splits a buffer of auth.log text into lines and
+ * locates the sshd fields of every line in a single pass.
+ *
+ * The buffer is examined 64 bytes at a time. Each block is turned into
+ * bit masks of newlines, brackets, spaces and the first letters of the
+ * key words using AVX2 or SSE compares when the CPU supports them, or a
+ * scalar loop otherwise. Shifting the space mask by one and intersecting
+ * it with the letter mask leaves only plausible word starts. The set bits
+ * are then walked in order: a newline ends a line, a word start is
+ * checked for "from", "port" or "Failed", and a bracket is checked for a
+ * preceding "sshd". The implementation is chosen once at run time from
+ * the CPU features.
+ */
+
+#ifndef LINE_SCANNER_H
+#define LINE_SCANNER_H
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <istream>
+#include <string>
+#include <vector>
+
+/** Offsets of one line and of its sshd fields; -1 when absent. */
+struct LineFields {
+    uint32_t begin;   // Offset of the line in the scanned buffer
+    uint32_t length;  // Length of the line without the '\n'
+    int32_t sshd;     // Offset of "sshd[" within the line
+    int32_t failed;   // Offset of "Failed " within the line
+    int32_t from;     // Offset of the address after " from "
+    int32_t port;     // Offset of the number after " port "
+};
+
+/**
+ * Bit masks for one 64-byte block; bit i describes byte i of the block.
+ * Word starts are found later by combining spaces with letters.
+ */
+struct BlockMasks {
+    uint64_t marks;    // '\n' and '[' bytes
+    uint64_t spaces;   // ' ' bytes
+    uint64_t letters;  // 'f', 'p' and 'F', the first letters of key words
+};
+
+/** Fills the masks for the 64 bytes at p. */
+using BlockMaskFn = void (*)(const char* p, BlockMasks& m);
+
+/**
+ * @return One bit per byte of w that equals the byte broadcast in c,
+ * using SWAR arithmetic on a 64-bit word.
+ */
+inline uint64_t swarBits(uint64_t w, uint64_t c) {
+    const uint64_t low7 = 0x7f7f7f7f7f7f7f7fULL;
+    uint64_t x = w ^ c;
+    // High bit of each byte is set exactly when that byte of x is zero
+    uint64_t zero = ~(((x & low7) + low7) | x | low7);
+    // Gather the eight high bits into the low byte
+    return ((zero >> 7) * 0x0102040810204080ULL) >> 56;
+}
+
+/** Portable version used when no vector unit is available. */
+inline void blockMaskScalar(const char* p, BlockMasks& m) {
+    const uint64_t ones = 0x0101010101010101ULL;
+    m = {0, 0, 0};
+    for (int i = 0; i < 8; i++) {
+        uint64_t w;
+        std::memcpy(&w, p + 8 * i, sizeof(w));
+        m.marks |= (swarBits(w, ones * '\n') | swarBits(w, ones * '['))
+            << (8 * i);
+        m.spaces |= swarBits(w, ones * ' ') << (8 * i);
+        m.letters |= (swarBits(w, ones * 'f') | swarBits(w, ones * 'p') |
+                swarBits(w, ones * 'F')) << (8 * i);
+    }
+}
+
+/** Four 16-byte SSE compares per character class. */
+__attribute__((target("sse4.2")))
+inline void blockMaskSse(const char* p, BlockMasks& m) {
+    const __m128i nl = _mm_set1_epi8('\n'), br = _mm_set1_epi8('['),
+        sp = _mm_set1_epi8(' '), f = _mm_set1_epi8('f'),
+        pl = _mm_set1_epi8('p'), cf = _mm_set1_epi8('F');
+    m = {0, 0, 0};
+    for (int i = 0; i < 4; i++) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+                    p + 16 * i));
+        __m128i marks = _mm_or_si128(_mm_cmpeq_epi8(v, nl),
+                _mm_cmpeq_epi8(v, br));
+        __m128i letters = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, f),
+                    _mm_cmpeq_epi8(v, pl)), _mm_cmpeq_epi8(v, cf));
+        m.marks |= static_cast<uint64_t>(static_cast<uint16_t>(
+                    _mm_movemask_epi8(marks))) << (16 * i);
+        m.spaces |= static_cast<uint64_t>(static_cast<uint16_t>(
+                    _mm_movemask_epi8(_mm_cmpeq_epi8(v, sp)))) << (16 * i);
+        m.letters |= static_cast<uint64_t>(static_cast<uint16_t>(
+                    _mm_movemask_epi8(letters))) << (16 * i);
+    }
+}
+
+/** Two 32-byte AVX2 compares per character class. */
+__attribute__((target("avx2")))
+inline void blockMaskAvx2(const char* p, BlockMasks& m) {
+    const __m256i nl = _mm256_set1_epi8('\n'), br = _mm256_set1_epi8('['),
+        sp = _mm256_set1_epi8(' '), f = _mm256_set1_epi8('f'),
+        pl = _mm256_set1_epi8('p'), cf = _mm256_set1_epi8('F');
+    uint64_t masks[3] = {0, 0, 0};
+    for (int i = 0; i < 2; i++) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(
+                    p + 32 * i));
+        __m256i marks = _mm256_or_si256(_mm256_cmpeq_epi8(v, nl),
+                _mm256_cmpeq_epi8(v, br));
+        __m256i letters = _mm256_or_si256(_mm256_or_si256(
+                    _mm256_cmpeq_epi8(v, f), _mm256_cmpeq_epi8(v, pl)),
+                _mm256_cmpeq_epi8(v, cf));
+        masks[0] |= static_cast<uint64_t>(static_cast<uint32_t>(
+                    _mm256_movemask_epi8(marks))) << (32 * i);
+        masks[1] |= static_cast<uint64_t>(static_cast<uint32_t>(
+                    _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, sp))))
+            << (32 * i);
+        masks[2] |= static_cast<uint64_t>(static_cast<uint32_t>(
+                    _mm256_movemask_epi8(letters))) << (32 * i);
+    }
+    m = {masks[0], masks[1], masks[2]};
+}
+
+/** A named block mask implementation. */
+struct ScannerImpl {
+    const char* name;
+    BlockMaskFn mask;
+};
+
+/** @return The fastest implementation this CPU supports. */
+inline ScannerImpl bestScanner() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return {"avx2", blockMaskAvx2};
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return {"sse4.2", blockMaskSse};
+    }
+    return {"scalar", blockMaskScalar};
+}
+
+/**
+ * Splits buf into complete lines and records their fields. Only newlines,
+ * brackets and key-word first letters that follow a space are visited,
+ * so most bytes of a line are never looked at individually.
+ * @param buf The text to be scanned.
+ * @param len The number of bytes in buf.
+ * @param out Receives one LineFields per complete line.
+ * @param mask The block mask implementation to use.
+ * @return The number of bytes consumed, i.e. the offset just past the
+ * last '\n'. Bytes after it belong to a line that is not yet complete.
+ */
+inline size_t scanLines(const char* buf, size_t len,
+        std::vector<LineFields>& out, BlockMaskFn mask) {
+    LineFields cur = {0, 0, -1, -1, -1, -1};
+    auto startsWith = [buf, len](size_t pos, const char* word, size_t n) {
+        return pos + n <= len && std::memcmp(buf + pos, word, n) == 0;
+    };
+    auto visit = [&](size_t p) {
+        int32_t rel = p - cur.begin;
+        switch (buf[p]) {
+        case '\n':
+            cur.length = rel;
+            out.push_back(cur);
+            cur = {static_cast<uint32_t>(p + 1), 0, -1, -1, -1, -1};
+            break;
+        case '[':
+            if (cur.sshd < 0 && rel >= 4 &&
+                std::memcmp(buf + p - 4, "sshd", 4) == 0) {
+                cur.sshd = rel - 4;
+            }
+            break;
+        case 'f':
+            if (cur.from < 0 && startsWith(p, "from ", 5)) {
+                cur.from = rel + 5;
+            }
+            break;
+        case 'p':
+            if (cur.port < 0 && startsWith(p, "port ", 5)) {
+                cur.port = rel + 5;
+            }
+            break;
+        default:  // 'F'
+            if (cur.failed < 0 && startsWith(p, "Failed ", 7)) {
+                cur.failed = rel;
+            }
+            break;
+        }
+    };
+    // A space in the last byte of a block precedes the next block's first
+    uint64_t carry = 0;
+    auto walk = [&](const char* p, size_t block) {
+        BlockMasks m;
+        mask(p, m);
+        uint64_t wordStarts = ((m.spaces << 1) | carry) & m.letters;
+        carry = m.spaces >> 63;
+        for (uint64_t bits = m.marks | wordStarts; bits != 0;
+             bits &= bits - 1) {
+            visit(block + __builtin_ctzll(bits));
+        }
+    };
+    size_t block = 0;
+    for (; block + 64 <= len; block += 64) {
+        walk(buf + block, block);
+    }
+    // The tail is shorter than a block; pad it so the mask can be reused
+    if (block < len) {
+        char tail[64];
+        std::memset(tail, 0, sizeof(tail));
+        std::memcpy(tail, buf + block, len - block);
+        walk(tail, block);
+    }
+    return cur.begin;
+}
+
+/**
+ * Collects text as it arrives, in pieces of any size, and hands out its
+ * complete lines together with the fields found by scanLines. Bytes after
+ * the last '\n' are kept until the rest of their line arrives.
+ */
+class LineBuffer {
+public:
+    /** @param mask The block mask implementation, normally
+     * bestScanner().mask. */
+    explicit LineBuffer(BlockMaskFn mask) : mask(mask) {}
+
+    /**
+     * Makes room for up to len more bytes. Fill them, then call commit()
+     * with the number actually written.
+     * @return Where the new bytes go.
+     */
+    char* prepare(size_t len) {
+        if (index == lines.size()) {
+            // Every line has been handed out; drop their bytes
+            buf.erase(buf.begin(), buf.begin() + consumed);
+            dropped += consumed;
+            lines.clear();
+            index = consumed = 0;
+        }
+        filled = buf.size();
+        buf.resize(filled + len);
+        return buf.data() + filled;
+    }
+
+    /** Scans the len bytes written after the last prepare(). */
+    void commit(size_t len) {
+        buf.resize(filled + len);
+        scan();
+    }
+
+    /** Copies len bytes into the buffer and scans them. */
+    void append(const char* data, size_t len) {
+        std::memcpy(prepare(len), data, len);
+        commit(len);
+    }
+
+    /** Ends the input; a final unterminated line becomes available. */
+    void finish() {
+        if (consumed < buf.size()) {
+            append("\n", 1);
+        }
+    }
+
+    /**
+     * Gets the next complete line (without its '\n') and its fields.
+     * @return Returns false if no complete line is buffered.
+     */
+    bool next(std::string& line, LineFields& fields) {
+        if (index == lines.size()) {
+            return false;
+        }
+        fields = lines[index++];
+        line.assign(buf.data() + fields.begin, fields.length);
+        lastOffset = dropped + fields.begin;
+        return true;
+    }
+
+    /** @return The offset in the whole input of the last line returned. */
+    uint64_t offset() const { return lastOffset; }
+
+private:
+    void scan() {
+        size_t first = lines.size(), base = consumed;
+        consumed += scanLines(buf.data() + base, buf.size() - base, lines,
+                mask);
+        // scanLines reports offsets relative to where it started
+        for (size_t i = first; i < lines.size(); i++) {
+            lines[i].begin += base;
+        }
+    }
+
+    BlockMaskFn mask;
+    std::vector<char> buf;
+    std::vector<LineFields> lines;
+    size_t index = 0, consumed = 0, filled = 0;
+    uint64_t dropped = 0;  // Bytes erased from the front so far
+    uint64_t lastOffset = 0;
+};
+
+/**
+ * Reads a stream in blocks of up to blockSize bytes and hands out its
+ * lines together with the fields found by scanLines, replacing
+ * std::getline followed by separate find calls. Each read takes what
+ * the stream has buffered rather than waiting for a full block.
+ */
+class BlockLineReader {
+public:
+    /**
+     * @param is The stream to be read, positioned at the first log line.
+     * @param mask The block mask implementation, normally
+     * bestScanner().mask.
+     * @param blockSize The most bytes taken per read.
+     */
+    BlockLineReader(std::istream& is, BlockMaskFn mask,
+            size_t blockSize = 1 << 20) : is(is), lines(mask),
+        blockSize(blockSize) {}
+
+    /**
+     * Gets the next line (without its '\n') and its fields.
+     * @return Returns false once the stream is exhausted.
+     */
+    bool next(std::string& line, LineFields& fields) {
+        while (!lines.next(line, fields)) {
+            if (eof) {
+                return false;
+            }
+            // Take what is buffered; only wait when nothing is, and then
+            // only for the next chunk, so a live source is never held
+            // back until a whole block has arrived
+            std::streamsize avail = is.rdbuf()->in_avail();
+            if (avail <= 0) {
+                avail = is.peek() == std::istream::traits_type::eof() ? 0 :
+                    is.rdbuf()->in_avail();
+            }
+            size_t len = std::min<size_t>(avail, blockSize);
+            is.read(lines.prepare(len), len);
+            std::streamsize got = is.gcount();
+            lines.commit(got);
+            if (got == 0) {
+                eof = true;
+                lines.finish();
+            }
+        }
+        return true;
+    }
+
+    /** @return The offset in the stream of the last line returned. */
+    uint64_t offset() const { return lines.offset(); }
+
+private:
+    std::istream& is;
+    LineBuffer lines;
+    size_t blockSize;
+    bool eof = false;
+};
+
+#endif  // LINE_SCANNER_H
@@ -0,0 +1,232 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * A precompiled, memory-mapped form of authorized_users.txt and
+ * banned_ips.txt for very large threat feeds.
+ *
+ * compileLookupImage() turns the text files into one binary image. Each
+ * list becomes a section holding the 64-bit FNV-1a hashes of its entries
+ * in Eytzinger (BFS) order, a parallel array of offsets into a blob of
+ * the entry strings, and the blob itself. Opening an image is a single
+ * mmap, so start-up costs O(1) regardless of size and every process that
+ * maps the same file shares its pages in the page cache. A lookup is a
+ * branch-free walk down the implicit search tree followed by one string
+ * comparison to confirm the match.
+ */
+
+#ifndef LOOKUP_IMAGE_H
+#define LOOKUP_IMAGE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/** The sections of an image, in file order. */
+enum LookupSection { kAuthSection = 0, kBanSection = 1 };
+
+/** Position and size of one section inside an image. */
+struct ImageSection {
+    uint64_t count;
+    uint64_t hashOffset;    // count + 1 uint64_t hashes, 1-based
+    uint64_t stringOffset;  // count + 1 uint64_t blob offsets, 1-based
+    uint64_t blobOffset;    // uint32_t length followed by the bytes
+    uint64_t blobSize;
+};
+
+/** The fixed header at the start of every image. */
+struct ImageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sections;
+    ImageSection section[2];
+};
+
+constexpr char kImageMagic[8] = {'H', 'D', 'L', 'K', 'U', 'P', 'I', 'M'};
+constexpr uint32_t kImageVersion = 1;
+
+/** A 64-bit FNV-1a hash; unlike std::hash it is stable across builds. */
+inline uint64_t imageHash(const char* data, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ static_cast<unsigned char>(data[i])) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/**
+ * Reads whitespace-separated entries, sorts them by hash and lays them
+ * out in Eytzinger order.
+ */
+inline void buildSection(const std::string& fileName,
+        std::vector<char>& out, ImageSection& sec) {
+    std::ifstream is(fileName);
+    if (!is.good()) {
+        throw std::runtime_error("Error opening file " + fileName);
+    }
+    std::vector<std::pair<uint64_t, std::string>> entries;
+    for (std::string entry; is >> entry;) {
+        entries.emplace_back(imageHash(entry.data(), entry.size()), entry);
+    }
+    std::sort(entries.begin(), entries.end());
+    entries.erase(std::unique(entries.begin(), entries.end()),
+            entries.end());
+    for (size_t i = 1; i < entries.size(); i++) {
+        if (entries[i].first == entries[i - 1].first) {
+            throw std::runtime_error("Hash collision between " +
+                    entries[i - 1].second + " and " + entries[i].second);
+        }
+    }
+    const size_t n = entries.size();
+    std::vector<uint64_t> hashes(n + 1, 0), strings(n + 1, 0);
+    std::vector<char> blob;
+    // An in-order walk of the implicit tree visits entries in sorted order
+    size_t next = 0;
+    std::vector<size_t> stack;
+    for (size_t k = 1; k <= n || !stack.empty();) {
+        if (k <= n) {
+            stack.push_back(k);
+            k = 2 * k;
+            continue;
+        }
+        k = stack.back();
+        stack.pop_back();
+        const std::string& key = entries[next].second;
+        hashes[k] = entries[next++].first;
+        strings[k] = blob.size();
+        uint32_t len = key.size();
+        blob.insert(blob.end(), reinterpret_cast<char*>(&len),
+                reinterpret_cast<char*>(&len) + sizeof(len));
+        blob.insert(blob.end(), key.begin(), key.end());
+        k = 2 * k + 1;
+    }
+    auto append = [&out](const void* data, size_t size) {
+        // Keep every array 8-byte aligned
+        out.resize((out.size() + 7) & ~size_t(7));
+        uint64_t offset = out.size();
+        const char* p = static_cast<const char*>(data);
+        out.insert(out.end(), p, p + size);
+        return offset;
+    };
+    sec.count = n;
+    sec.hashOffset = append(hashes.data(), hashes.size() * sizeof(uint64_t));
+    sec.stringOffset = append(strings.data(),
+            strings.size() * sizeof(uint64_t));
+    sec.blobOffset = append(blob.data(), blob.size());
+    sec.blobSize = blob.size();
+}
+
+/**
+ * Compiles the two lookup files into a binary image. The image is written
+ * to a temporary file and renamed into place, so readers (including the
+ * --watch reloader) never see a partial image.
+ * @param authFile Typically "authorized_users.txt".
+ * @param banFile Typically "banned_ips.txt".
+ * @param imageFile The image to be created or replaced.
+ */
+inline void compileLookupImage(const std::string& authFile,
+        const std::string& banFile, const std::string& imageFile) {
+    ImageHeader header = {};
+    std::memcpy(header.magic, kImageMagic, sizeof(kImageMagic));
+    header.version = kImageVersion;
+    header.sections = 2;
+    std::vector<char> out(sizeof(header));
+    buildSection(authFile, out, header.section[kAuthSection]);
+    buildSection(banFile, out, header.section[kBanSection]);
+    std::memcpy(out.data(), &header, sizeof(header));
+    const std::string tmp = imageFile + ".tmp";
+    std::ofstream os(tmp, std::ios::binary);
+    if (!os.write(out.data(), out.size()) || (os.close(), !os)) {
+        throw std::runtime_error("Error writing file " + tmp);
+    }
+    if (std::rename(tmp.c_str(), imageFile.c_str()) != 0) {
+        throw std::runtime_error("Error renaming " + tmp);
+    }
+}
+
+/** A read-only view of a compiled image mapped into memory. */
+class LookupImage {
+public:
+    /** Maps the image; throws if it is missing or malformed. */
+    explicit LookupImage(const std::string& fileName) {
+        int fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            throw std::runtime_error("Error opening file " + fileName);
+        }
+        size = st.st_size;
+        void* p = size >= sizeof(ImageHeader) ?
+            mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (p == MAP_FAILED) {
+            throw std::runtime_error("Error mapping file " + fileName);
+        }
+        base = static_cast<const char*>(p);
+        std::memcpy(&header, base, sizeof(header));
+        if (std::memcmp(header.magic, kImageMagic, sizeof(kImageMagic)) ||
+            header.version != kImageVersion || header.sections != 2 ||
+            !valid(header.section[0]) || !valid(header.section[1])) {
+            munmap(const_cast<char*>(base), size);
+            throw std::runtime_error("Invalid lookup image " + fileName);
+        }
+    }
+
+    ~LookupImage() { munmap(const_cast<char*>(base), size); }
+    LookupImage(const LookupImage&) = delete;
+    LookupImage& operator=(const LookupImage&) = delete;
+
+    /** @return Returns true if key is an entry of the given section. */
+    bool contains(LookupSection which, const char* key, size_t len) const {
+        const ImageSection& sec = header.section[which];
+        const uint64_t* hashes = reinterpret_cast<const uint64_t*>(
+                base + sec.hashOffset);
+        const uint64_t x = imageHash(key, len);
+        size_t k = 1;
+        while (k <= sec.count) {
+            // Fetch the cache line holding the node three levels down
+            __builtin_prefetch(hashes + 8 * k);
+            k = 2 * k + (hashes[k] < x);
+        }
+        // Undo the trailing right turns to find the lower bound
+        k >>= __builtin_ffsll(~k);
+        if (k == 0 || hashes[k] != x) {
+            return false;
+        }
+        uint64_t offset = reinterpret_cast<const uint64_t*>(
+                base + sec.stringOffset)[k];
+        uint32_t stored;
+        std::memcpy(&stored, base + sec.blobOffset + offset, sizeof(stored));
+        return stored == len && std::memcmp(base + sec.blobOffset + offset +
+                sizeof(stored), key, len) == 0;
+    }
+
+    /** @return The number of entries in the given section. */
+    size_t count(LookupSection which) const {
+        return header.section[which].count;
+    }
+
+private:
+    bool valid(const ImageSection& sec) const {
+        uint64_t arrays = (sec.count + 1) * sizeof(uint64_t);
+        return sec.hashOffset + arrays <= size &&
+            sec.stringOffset + arrays <= size &&
+            sec.blobOffset + sec.blobSize <= size;
+    }
+
+    const char* base = nullptr;
+    size_t size = 0;
+    ImageHeader header;
+};
+
+#endif  // LOOKUP_IMAGE_H
@@ -0,0 +1,365 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * The authorized-user and banned-IP lookups, and a store that lets them
+ * be replaced while detection keeps running.
+ *
+ * The current lookups are published through an atomic pointer. Readers
+ * load the pointer without taking any lock and, between lines, announce
+ * that they no longer hold a reference (quiescent-state based
+ * reclamation). A writer swaps in a new object and frees the old one only
+ * after every registered reader has passed a quiescent state. A watcher
+ * thread uses inotify to rebuild the lookups when the files change.
+ */
+
+#ifndef LOOKUP_STORE_H
+#define LOOKUP_STORE_H
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "bloom_filter.h"
+#include "lookup_image.h"
+
+/** Synonym for an unordered map that is used to track banned IPs and
+ * authorized users. For example, the key in this map would be IP addresses
+ * and the value is just a place holder (is always set to true).
+ */
+using LookupMap = std::unordered_map<std::string, bool>;
+
+/**
+ * Helper method to load data from a given file into an unordered map.
+ *
+ * @param fileName The file name from words are are to be read by this
+ * method. The parameter value is typically "authorized_users.txt" or
+ * "banned_ips.txt".
+ *
+ * @return Return an unordered map with the
+ */
+inline LookupMap loadLookup(const std::string& fileName) {
+    // Open the file and check to ensure that the stream is valid
+    std::ifstream is(fileName);
+    if (!is.good()) {
+        throw std::runtime_error("Error opening file " + fileName);
+    }
+    // The look up map to be populated by this method.
+    LookupMap lookup;
+    // Load the entries into the unordered map
+    for (std::string entry; is >> entry;) {
+        lookup[entry] = true;
+    }
+    // Return the loaded unordered map back to the caller.
+    return lookup;
+}
+
+/**
+ * Calls found for each word of a log line until it returns true. Words
+ * are runs of letters, digits, '.', '-' and '_', so IPs and user names
+ * are seen whole (e.g. "user=mysql" yields "user" and "mysql").
+ * @return Returns true if found returned true for some word.
+ */
+template <typename Found>
+bool anyWord(const std::string& line, Found found) {
+    auto isWordChar = [](char c) {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+            (c >= 'A' && c <= 'Z') || c == '.' || c == '-' || c == '_';
+    };
+    for (size_t i = 0; i < line.size();) {
+        if (!isWordChar(line[i])) {
+            i++;
+            continue;
+        }
+        size_t start = i;
+        while (i < line.size() && isWordChar(line[i])) {
+            i++;
+        }
+        if (found(line.data() + start, i - start)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Checks whether any word of a log line is a key in the lookup. This
+ * costs one hash probe per word regardless of how large the lookup is.
+ * @param line A string of the current login attempt report being assessed.
+ * @param keys The lookup to be probed.
+ * @return Returns true if any word of the line is in the lookup.
+ */
+inline bool containsKey(const std::string& line, const LookupMap& keys) {
+    if (keys.empty()) {
+        return false;
+    }
+    std::string word;
+    return anyWord(line, [&](const char* data, size_t len) {
+        word.assign(data, len);
+        return keys.find(word) != keys.end();
+    });
+}
+
+/** @return The hash a word is added to and probed in a filter with. */
+inline uint64_t wordHash(const char* data, size_t len) {
+    return std::hash<std::string_view>()(std::string_view(data, len));
+}
+
+/**
+ * Builds one filter holding the keys of both lookups.
+ * @param bitsPerKey The filter size; see BlockedBloom.
+ */
+inline std::shared_ptr<const BlockedBloom> buildLookupFilter(
+        const LookupMap& authUser, const LookupMap& banIP,
+        double bitsPerKey = 10) {
+    std::shared_ptr<BlockedBloom> filter = std::make_shared<BlockedBloom>(
+            authUser.size() + banIP.size(), bitsPerKey);
+    for (const LookupMap* keys : {&authUser, &banIP}) {
+        for (const auto& entry : *keys) {
+            filter->add(wordHash(entry.first.data(), entry.first.size()));
+        }
+    }
+    return filter;
+}
+
+/**
+ * Checks whether any word of a log line is a key in the lookup, probing
+ * the filter first. Only words the filter cannot rule out are copied and
+ * looked up exactly, so a word that is in neither lookup usually costs
+ * one cache line instead of a probe of a table far larger than the cache.
+ * @param filter A filter holding at least every key of keys.
+ */
+inline bool containsKey(const std::string& line, const LookupMap& keys,
+        const BlockedBloom& filter) {
+    if (keys.empty()) {
+        return false;
+    }
+    std::string word;
+    return anyWord(line, [&](const char* data, size_t len) {
+        if (!filter.mayContain(wordHash(data, len))) {
+            return false;
+        }
+        word.assign(data, len);
+        return keys.find(word) != keys.end();
+    });
+}
+
+/**
+ * Checks whether any word of a log line is an entry in one section of a
+ * compiled lookup image.
+ */
+inline bool containsKey(const std::string& line, const LookupImage& image,
+        LookupSection which) {
+    if (image.count(which) == 0) {
+        return false;
+    }
+    return anyWord(line, [&](const char* data, size_t len) {
+        return image.contains(which, data, len);
+    });
+}
+
+/**
+ * Both lookup lists, always replaced together. When image is set the
+ * lists come from a compiled image and the two maps are left empty.
+ * When filter is set it holds the keys of both maps and is probed before
+ * them.
+ */
+struct Lookups {
+    LookupMap authUser;
+    LookupMap banIP;
+    std::shared_ptr<const LookupImage> image;
+    std::shared_ptr<const BlockedBloom> filter;
+};
+
+class LookupStore {
+public:
+    /** Builds a complete Lookups object; may throw on bad input. */
+    using Loader = std::function<std::unique_ptr<Lookups>()>;
+
+    /** The Readers a store makes room for unless told otherwise. */
+    static constexpr size_t kDefaultReaders = 64;
+
+    /**
+     * A registered reader. get() is wait-free; the reference it returns
+     * stays valid until the next call to quiescent() on this reader.
+     */
+    class Reader {
+    public:
+        explicit Reader(LookupStore& store) : store(store) {
+            slot = store.claimSlot();
+        }
+        ~Reader() { store.readers[slot].store(kOffline); }
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+
+        const Lookups& get() const { return *store.current.load(); }
+
+        /** Announces that no reference from get() is held any more. */
+        void quiescent() {
+            store.readers[slot].store(store.epoch.load());
+        }
+
+        /**
+         * Announces that no reference from get() is held until the next
+         * quiescent(), e.g. while blocked on a quiet source, so that a
+         * publish does not wait for this reader.
+         */
+        void offline() { store.readers[slot].store(kOffline); }
+
+    private:
+        LookupStore& store;
+        size_t slot;
+    };
+
+    /**
+     * Loads the initial lookups. Errors from the first load are passed
+     * on to the caller, just as they are without hot reloading.
+     * @param maxReaders The most Readers that may exist at the same time,
+     * e.g. one per thread of a pool that reads the lookups.
+     */
+    explicit LookupStore(Loader loader,
+            size_t maxReaders = kDefaultReaders) : loader(loader),
+        readerCount(maxReaders ? maxReaders : 1),
+        readers(new std::atomic<uint64_t>[readerCount]) {
+        for (size_t i = 0; i < readerCount; i++) {
+            readers[i].store(kOffline);
+        }
+        current.store(loader().release());
+    }
+
+    ~LookupStore() {
+        stopWatching();
+        delete current.load();
+    }
+
+    LookupStore(const LookupStore&) = delete;
+    LookupStore& operator=(const LookupStore&) = delete;
+
+    /**
+     * Replaces the lookups and frees the previous ones once every reader
+     * has moved past them. Only one writer may publish at a time.
+     */
+    void publish(std::unique_ptr<Lookups> next) {
+        const Lookups* old = current.exchange(next.release());
+        uint64_t target = ++epoch;
+        for (size_t i = 0; i < readerCount; i++) {
+            const auto& r = readers[i];
+            for (uint64_t seen = r.load(); seen != kOffline && seen < target;
+                 seen = r.load()) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+        delete old;
+        version++;
+    }
+
+    /**
+     * Rebuilds the lookups with the loader and publishes them. A failed
+     * rebuild (e.g. a file that is half written) keeps the old lookups.
+     * @return Returns true if new lookups were published.
+     */
+    bool reload() {
+        std::unique_ptr<Lookups> next;
+        try {
+            next = loader();
+        } catch (const std::exception&) {
+            failures++;
+            return false;
+        }
+        publish(std::move(next));
+        return true;
+    }
+
+    /**
+     * Starts a thread that reloads the lookups whenever one of the named
+     * files in dir is written, created or renamed into place.
+     */
+    void watch(const std::string& dir, std::vector<std::string> files) {
+        stopWatching();
+        int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (ifd < 0 || inotify_add_watch(ifd, dir.c_str(), IN_CLOSE_WRITE |
+                    IN_MOVED_TO | IN_CREATE) < 0) {
+            if (ifd >= 0) {
+                close(ifd);
+            }
+            throw std::runtime_error("Error watching directory " + dir);
+        }
+        stopFd = eventfd(0, EFD_CLOEXEC);
+        watcher = std::thread([this, ifd, files] {
+            watchLoop(ifd, files);
+            close(ifd);
+        });
+    }
+
+    /** Stops the watcher thread, if one is running. */
+    void stopWatching() {
+        if (watcher.joinable()) {
+            uint64_t one = 1;
+            if (write(stopFd, &one, sizeof(one)) < 0) {
+                // The watcher also wakes up once a second on its own
+            }
+            watcher.join();
+            close(stopFd);
+        }
+    }
+
+    /** @return The number of times the lookups have been replaced. */
+    uint64_t reloads() const { return version.load(); }
+
+    /** @return The number of reloads rejected because loading failed. */
+    uint64_t failedReloads() const { return failures.load(); }
+
+private:
+    static constexpr uint64_t kOffline = UINT64_MAX;
+
+    size_t claimSlot() {
+        for (size_t i = 0; i < readerCount; i++) {
+            uint64_t expected = kOffline;
+            if (readers[i].compare_exchange_strong(expected, epoch.load())) {
+                return i;
+            }
+        }
+        throw std::runtime_error("Too many lookup readers");
+    }
+
+    void watchLoop(int ifd, const std::vector<std::string>& files) {
+        alignas(inotify_event) char buf[4096];
+        pollfd fds[2] = {{ifd, POLLIN, 0}, {stopFd, POLLIN, 0}};
+        while (poll(fds, 2, 1000) >= 0 && !(fds[1].revents & POLLIN)) {
+            bool changed = false;
+            for (ssize_t n; (n = read(ifd, buf, sizeof(buf))) > 0;) {
+                for (char* p = buf; p < buf + n;) {
+                    auto* ev = reinterpret_cast<inotify_event*>(p);
+                    for (const auto& f : files) {
+                        changed |= ev->len > 0 && f == ev->name;
+                    }
+                    p += sizeof(inotify_event) + ev->len;
+                }
+            }
+            if (changed) {
+                reload();
+            }
+        }
+    }
+
+    Loader loader;
+    std::atomic<const Lookups*> current{nullptr};
+    std::atomic<uint64_t> epoch{1};
+    size_t readerCount;
+    std::unique_ptr<std::atomic<uint64_t>[]> readers;
+    std::atomic<uint64_t> version{0};
+    std::atomic<uint64_t> failures{0};
+    std::thread watcher;
+    int stopFd = -1;
+};
+
+#endif  // LOOKUP_STORE_H
@@ -0,0 +1,221 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * A time-ordered k-way merge of several log streams, so that one detector
+ * can correlate attempts made against many hosts.
+ *
+ * Each stream first passes through a small reordering buffer (a min-heap
+ * of its next few lines), which absorbs the slight disorder syslog
+ * produces within one host. The heads of the buffers are then merged
+ * with a loser tree: after the smallest line is taken, only the path
+ * from its leaf to the root is replayed, so each line costs
+ * O(log k) comparisons for k streams.
+ */
+
+#ifndef MERGE_H
+#define MERGE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+#include "line_scanner.h"
+
+/**
+ * A tournament tree of losers over k leaves. Each internal node holds the
+ * leaf that lost the match played there, and node 0 holds the overall
+ * winner. Leaves that are exhausted lose to every live leaf; ties go to
+ * the lower leaf index so the merge is deterministic.
+ */
+template <typename Key, typename Less = std::less<Key>>
+class LoserTree {
+public:
+    /** @param k The number of leaves (input streams). */
+    explicit LoserTree(size_t k) : k(k), keys(k), live(k, false) {
+        for (width = 1; width < k; width *= 2) {}
+        tree.assign(width, k);
+    }
+
+    /** Sets the key of a leaf before build(), or marks it exhausted. */
+    void set(size_t leaf, const Key& key, bool isLive = true) {
+        keys[leaf] = key;
+        live[leaf] = isLive;
+    }
+
+    /** Plays every match; call once after the initial set() calls. */
+    void build() { tree[0] = play(1); }
+
+    /** @return The winning leaf, or k if every leaf is exhausted. */
+    size_t top() const {
+        return tree[0] < k && live[tree[0]] ? tree[0] : k;
+    }
+
+    /**
+     * Gives the winning leaf a new key, or marks it exhausted, and
+     * replays its path to the root.
+     */
+    void replace(const Key& key, bool isLive = true) {
+        size_t winner = tree[0];
+        keys[winner] = key;
+        live[winner] = isLive;
+        for (size_t node = (winner + width) / 2; node > 0; node /= 2) {
+            if (beats(tree[node], winner)) {
+                std::swap(tree[node], winner);
+            }
+        }
+        tree[0] = winner;
+    }
+
+private:
+    /** @return Returns true if leaf a wins against leaf b. */
+    bool beats(size_t a, size_t b) const {
+        bool aLive = a < k && live[a], bLive = b < k && live[b];
+        if (aLive != bLive) {
+            return aLive;
+        }
+        if (!aLive || (!less(keys[a], keys[b]) && !less(keys[b], keys[a]))) {
+            return a < b;
+        }
+        return less(keys[a], keys[b]);
+    }
+
+    /** Plays the subtree at node, records its loser, returns its winner. */
+    size_t play(size_t node) {
+        if (node >= width) {
+            return node - width;
+        }
+        size_t left = play(2 * node), right = play(2 * node + 1);
+        bool leftWins = beats(left, right);
+        tree[node] = leftWins ? right : left;
+        return leftWins ? left : right;
+    }
+
+    size_t k;
+    size_t width;
+    std::vector<Key> keys;
+    std::vector<bool> live;
+    std::vector<size_t> tree;
+    Less less;
+};
+
+/**
+ * Merges several line readers into one stream ordered by timestamp.
+ * Reader is any type with bool next(std::string&, LineFields&) and
+ * uint64_t offset(), such as BlockLineReader. An empty line ends a
+ * stream, as it ends a log in process(). Lines that arrive more than the
+ * reorder depth out of order within their stream are emitted as soon as
+ * they surface rather than being held back indefinitely.
+ */
+template <typename Reader>
+class MergedLines {
+public:
+    /** Converts the leading timestamp of a line to seconds. */
+    using Clock = std::function<uint32_t(const std::string&)>;
+
+    /**
+     * @param readers The streams to be merged; they must outlive this.
+     * @param clock Extracts the time of a line.
+     * @param reorder The number of lines buffered per stream (at least 1).
+     */
+    MergedLines(std::vector<Reader*> readers, Clock clock, size_t reorder) :
+        readers(readers), clock(clock),
+        reorder(std::max<size_t>(reorder, 1)), streams(readers.size()),
+        tree(readers.size()) {
+        for (size_t i = 0; i < readers.size(); i++) {
+            fill(i);
+            Stream& s = streams[i];
+            tree.set(i, s.heap.empty() ? Order() : s.heap.front().order,
+                    !s.heap.empty());
+        }
+        tree.build();
+    }
+
+    /**
+     * Gets the earliest buffered line of all streams.
+     * @return Returns false once every stream has ended.
+     */
+    bool next(std::string& line, LineFields& fields) {
+        size_t i = tree.top();
+        if (i == readers.size()) {
+            return false;
+        }
+        Stream& s = streams[i];
+        std::pop_heap(s.heap.begin(), s.heap.end(), later);
+        line.swap(s.heap.back().line);
+        fields = s.heap.back().fields;
+        lastOffset = s.heap.back().offset;
+        s.heap.pop_back();
+        fill(i);
+        tree.replace(s.heap.empty() ? Order() : s.heap.front().order,
+                !s.heap.empty());
+        return true;
+    }
+
+    /** @return The offset of the last line returned within its stream. */
+    uint64_t offset() const { return lastOffset; }
+
+private:
+    /** Time first, then arrival order within the stream. */
+    struct Order {
+        uint32_t time = 0;
+        uint64_t seq = 0;
+
+        bool operator<(const Order& o) const {
+            return time != o.time ? time < o.time : seq < o.seq;
+        }
+    };
+
+    struct Pending {
+        Order order;
+        std::string line;
+        LineFields fields;
+        uint64_t offset = 0;
+    };
+
+    struct Stream {
+        std::vector<Pending> heap;  // Min-heap on order
+        bool ended = false;
+        uint64_t seq = 0;
+    };
+
+    static bool later(const Pending& a, const Pending& b) {
+        return b.order < a.order;
+    }
+
+    /** Tops up stream i's reordering buffer from its reader. */
+    void fill(size_t i) {
+        Stream& s = streams[i];
+        while (!s.ended && s.heap.size() < reorder) {
+            Pending p;
+            if (!readers[i]->next(p.line, p.fields) || p.line.empty()) {
+                s.ended = true;
+                break;
+            }
+            // Streams advance together, so the last timestamp converted
+            // for any stream is usually this line's too
+            if (p.line.compare(0, kStampLength, lastStamp) != 0) {
+                lastStamp = p.line.substr(0, kStampLength);
+                lastTime = clock(lastStamp);
+            }
+            p.order = {lastTime, s.seq++};
+            p.offset = readers[i]->offset();
+            s.heap.push_back(std::move(p));
+            std::push_heap(s.heap.begin(), s.heap.end(), later);
+        }
+    }
+
+    // Length of "Aug 29 11:01:01"
+    static constexpr size_t kStampLength = 15;
+
+    std::vector<Reader*> readers;
+    Clock clock;
+    size_t reorder;
+    std::vector<Stream> streams;
+    LoserTree<Order> tree;
+    std::string lastStamp;
+    uint32_t lastTime = 0;
+    uint64_t lastOffset = 0;
+};
+
+#endif  // MERGE_H
@@ -0,0 +1,440 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * Blocks flagged source addresses by adding them to an nftables set.
+ *
+ * Running the nft command once per alert would spawn thousands of
+ * processes during a flood. Instead, BanAction collects newly flagged
+ * addresses and NftSet writes each batch to the kernel as a single
+ * nf_tables transaction over one netlink socket: a batch-begin message,
+ * NEWSETELEM messages carrying the addresses, and a batch-end message,
+ * applied atomically. Batches are written by a thread of their own at
+ * most once per interval unless they fill up, so a flood costs a few
+ * system calls and detection never waits on the kernel. Messages are
+ * built by hand, so neither libmnl nor libnftnl is needed.
+ *
+ * The set is created (along with its table) if it does not exist, as a
+ * set of ipv4_addr, so a rule such as
+ *     ip saddr @blocked drop
+ * can refer to it. This needs CAP_NET_ADMIN; it can be tried out
+ * without touching the host's firewall inside a network namespace,
+ * e.g. with "unshare -n".
+ */
+
+#ifndef NFT_SET_H
+#define NFT_SET_H
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netlink.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "flat_map.h"
+
+/** The nftables data type id of ipv4_addr, as nft names set key types. */
+constexpr uint32_t kNftTypeIPv4 = 7;
+
+/** Builds a sequence of netlink messages in one buffer. */
+class NetlinkBatch {
+public:
+    /** Starts a message with an nfgenmsg header. */
+    void begin(uint16_t type, uint16_t flags, uint8_t family,
+            uint16_t resId, uint32_t seq) {
+        start = buf.size();
+        nlmsghdr hdr = {};
+        hdr.nlmsg_type = type;
+        hdr.nlmsg_flags = flags;
+        hdr.nlmsg_seq = seq;
+        append(&hdr, sizeof(hdr));
+        nfgenmsg gen = {};
+        gen.nfgen_family = family;
+        gen.version = NFNETLINK_V0;
+        gen.res_id = htons(resId);
+        append(&gen, sizeof(gen));
+    }
+
+    /** Ends the current message. */
+    void end() { header(start)->nlmsg_len = buf.size() - start; }
+
+    void put(uint16_t type, const void* data, size_t len) {
+        nlattr attr = {static_cast<uint16_t>(NLA_HDRLEN + len), type};
+        append(&attr, sizeof(attr));
+        append(data, len);
+    }
+
+    void put(uint16_t type, const std::string& text) {
+        put(type, text.c_str(), text.size() + 1);
+    }
+
+    void putBe32(uint16_t type, uint32_t value) {
+        value = htonl(value);
+        put(type, &value, sizeof(value));
+    }
+
+    void putBe64(uint16_t type, uint64_t value) {
+        value = htobe64(value);
+        put(type, &value, sizeof(value));
+    }
+
+    /** Opens a nested attribute; close it with the returned offset. */
+    size_t nest(uint16_t type) {
+        size_t at = buf.size();
+        nlattr attr = {NLA_HDRLEN, static_cast<uint16_t>(type |
+                    NLA_F_NESTED)};
+        append(&attr, sizeof(attr));
+        return at;
+    }
+
+    void close(size_t at) {
+        reinterpret_cast<nlattr*>(&buf[at])->nla_len = buf.size() - at;
+    }
+
+    const std::vector<char>& data() const { return buf; }
+    void clear() { buf.clear(); }
+
+private:
+    nlmsghdr* header(size_t at) {
+        return reinterpret_cast<nlmsghdr*>(&buf[at]);
+    }
+
+    void append(const void* data, size_t len) {
+        const char* p = static_cast<const char*>(data);
+        buf.insert(buf.end(), p, p + len);
+        buf.resize(NLMSG_ALIGN(buf.size()));
+    }
+
+    std::vector<char> buf;
+    size_t start = 0;
+};
+
+/** An nftables set of IPv4 addresses written through netlink. */
+class NftSet {
+public:
+    /**
+     * Opens the netlink socket and creates the table and set if needed.
+     * @param table The table, in the inet family.
+     * @param set The set of ipv4_addr within it.
+     * @param timeouts Create the set with timeout support, so elements
+     * may be added with an expiry.
+     */
+    NftSet(const std::string& table, const std::string& set,
+            bool timeouts) : table(table), set(set) {
+        if (table.empty() || set.empty()) {
+            throw std::runtime_error("An nftables table and set name are "
+                    "both needed");
+        }
+        fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+        if (fd < 0) {
+            throw std::runtime_error("Error opening netfilter netlink "
+                    "socket: " + std::string(std::strerror(errno)));
+        }
+        int size = 4 << 20;
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        timeval wait = {2, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+        sockaddr_nl local = {};
+        local.nl_family = AF_NETLINK;
+        if (bind(fd, reinterpret_cast<sockaddr*>(&local),
+                    sizeof(local)) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Error binding netlink socket");
+        }
+        NetlinkBatch batch;
+        uint32_t first = openBatch(batch);
+        batch.begin(message(NFT_MSG_NEWTABLE), kCreate, NFPROTO_INET, 0,
+                seq++);
+        batch.put(NFTA_TABLE_NAME, table);
+        batch.end();
+        batch.begin(message(NFT_MSG_NEWSET), kCreate, NFPROTO_INET, 0,
+                seq++);
+        batch.put(NFTA_SET_TABLE, table);
+        batch.put(NFTA_SET_NAME, set);
+        batch.putBe32(NFTA_SET_FLAGS, timeouts ? NFT_SET_TIMEOUT : 0);
+        batch.putBe32(NFTA_SET_KEY_TYPE, kNftTypeIPv4);
+        batch.putBe32(NFTA_SET_KEY_LEN, 4);
+        batch.putBe32(NFTA_SET_ID, 1);
+        batch.end();
+        commit(batch, first);
+    }
+
+    ~NftSet() { ::close(fd); }
+    NftSet(const NftSet&) = delete;
+    NftSet& operator=(const NftSet&) = delete;
+
+    /**
+     * Adds addresses to the set in one transaction. Addresses already in
+     * the set are not an error.
+     * @param ips The addresses, in host byte order.
+     * @param timeout Seconds until the elements expire; 0 = never.
+     */
+    void add(const std::vector<uint32_t>& ips, uint32_t timeout) {
+        const size_t perMessage = 1024;
+        NetlinkBatch batch;
+        uint32_t first = openBatch(batch);
+        for (size_t from = 0; from < ips.size(); from += perMessage) {
+            batch.begin(message(NFT_MSG_NEWSETELEM), kCreate, NFPROTO_INET,
+                    0, seq++);
+            batch.put(NFTA_SET_ELEM_LIST_TABLE, table);
+            batch.put(NFTA_SET_ELEM_LIST_SET, set);
+            size_t list = batch.nest(NFTA_SET_ELEM_LIST_ELEMENTS);
+            for (size_t i = from; i < ips.size() && i < from + perMessage;
+                 i++) {
+                size_t elem = batch.nest(NFTA_LIST_ELEM);
+                size_t key = batch.nest(NFTA_SET_ELEM_KEY);
+                uint32_t addr = htonl(ips[i]);
+                batch.put(NFTA_DATA_VALUE, &addr, sizeof(addr));
+                batch.close(key);
+                if (timeout > 0) {
+                    batch.putBe64(NFTA_SET_ELEM_TIMEOUT, timeout * 1000ULL);
+                }
+                batch.close(elem);
+            }
+            batch.close(list);
+            batch.end();
+        }
+        commit(batch, first);
+    }
+
+    std::string name() const { return "inet " + table + " " + set; }
+
+private:
+    static constexpr uint16_t kCreate = NLM_F_REQUEST | NLM_F_CREATE |
+        NLM_F_ACK;
+
+    static uint16_t message(uint16_t type) {
+        return (NFNL_SUBSYS_NFTABLES << 8) | type;
+    }
+
+    /** Starts a transaction. @return The sequence number of its first
+     * acknowledged message. */
+    uint32_t openBatch(NetlinkBatch& batch) {
+        batch.begin(NFNL_MSG_BATCH_BEGIN, NLM_F_REQUEST, AF_UNSPEC,
+                NFNL_SUBSYS_NFTABLES, seq++);
+        batch.end();
+        return seq;
+    }
+
+    /**
+     * Ends the transaction, sends it and waits for every message from
+     * first on to be acknowledged. Throws with the kernel's error.
+     */
+    void commit(NetlinkBatch& batch, uint32_t first) {
+        const uint32_t last = seq;
+        batch.begin(NFNL_MSG_BATCH_END, NLM_F_REQUEST, AF_UNSPEC,
+                NFNL_SUBSYS_NFTABLES, seq++);
+        batch.end();
+        sockaddr_nl kernel = {};
+        kernel.nl_family = AF_NETLINK;
+        const std::vector<char>& out = batch.data();
+        if (sendto(fd, out.data(), out.size(), 0,
+                    reinterpret_cast<sockaddr*>(&kernel),
+                    sizeof(kernel)) < 0) {
+            throw std::runtime_error("Error sending to nftables: " +
+                    std::string(std::strerror(errno)));
+        }
+        std::vector<char> in(1 << 16);
+        for (uint32_t acked = first; acked < last;) {
+            ssize_t n = recv(fd, in.data(), in.size(), 0);
+            if (n < 0) {
+                throw std::runtime_error("No answer from nftables: " +
+                        std::string(std::strerror(errno)));
+            }
+            int len = n;
+            for (nlmsghdr* h = reinterpret_cast<nlmsghdr*>(in.data());
+                 NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+                if (h->nlmsg_type != NLMSG_ERROR) {
+                    continue;
+                }
+                const nlmsgerr* err = static_cast<const nlmsgerr*>(
+                        NLMSG_DATA(h));
+                if (err->error != 0) {
+                    throw std::runtime_error("nftables rejected " +
+                            name() + ": " + std::strerror(-err->error));
+                }
+                acked = std::max(acked, h->nlmsg_seq + 1);
+            }
+        }
+    }
+
+    std::string table, set;
+    int fd = -1;
+    uint32_t seq = static_cast<uint32_t>(time(nullptr));
+};
+
+/**
+ * Collects newly flagged addresses and hands them to an NftSet in
+ * batches. offer() only queues an address; a worker thread of its own
+ * writes a batch once it holds maxBatch addresses, or once interval has
+ * passed since the last write, so detector threads never wait on
+ * netlink and a partial batch is written within interval. An address is
+ * sent once per timeout: with a timeout it is offered again after its
+ * set element has expired. Safe to call from several detector threads.
+ */
+class BanAction {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * @param set Where the addresses go.
+     * @param interval The longest time a partial batch waits, and the
+     * shortest time between two partial batches.
+     * @param maxBatch The most addresses written in one transaction.
+     * @param timeout Seconds until a blocked address expires; 0 = never.
+     */
+    BanAction(NftSet& set, std::chrono::milliseconds interval,
+            size_t maxBatch = 8192, uint32_t timeout = 0) : set(set),
+        interval(interval), maxBatch(maxBatch ? maxBatch : 1),
+        timeout(timeout), last(Clock::now()) {
+        worker = std::thread([this] { run(); });
+    }
+
+    /** Writes whatever is still queued and stops the worker. */
+    ~BanAction() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        queued.notify_one();
+        worker.join();
+    }
+
+    BanAction(const BanAction&) = delete;
+    BanAction& operator=(const BanAction&) = delete;
+
+    /** Queues ip for blocking unless it is already blocked. */
+    void offer(uint32_t ip) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (timeout > 0) {
+            expire(Clock::now());
+        }
+        if (sent.find(ip) != nullptr) {
+            return;
+        }
+        sent.insert(ip);
+        pending.push_back(ip);
+        // The worker only needs waking to start the interval or to write
+        // a full batch early
+        if (pending.size() == 1 || pending.size() == maxBatch) {
+            queued.notify_one();
+        }
+    }
+
+    /** Writes whatever is still queued and waits for it, e.g. at the end
+     * of the input. */
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        flushing = true;
+        queued.notify_one();
+        written.wait(lock, [this] { return pending.empty() && !writing; });
+        flushing = false;
+    }
+
+    /** @return A one-line account of what was blocked. */
+    std::string report() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string text = "Blocked " + std::to_string(blocked) +
+            " addresses in " + set.name() + " with " +
+            std::to_string(transactions) + " transactions.";
+        if (failed > 0) {
+            text += " " + std::to_string(failed) + " addresses could not "
+                "be blocked: " + error;
+        }
+        return text;
+    }
+
+private:
+    /** Forgets addresses whose set element has expired. */
+    void expire(Clock::time_point now) {
+        while (!expiries.empty() && expiries.front().first <= now) {
+            sent.erase(expiries.front().second);
+            expiries.pop_front();
+        }
+    }
+
+    /** The worker: writes each batch outside the lock. */
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            if (pending.empty()) {
+                if (stopping) {
+                    return;
+                }
+                queued.wait(lock);
+                continue;
+            }
+            queued.wait_until(lock, last + interval, [this] {
+                return pending.size() >= maxBatch || flushing || stopping;
+            });
+            size_t n = std::min(pending.size(), maxBatch);
+            std::vector<uint32_t> batch(pending.begin(),
+                    pending.begin() + n);
+            pending.erase(pending.begin(), pending.begin() + n);
+            writing = true;
+            lock.unlock();
+            std::string problem;
+            try {
+                set.add(batch, timeout);
+            } catch (const std::exception& e) {
+                problem = e.what();
+            }
+            lock.lock();
+            writing = false;
+            last = Clock::now();
+            if (problem.empty()) {
+                blocked += batch.size();
+                transactions++;
+                // The elements' timeouts started with this write
+                if (timeout > 0) {
+                    Clock::time_point until = last +
+                        std::chrono::seconds(timeout);
+                    for (uint32_t ip : batch) {
+                        expiries.emplace_back(until, ip);
+                    }
+                }
+            } else {
+                // Forget them, so they are tried again if offered again
+                for (uint32_t ip : batch) {
+                    sent.erase(ip);
+                }
+                failed += batch.size();
+                error = problem;
+            }
+            written.notify_all();
+        }
+    }
+
+    NftSet& set;
+    std::chrono::milliseconds interval;
+    size_t maxBatch;
+    uint32_t timeout;
+    Clock::time_point last;  // When the last batch was written
+    std::mutex mutex;
+    std::condition_variable queued, written;
+    // Every address queued or in the set; with a timeout, expiries
+    // holds the written ones in the order their elements expire
+    FlatMap<uint32_t, bool> sent;
+    std::deque<std::pair<Clock::time_point, uint32_t>> expiries;
+    std::vector<uint32_t> pending;
+    bool writing = false, flushing = false, stopping = false;
+    size_t blocked = 0, failed = 0, transactions = 0;
+    std::string error;  // Why the last failed batch was rejected
+    std::thread worker;
+};
+
+#endif  // NFT_SET_H
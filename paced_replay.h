@@ -0,0 +1,163 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * A load generator that replays a captured log with its original timing,
+ * for sizing hardware and finding where the detector saturates.
+ *
+ * A producer thread reads the log and groups its lines by timestamp. Each
+ * group is due at the wall-clock time its timestamp maps to, scaled by
+ * the replay speed (1 = real time, 10 = ten times faster, 0 = as fast as
+ * possible), and is held back until then. Due groups go into a bounded
+ * queue that the detector drains, so when the detector falls behind the
+ * producer blocks and the lag shows up as latency instead of memory.
+ */
+
+#ifndef PACED_REPLAY_H
+#define PACED_REPLAY_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <istream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+class PacedLines {
+public:
+    using Clock = std::chrono::steady_clock;
+    /** Converts the leading timestamp of a line to seconds. */
+    using Stamp = std::function<uint32_t(const std::string&)>;
+
+    /** Complete lines that became due together. */
+    struct Chunk {
+        std::string text;
+        Clock::time_point due;
+        bool eof = false;
+    };
+
+    /**
+     * Starts the producer thread.
+     * @param is The captured log, positioned at its first line.
+     * @param stamp Extracts the time of a line.
+     * @param speed How many times faster than real time; 0 = unpaced.
+     * @param maxQueued The most chunks waiting for the detector.
+     */
+    PacedLines(std::istream& is, Stamp stamp, double speed,
+            size_t maxQueued = 256) : is(is), stamp(stamp), speed(speed),
+        maxQueued(maxQueued), producer([this] { run(); }) {}
+
+    ~PacedLines() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopped = true;
+        }
+        changed.notify_all();
+        producer.join();
+    }
+
+    PacedLines(const PacedLines&) = delete;
+    PacedLines& operator=(const PacedLines&) = delete;
+
+    /**
+     * Takes the next due chunk. The last chunk has eof set.
+     * @param wait Whether to wait for a chunk if none is due yet.
+     * @return Returns false if wait was false and no chunk was due.
+     */
+    bool pop(Chunk& chunk, bool wait) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (wait) {
+            changed.wait(lock, [this] { return !queue.empty(); });
+        } else if (queue.empty()) {
+            return false;
+        }
+        chunk = std::move(queue.front());
+        queue.pop_front();
+        lock.unlock();
+        changed.notify_all();
+        return true;
+    }
+
+    /** @return The largest delay between a chunk's due time and its
+     * delivery, in seconds; non-zero once the detector falls behind. */
+    double maxLag() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return lag;
+    }
+
+private:
+    void run() {
+        const size_t maxChunk = 64 << 10;
+        Chunk chunk;
+        Clock::time_point origin;
+        uint32_t first = 0, current = 0;
+        bool started = false;
+        for (std::string line; std::getline(is, line) && !line.empty();) {
+            uint32_t t = stamp(line);
+            if (!started) {
+                started = true;
+                origin = Clock::now();
+                first = current = t;
+                chunk.due = origin;
+            }
+            if ((t != current || chunk.text.size() >= maxChunk) &&
+                !chunk.text.empty() && !push(chunk)) {
+                return;
+            }
+            if (t != current) {
+                current = t;
+                // Later timestamps only; a line from the past is due now
+                double offset = speed > 0 && t > first ?
+                    (t - first) / speed : 0;
+                chunk.due = std::max(chunk.due, origin +
+                        std::chrono::duration_cast<Clock::duration>(
+                            std::chrono::duration<double>(offset)));
+            }
+            chunk.text.append(line).push_back('\n');
+        }
+        if (!chunk.text.empty() && !push(chunk)) {
+            return;
+        }
+        chunk.eof = true;
+        push(chunk);
+    }
+
+    /** Waits until chunk is due and there is room, then queues it. */
+    bool push(Chunk& chunk) {
+        if (speed > 0) {
+            std::this_thread::sleep_until(chunk.due);
+        } else {
+            chunk.due = Clock::now();
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] {
+            return stopped || queue.size() < maxQueued;
+        });
+        if (stopped) {
+            return false;
+        }
+        lag = std::max(lag, std::chrono::duration<double>(Clock::now() -
+                    chunk.due).count());
+        Clock::time_point due = chunk.due;
+        queue.push_back(std::move(chunk));
+        chunk = Chunk();
+        chunk.due = due;
+        lock.unlock();
+        changed.notify_all();
+        return true;
+    }
+
+    std::istream& is;
+    Stamp stamp;
+    double speed;
+    size_t maxQueued;
+    mutable std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<Chunk> queue;
+    bool stopped = false;
+    double lag = 0;
+    std::thread producer;
+};
+
+#endif  // PACED_REPLAY_H
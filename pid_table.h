@@ -0,0 +1,139 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * Per-process state indexed directly by PID.
+ *
+ * The user key of the frequency rule is the PID in "sshd[NNNNN]", a small
+ * bounded integer, so its state needs neither a hash nor a key copy: it
+ * lives at slot[pid] of one array covering every PID Linux can hand out
+ * (PID_MAX_LIMIT, 2^22). The array is an anonymous mapping reserved but
+ * not committed, so only the pages of PIDs actually seen are ever
+ * touched. Each slot carries the generation it was written in. A slot
+ * whose generation is not the table's is empty, which lets a single PID
+ * be reset when it is reused by a new process and the whole table be
+ * cleared without touching a page.
+ */
+
+#ifndef PID_TABLE_H
+#define PID_TABLE_H
+
+#include <sys/mman.h>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <string>
+#include <type_traits>
+
+/** One more than the largest PID the kernel allows (PID_MAX_LIMIT). */
+constexpr uint32_t kPidLimit = 1U << 22;
+
+/**
+ * Parses the PID of an sshd key such as "12345" or "1234]".
+ * @param text The text holding the PID.
+ * @param pos The offset of its first digit.
+ * @return The PID, or 0 if no digits start at pos or the PID is out of
+ * range; no sshd process has PID 0.
+ */
+inline uint32_t parsePid(const std::string& text, size_t pos) {
+    uint32_t pid = 0;
+    size_t end = pos;
+    for (; end < text.size() && text[end] >= '0' && text[end] <= '9'; end++) {
+        pid = pid * 10 + (text[end] - '0');
+        if (pid >= kPidLimit) {
+            return 0;
+        }
+    }
+    return pid;
+}
+
+template <typename Value>
+class PidTable {
+    // Slots live in memory the kernel zero-fills and are never destroyed
+    static_assert(std::is_trivially_copyable<Value>::value,
+            "PidTable values must be trivially copyable");
+
+public:
+    PidTable() {
+        void* p = mmap(nullptr, bytes(), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        slots = static_cast<Slot*>(p);
+    }
+
+    ~PidTable() { munmap(slots, bytes()); }
+
+    PidTable(const PidTable&) = delete;
+    PidTable& operator=(const PidTable&) = delete;
+
+    /** @return Returns true if pid has a slot, i.e. 0 < pid < kPidLimit. */
+    static bool covers(uint32_t pid) { return pid > 0 && pid < kPidLimit; }
+
+    /** @return The state of pid, or nullptr if it has none. */
+    Value* find(uint32_t pid) {
+        Slot& slot = slots[pid];
+        return slot.generation == generation ? &slot.value : nullptr;
+    }
+
+    const Value* find(uint32_t pid) const {
+        return const_cast<PidTable*>(this)->find(pid);
+    }
+
+    /**
+     * Gives pid fresh, default-constructed state, dropping whatever an
+     * earlier process with the same PID left behind.
+     * @return The new state.
+     */
+    Value& reset(uint32_t pid) {
+        Slot& slot = slots[pid];
+        if (slot.generation != generation) {
+            live++;
+        }
+        slot.generation = generation;
+        slot.value = Value();
+        return slot.value;
+    }
+
+    /** Drops the state of pid. */
+    void erase(uint32_t pid) {
+        if (slots[pid].generation == generation) {
+            slots[pid].generation = 0;
+            live--;
+        }
+    }
+
+    /**
+     * Drops the state of every PID at once by starting a new generation.
+     * Only when the counter wraps are the pages handed back to the
+     * kernel, which refills them with zeros.
+     */
+    void clear() {
+        if (++generation == 0) {
+            madvise(slots, bytes(), MADV_DONTNEED);
+            generation = 1;
+        }
+        live = 0;
+    }
+
+    /** Starts loading the slot of pid into cache. */
+    void prefetch(uint32_t pid) const {
+        __builtin_prefetch(&slots[pid]);
+    }
+
+    /** @return The number of PIDs that have state. */
+    size_t size() const { return live; }
+
+private:
+    struct Slot {
+        uint32_t generation;  // Zero in pages never touched
+        Value value;
+    };
+
+    static size_t bytes() { return sizeof(Slot) * size_t(kPidLimit); }
+
+    Slot* slots = nullptr;
+    uint32_t generation = 1;
+    size_t live = 0;
+};
+
+#endif  // PID_TABLE_H
@@ -0,0 +1,361 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * Bounded-memory sliding-window counters used by the frequency rules.
+ *
+ * Each tracked key owns a small ring buffer holding the timestamps of its
+ * most recent attempts, so checking "more than N attempts in W seconds" is
+ * O(1) per event. Keys that have been idle for a whole window are expired
+ * through a timing wheel, and the number of keys is capped so that a
+ * botnet with millions of source addresses cannot exhaust memory.
+ */
+
+#ifndef RATE_TRACKER_H
+#define RATE_TRACKER_H
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "flat_map.h"
+#include "pid_table.h"
+
+/** The largest threshold a RingWindow can hold timestamps for. */
+constexpr int kMaxRing = 16;
+
+/**
+ * @return The threshold t, after checking that a ring can hold it.
+ * @throws std::runtime_error if t is not between 1 and kMaxRing.
+ */
+inline int checkThreshold(int t) {
+    if (t < 1 || t > kMaxRing) {
+        throw std::runtime_error("Threshold " + std::to_string(t) +
+                " is not between 1 and " + std::to_string(kMaxRing));
+    }
+    return t;
+}
+
+/**
+ * A fixed-size ring of the most recent attempt times for one key. When
+ * the ring is full, the slot at head is the oldest timestamp.
+ */
+struct RingWindow {
+    std::array<uint32_t, kMaxRing> times;
+    uint8_t head = 0;
+    uint8_t count = 0;
+
+    /**
+     * Records an attempt and checks the frequency rule.
+     * @param now The time of the attempt in seconds since Epoch.
+     * @param window The length of the sliding window in seconds.
+     * @param threshold The number of attempts allowed inside a window
+     * (must be between 1 and kMaxRing).
+     * @return Returns true if this attempt makes more than threshold
+     * attempts inside the window.
+     */
+    bool record(uint32_t now, long window, int threshold) {
+        bool hit = count == threshold &&
+            static_cast<long>(now) - static_cast<long>(times[head]) < window;
+        times[head] = now;
+        head = (head + 1 == threshold) ? 0 : head + 1;
+        if (count < threshold) {
+            count++;
+        }
+        return hit;
+    }
+};
+
+/**
+ * A RingWindow whose window and threshold are compile-time constants.
+ * The timestamps are kept oldest first and shifted by one on every
+ * attempt; with Threshold known the shift and the comparison unroll into
+ * a few straight-line moves with no index arithmetic or branches.
+ */
+template <long Window, int Threshold>
+struct FixedRingWindow {
+    static_assert(Threshold >= 1 && Threshold <= kMaxRing,
+            "threshold out of range");
+    std::array<uint32_t, Threshold> times;
+    uint8_t count = 0;
+
+    /**
+     * Records an attempt and checks the frequency rule. The runtime
+     * window and threshold are ignored; they exist so RateTracker can use
+     * either ring type.
+     */
+    bool record(uint32_t now, long, int) {
+        bool hit = count == Threshold &&
+            static_cast<long>(now) - static_cast<long>(times[0]) < Window;
+        for (int i = 0; i + 1 < Threshold; i++) {
+            times[i] = times[i + 1];
+        }
+        times[Threshold - 1] = now;
+        count += count < Threshold;
+        return hit;
+    }
+};
+
+/**
+ * A timing wheel with one slot per second of the window. A key is placed
+ * in the slot for the second it was last touched, and when the wheel
+ * turns past that slot the owner is asked whether the key has expired.
+ * Keys may sit in more than one slot; owners must ignore stale entries.
+ */
+template <typename Key>
+class TimingWheel {
+public:
+    /**
+     * @param slots The number of one-second slots, normally the window
+     * length plus one.
+     */
+    explicit TimingWheel(size_t slots) : slots(slots ? slots : 1) {}
+
+    /** Schedules key for an expiry check once the wheel passes now. */
+    void schedule(const Key& key, uint32_t now) {
+        slots[now % slots.size()].push_back(key);
+    }
+
+    /**
+     * Turns the wheel up to now and hands each key in the passed slots
+     * to the supplied callback, which decides whether to expire it.
+     */
+    template <typename Expire>
+    void advance(uint32_t now, Expire expire) {
+        if (tick == 0) {
+            tick = now;
+        }
+        if (now <= tick) {
+            return;
+        }
+        // Never sweep more than one full revolution
+        uint32_t from = (now - tick > slots.size()) ?
+            now - slots.size() : tick;
+        for (uint32_t t = from + 1; t <= now; t++) {
+            drain(t % slots.size(), expire);
+        }
+        tick = now;
+    }
+
+    /**
+     * Drains slots starting at the oldest until the callback reports
+     * that enough keys were removed. Used to enforce a capacity limit.
+     * The callback also receives the slot index so it can skip keys that
+     * were touched again after being placed in that slot.
+     */
+    template <typename Evict>
+    void evictOldest(Evict evict) {
+        for (size_t i = 1; i <= slots.size(); i++) {
+            size_t idx = (tick + i) % slots.size();
+            auto& slot = slots[idx];
+            while (!slot.empty()) {
+                Key key = slot.back();
+                slot.pop_back();
+                if (evict(key, idx)) {
+                    return;
+                }
+            }
+        }
+    }
+
+    /** @return The number of one-second slots in the wheel. */
+    size_t size() const { return slots.size(); }
+
+    /** Calls visit for each key in slot idx, stale entries included. */
+    template <typename Visit>
+    void forEach(size_t idx, Visit visit) const {
+        for (const Key& key : slots[idx]) {
+            visit(key);
+        }
+    }
+
+private:
+    template <typename Expire>
+    void drain(size_t idx, Expire& expire) {
+        std::vector<Key> due;
+        due.swap(slots[idx]);
+        for (const Key& key : due) {
+            expire(key);
+        }
+    }
+
+    std::vector<std::vector<Key>> slots;
+    uint32_t tick = 0;
+};
+
+/**
+ * Tracks "more than threshold attempts in window seconds" for an
+ * arbitrary key type (user, source IP, subnet prefix) with a hard limit
+ * on the number of keys held in memory. Ring is RingWindow, or a
+ * FixedRingWindow when the rule parameters are known at compile time.
+ */
+template <typename Key, typename Ring = RingWindow,
+          typename Hash = std::hash<Key>>
+class RateTracker {
+public:
+    /**
+     * @param window The length of the sliding window in seconds.
+     * @param threshold The number of attempts allowed inside a window.
+     * @param maxKeys The largest number of keys tracked at once. When the
+     * limit is reached the least recently seen keys are evicted first.
+     */
+    RateTracker(long window, int threshold, size_t maxKeys) :
+        window(window), threshold(checkThreshold(threshold)),
+        maxKeys(maxKeys ? maxKeys : 1), wheel(window + 1) {}
+
+    /**
+     * Records an attempt for the given key.
+     * @return Returns true if the key has exceeded the threshold.
+     */
+    bool record(const Key& key, uint32_t now) {
+        wheel.advance(now, [this, now](const Key& k) { expire(k, now); });
+        Entry* entry = state.find(key);
+        if (entry == nullptr) {
+            if (state.size() >= maxKeys) {
+                makeRoom();
+            }
+            entry = &state.insert(key);
+        }
+        if (entry->lastSeen != now) {
+            wheel.schedule(key, now);
+            entry->lastSeen = now;
+        }
+        return entry->ring.record(now, window, threshold);
+    }
+
+    /**
+     * Starts loading key's window state into cache so that a later
+     * record() for key does not stall on it. Callers issue this a few
+     * keys ahead so the misses of nearby keys overlap.
+     */
+    void prefetch(const Key& key) const { state.prefetch(key); }
+
+    /** @return Returns true if the key currently has window state. */
+    bool contains(const Key& key) const {
+        return state.find(key) != nullptr;
+    }
+
+    /** @return The number of keys currently held in memory. */
+    size_t size() const { return state.size(); }
+
+    /** @return The number of live keys dropped to respect maxKeys. */
+    size_t evictions() const { return evicted; }
+
+private:
+    struct Entry {
+        Ring ring;
+        uint32_t lastSeen = 0;
+    };
+
+    void expire(const Key& key, uint32_t now) {
+        const Entry* entry = state.find(key);
+        if (entry != nullptr &&
+            static_cast<long>(entry->lastSeen) + window <= now) {
+            state.erase(key);
+        }
+    }
+
+    void makeRoom() {
+        wheel.evictOldest([this](const Key& key, size_t idx) {
+            const Entry* entry = state.find(key);
+            if (entry != nullptr && entry->lastSeen % wheel.size() == idx) {
+                state.erase(key);
+                evicted++;
+            }
+            return state.size() < maxKeys;
+        });
+    }
+
+    long window;
+    int threshold;
+    size_t maxKeys;
+    size_t evicted = 0;
+    FlatMap<Key, Entry, Hash> state;
+    TimingWheel<Key> wheel;
+};
+
+/**
+ * The same rule as RateTracker for keys that are sshd PIDs, with the
+ * state of each PID at a fixed index of a PidTable. Nothing is hashed,
+ * and nothing needs a cap since the table covers every possible PID. A
+ * PID idle for a whole window is treated as a new process, as the
+ * RateTracker would have expired it, so a reused PID starts over.
+ */
+template <typename Ring = RingWindow>
+class PidRateTracker {
+public:
+    PidRateTracker(long window, int threshold) : window(window),
+        threshold(checkThreshold(threshold)) {}
+
+    /**
+     * Records an attempt by pid, which PidTable::covers.
+     * @return Returns true if pid has exceeded the threshold.
+     */
+    bool record(uint32_t pid, uint32_t now) {
+        Entry* entry = state.find(pid);
+        if (entry == nullptr ||
+            static_cast<long>(entry->lastSeen) + window <= now) {
+            entry = &state.reset(pid);
+        }
+        entry->lastSeen = now;
+        return entry->ring.record(now, window, threshold);
+    }
+
+    /** Starts loading pid's window state into cache. */
+    void prefetch(uint32_t pid) const { state.prefetch(pid); }
+
+    /** @return The number of PIDs that have had window state. */
+    size_t size() const { return state.size(); }
+
+private:
+    struct Entry {
+        Ring ring;
+        uint32_t lastSeen;
+    };
+
+    long window;
+    int threshold;
+    PidTable<Entry> state;
+};
+
+/**
+ * Parses a dotted-quad IPv4 address starting at pos.
+ * @param line The text holding the address.
+ * @param pos The offset of the first digit.
+ * @param ip Set to the address in host byte order on success.
+ * @return Returns true if a valid address starts at pos.
+ */
+inline bool parseIPv4(const std::string& line, size_t pos, uint32_t& ip) {
+    uint32_t addr = 0;
+    for (int octet = 0; octet < 4; octet++) {
+        if (pos >= line.size() || line[pos] < '0' || line[pos] > '9') {
+            return false;
+        }
+        uint32_t value = 0;
+        while (pos < line.size() && line[pos] >= '0' && line[pos] <= '9') {
+            value = value * 10 + (line[pos++] - '0');
+            if (value > 255) {
+                return false;
+            }
+        }
+        addr = (addr << 8) | value;
+        if (octet < 3 && (pos >= line.size() || line[pos++] != '.')) {
+            return false;
+        }
+    }
+    ip = addr;
+    return true;
+}
+
+/**
+ * Extracts the IPv4 source address that sshd logs after " from ".
+ * @param line A string of the current login attempt report being assessed.
+ * @param ip Set to the address in host byte order on success.
+ * @return Returns true if the line contained a dotted-quad source address.
+ */
+inline bool parseSourceIP(const std::string& line, uint32_t& ip) {
+    size_t pos = line.find(" from ");
+    return pos != std::string::npos && parseIPv4(line, pos + 6, ip);
+}
+
+#endif  // RATE_TRACKER_H
@@ -9,6 +9,12 @@
  *
  *   2. unless an user is in the "authorized list", if an user has
  *      attempted to login more than 3 times in a span of 20 seconds,
+ *
+ * With --source-rules, failed attempts are also counted per source IP
+ * and per /24 subnet so that an attacker spraying many users from one
+ * address, or a botnet spread across one subnet, is also flagged. With
+ * --spray, an account attacked from too many distinct IPs (password
+ * spraying) is flagged as well.
  */
 
 
@@ -20,19 +26,37 @@
 #include <vector>
 #include <stdexcept>
 #include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <boost/asio.hpp>
+#include "ingest.h"
+#include "line_scanner.h"
+#include "line_prefilter.h"
+#include "merge.h"
+#include "uring_reader.h"
+#include "paced_replay.h"
+#include "watermark.h"
+#include "alert_suppressor.h"
+#include "alert_queue.h"
+#include "nft_set.h"
+#include "learned_bans.h"
+#include "event_index.h"
+#include "event_archive.h"
+#include "lookup_store.h"
+#include "rate_tracker.h"
+#include "count_min.h"
+#include "frequency_rule.h"
+#include "top_k.h"
+#include "hyperloglog.h"
+#include "benchmarks.h"
 
 // Convenience namespace declarations to streamline the code below
 using namespace boost::asio;
 using namespace boost::asio::ip;
 // using namespace std;
 
-/** Synonym for an unordered map that is used to track banned IPs and 
- * authorized users. For example, the key in this map would be IP addresses
- * and the value is just a place holder (is always set to true).
- */
-using LookupMap = std::unordered_map<std::string, bool>;
-
 /**
  * An unordered map to track the seconds for each log entry associated
  * with each user. The user ID is the key into this unordered map.
@@ -45,29 +69,251 @@ using LookupMap = std::unordered_map<std::string, bool>;
 using LoginTimes = std::unordered_map<std::string, std::vector<long>>;
 
 /**
- * Helper method to load data from a given file into an unordered map.
- * 
- * @param fileName The file name from words are are to be read by this 
- * method. The parameter value is typically "authorized_users.txt" or
- * "banned_ips.txt".
- * 
- * @return Return an unordered map with the 
+ * Tunable parameters for the frequency rules. With sourceRules, the
+ * defaults flag an IP with more than 5 failures, or a /24 subnet with
+ * more than 10 failures, in a span of 20 seconds.
  */
-LookupMap loadLookup(const std::string& fileName) {
-    // Open the file and check to ensure that the stream is valid
-    std::ifstream is(fileName);
-    if (!is.good()) {
-        throw std::runtime_error("Error opening file " + fileName);
+struct DetectorConfig {
+    // The per-IP and per-subnet rules are off unless asked for, so the
+    // default output is that of the original two rules
+    bool sourceRules = false;
+    long sourceWindow = 20;
+    int ipThreshold = 5;
+    int subnetThreshold = 10;
+    // Upper bound on the number of IPs (and subnets) tracked at once
+    size_t maxTrackedSources = 1 << 20;
+    // The per-user rule. Legacy mode, the default, uses the original
+    // LoginTimes vectors (checkLog). Otherwise the rule is more than
+    // userThreshold attempts within userWindow seconds over ring buffers
+    // (see makeUserRule), or, in approximate mode, over a fixed-size
+    // windowed Count-Min Sketch instead of exact state.
+    bool approximate = false;
+    bool legacyFrequency = true;
+    long userWindow = 20;
+    int userThreshold = 3;
+    size_t maxTrackedUsers = 1 << 20;
+    size_t sketchBytes = 8 << 20;
+    // Upper bound on users promoted to exact tracking by the sketch
+    size_t maxConfirmedUsers = 1 << 16;
+    // Heavy-hitter reporting: how many entries to print (0, the default,
+    // counts and prints nothing), how many Space-Saving counters to keep,
+    // and how often (in lines) to print a snapshot while processing (0
+    // prints only the final summary)
+    size_t topK = 0;
+    size_t topKCounters = 256;
+    int snapshotEvery = 0;
+    // Number of lines parsed into columns before the rules run over them
+    size_t batchSize = 4096;
+    // Rows ahead of the current one whose rule state is prefetched; 0 = off
+    size_t prefetchDistance = 16;
+    // Pool threads used when reading several sources; 0 = one per core
+    size_t jobs = 0;
+    // Share one detector between all sources instead of one per source
+    bool mergeHosts = false;
+    // Interleave all sources by timestamp into one detector
+    bool timeMerge = false;
+    // Lines of each source buffered to absorb out-of-order timestamps
+    size_t reorderDepth = 64;
+    // Seconds a line may trail the newest before it is late; -1 = off
+    long allowedLateness = -1;
+    // When set, an event index of the log is written to this file, its
+    // postings written out a period of indexBucket seconds at a time
+    std::string indexFile;
+    uint32_t indexBucket = 600;
+    // When set, the parsed events are also written to this columnar
+    // archive, which --replay can run the detector over later
+    std::string exportFile;
+    // After an alert, further alerts for the same key (account, source
+    // address, subnet) within suppressWindow seconds are only counted and
+    // summarized once the window closes; 0 reports every alerting line
+    long suppressWindow = 0;
+    size_t maxSuppressedKeys = 1 << 18;
+    // When set, alerts are published to these sinks through their queues
+    // instead of being printed by the detecting thread; owned by main
+    AlertBus* alerts = nullptr;
+    // When set, the source address of every alerting line is added to
+    // an nftables set in batches; owned by main
+    BanAction* banAction = nullptr;
+    // When set, the sources of window-rule alerts are banned here for a
+    // while, and their lines are then decided by the lookup phase; owned
+    // by main and saved to learnedBanFile, if given, at the end and
+    // whenever banSaveEvery seconds of event time or banSaveCount new
+    // bans have passed since the last save
+    LearnedBans* learnedBans = nullptr;
+    std::string learnedBanFile;
+    long banSaveEvery = 60;
+    size_t banSaveCount = 1000;
+    // Reload authorized_users.txt and banned_ips.txt when they change
+    bool watchLookups = false;
+    // When set, the lookups are mapped from this compiled image (see
+    // compileLookupImage) instead of being parsed from the text files
+    std::string lookupImage;
+    // Probe a Bloom filter built from both text lookups before them
+    bool lookupFilter = true;
+    // Spray rule (off unless asked for): more than sprayThreshold
+    // distinct source IPs against one account within roughly sprayWindow
+    // seconds
+    bool sprayRule = false;
+    long sprayWindow = 60;
+    int sprayThreshold = 10;
+    size_t maxSprayUsers = 1 << 18;
+};
+
+/** Streaming heavy-hitter counters for attacking IPs and target accounts. */
+using TopSources = SpaceSaving<uint32_t>;
+using TopTargets = SpaceSaving<std::string>;
+
+/** Sliding-window counters keyed by IPv4 address or by /24 prefix. */
+using SourceTracker = RateTracker<uint32_t>;
+
+/**
+ * Suppression windows keyed by the alert reason code followed by what
+ * the alert is about, e.g. "4IP 10.0.0.1" (see alertKey).
+ */
+using AlertWindows = AlertSuppressor<std::string>;
+
+/**
+ * A batch of log lines stored as columns (struct of arrays). The parse
+ * phase fills the per-line fields, each rule then runs as one loop over
+ * the columns it needs and records its result in its own column, and
+ * alerts are only emitted once every rule has run.
+ */
+struct LineBatch {
+    size_t size = 0;
+    std::vector<std::string> line;
+    std::vector<LineFields> fields;
+    std::vector<uint64_t> offset;  // Where each line starts in its input
+    // Parsed columns
+    std::vector<uint32_t> time;
+    std::vector<std::string> user;    // The key inside "sshd[...]"
+    std::vector<uint32_t> pid;        // Its PID, or 0 if not a number
+    std::vector<std::string> target;  // Account named in a failed attempt
+    std::vector<uint32_t> ip;
+    std::vector<uint8_t> hasIP;
+    std::vector<uint8_t> failed;
+    // Set for lines that arrived after the watermark passed their time
+    std::vector<uint8_t> late;
+    // Rule results; verdict is a processHelper reason code or 0
+    std::vector<uint8_t> authorized;
+    std::vector<uint8_t> verdict;
+    std::vector<uint8_t> userHit;
+    std::vector<uint8_t> sourceHit;
+    std::vector<uint8_t> sprayHit;
+    // The last timestamp converted, since neighboring lines share it
+    std::string lastStamp;
+    uint32_t lastTime = 0;
+    // Set once append() has filled the time column, so parseBatch keeps it
+    bool timed = false;
+
+    /** Sizes every column for n lines, reusing their memory. */
+    void resize(size_t n) {
+        size = n;
+        line.resize(n);
+        fields.resize(n);
+        offset.resize(n);
+        time.resize(n);
+        user.resize(n);
+        pid.resize(n);
+        target.resize(n);
+        ip.resize(n);
+        hasIP.resize(n);
+        failed.resize(n);
+        late.resize(n);
+        authorized.resize(n);
+        verdict.resize(n);
+        userHit.resize(n);
+        sourceHit.resize(n);
+        sprayHit.resize(n);
     }
-    // The look up map to be populated by this method.
-    LookupMap lookup;
-    // Load the entries into the unordered map
-    for (std::string entry; is >> entry;) {
-        lookup[entry] = true;
+
+    /**
+     * Adds a row holding line, its fields and its already converted time,
+     * growing every column.
+     */
+    void append(std::string& text, const LineFields& f, uint64_t at,
+            uint32_t t, bool isLate) {
+        if (size == line.size()) {
+            size_t rows = size;
+            resize(rows + rows / 2 + 16);
+            size = rows;
+        }
+        line[size].swap(text);
+        fields[size] = f;
+        offset[size] = at;
+        time[size] = t;
+        late[size] = isLate;
+        timed = true;
+        size++;
     }
-    // Return the loaded unordered map back to the caller.
-    return lookup;
-}
+};
+
+/**
+ * A line waiting in the event-time buffer. Lines from the same second are
+ * released in text order, so the result does not depend on arrival order.
+ */
+struct PendingLine {
+    std::string line;
+    LineFields fields;
+    uint64_t offset;
+    uint32_t time;  // The event time the watermark ordered it by
+
+    bool operator<(const PendingLine& other) const {
+        return line < other.line;
+    }
+};
+
+/** Everything process() keeps from one batch to the next. */
+struct DetectorState {
+    explicit DetectorState(const DetectorConfig& cfg) : cfg(cfg),
+        ipRate(cfg.sourceWindow, cfg.ipThreshold, cfg.maxTrackedSources),
+        subnetRate(cfg.sourceWindow, cfg.subnetThreshold,
+                cfg.maxTrackedSources),
+        spray(cfg.sprayWindow, cfg.sprayThreshold, cfg.maxSprayUsers),
+        topIPs(cfg.topKCounters), topUsers(cfg.topKCounters),
+        userRule(cfg.legacyFrequency ? nullptr : cfg.approximate ?
+                new SketchUserRule(cfg.userWindow, cfg.userThreshold,
+                    cfg.sketchBytes, cfg.maxConfirmedUsers) :
+                makeUserRule(cfg.userWindow, cfg.userThreshold,
+                    cfg.maxTrackedUsers).release()),
+        pending(cfg.allowedLateness < 0 ? nullptr :
+                new WatermarkBuffer<PendingLine>(cfg.allowedLateness)),
+        index(cfg.indexFile.empty() ? nullptr :
+                new EventIndexWriter(cfg.indexFile, cfg.indexBucket)),
+        archive(cfg.exportFile.empty() ? nullptr :
+                new ArchiveWriter(cfg.exportFile)),
+        suppressor(cfg.suppressWindow <= 0 ? nullptr :
+                new AlertWindows(cfg.suppressWindow,
+                    cfg.maxSuppressedKeys)) {}
+
+    DetectorConfig cfg;
+    LoginTimes log;
+    SourceTracker ipRate;
+    SourceTracker subnetRate;
+    SprayDetector spray;
+    TopSources topIPs;
+    TopTargets topUsers;
+    std::unique_ptr<UserRule> userRule;  // Null in legacy mode
+    int lineCount = 0, hackAtt = 0;
+    // The multiple of cfg.snapshotEvery the last snapshot was taken at
+    int snapshotAt = 0;
+    // Lines not written by sshd are dropped here and counted
+    LinePrefilter prefilter;
+    // With --lateness, lines wait here until the watermark passes them
+    std::unique_ptr<WatermarkBuffer<PendingLine>> pending;
+    LineBatch ready;
+    uint64_t lateLines = 0;
+    // With --index, every line is posted here under its user and IP;
+    // the key ids of addresses are cached to skip formatting them
+    std::unique_ptr<EventIndexWriter> index;
+    FlatMap<uint32_t, uint32_t> indexedIPs;
+    // With --export, every parsed line is appended here
+    std::unique_ptr<ArchiveWriter> archive;
+    // With --suppress, repeated alerts for a key are counted here
+    std::unique_ptr<AlertWindows> suppressor;
+    // Sources caught by this batch's window rules, and when; added to
+    // cfg.learnedBans once the batch has been emitted
+    std::vector<std::pair<uint32_t, uint32_t>> newBans;
+};
 
 /**
  * This method is used to convert a timestamp of the form "Jun 10
@@ -92,54 +338,6 @@ long toSeconds(const std::string& timestamp, const int year = 2021) {
     return mktime(&tstamp);
 }
 
-/**
- * @param url A string containing a valid URL. The port number in URL
- * is always optional.  The default port number is assumed to be 80.
- *
- * @return This method returns a std::tuple with 3 strings. The 3
- * strings are in the order: hostname, port, and path.  Here we use
- * std::tuple because a method can return only 1 value.  The
- * std::tuple is a convenient class to encapsulate multiple return
- * values into a single return value.
- */
-std::tuple<std::string, std::string, std::string>
-breakDownURL(const std::string& url) {
-    // The values to be returned.
-    std::string hostName, port = "80", path = "/";
-    size_t n, m;
-    n = url.find("/") + 2;
-    if (url.find(":", n) != std::string::npos) {
-        m = url.find(":", n);
-        port = url.substr(m + 1, url.find("/", m) - (m+1));
-        path = url.substr(url.find("/", m));
-    } else {
-        m = url.find("/", n);
-        path = url.substr(m);
-    }
-    hostName = url.substr(n, m - n);
-    // Return 3-values encapsulated into 1-tuple.
-    return {hostName, port, path};
-}
-/**
- * This method checks is users have been flagged. 
- * @param user A string object of 5 numbers that identify individuals connected
- * to login attempts 
- * @param flagged A LookupMap object that contains a string key and bool content
- * that registers certain users as flagged for potential hackers.
- * @return Returns a bool, false is the user object passed in has not been 
- * flagged or true is they have been flagged. 
- */
-bool isFlag(const std::string& user, LookupMap& flagged) {
-    if (flagged.find(user) == flagged.end()) {
-            flagged[user] = false;
-            return false;
-            
-    } else if (flagged.find(user) != flagged.end() 
-            && flagged[user] == true) {
-            return true;        
-    }
-    return false;
-}
 /**
  * Checks every line read in for being an authorized user according to the 
  * authUser LookupMap
@@ -150,12 +348,22 @@ bool isFlag(const std::string& user, LookupMap& flagged) {
  * origin or false if it had not. 
  */
 bool isAuth(const std::string& line, const LookupMap& authUser) {
-    for (auto e : authUser) {
-        if (line.find(e.first) != std::string::npos) {
-            return true;
-        }
+    return containsKey(line, authUser);
+}
+/**
+ * Checks a line for an authorized user using whichever form the current
+ * lookups were loaded in (text maps or a compiled image).
+ * @param line A string of the current login attempt report being assessed. 
+ * @param lookups The current authorized-user and banned-IP lookups.
+ * @return Returns a bool, true if the login attempt was from an authorized 
+ * origin or false if it had not. 
+ */
+bool isAuth(const std::string& line, const Lookups& lookups) {
+    if (lookups.image) {
+        return containsKey(line, *lookups.image, kAuthSection);
     }
-    return false;
+    return lookups.filter ? containsKey(line, lookups.authUser,
+            *lookups.filter) : isAuth(line, lookups.authUser);
 }
 /**
  * This method checks every IP associated with a log in attempt to see if it has
@@ -167,12 +375,22 @@ bool isAuth(const std::string& line, const LookupMap& authUser) {
  * not been banned.
  */
 bool isBand(const std::string& line, const LookupMap& banIP) {
-    for (auto e : banIP) {
-        if (line.find(e.first) != std::string::npos) {
-            return true;
-        }
+    return containsKey(line, banIP);
+}
+/**
+ * Checks a line for a banned IP using whichever form the current lookups
+ * were loaded in (text maps or a compiled image).
+ * @param line A string of the current login attempt report being assessed.
+ * @param lookups The current authorized-user and banned-IP lookups.
+ * @return Returns a bool, true if the IP has been banned and false if it has 
+ * not been banned.
+ */
+bool isBand(const std::string& line, const Lookups& lookups) {
+    if (lookups.image) {
+        return containsKey(line, *lookups.image, kBanSection);
     }
-    return false;
+    return lookups.filter ? containsKey(line, lookups.banIP,
+            *lookups.filter) : isBand(line, lookups.banIP);
 }
 /**
  * This method assist the main checkLog method by using a for loop to go through
@@ -257,7 +475,8 @@ bool checkLog(const std::string& line, LoginTimes& log,
  * process method. 
  * @param os A ostream object that prints results to the consol 
  * @param reason An integer object that signals to the processHelper method what 
- * message the processMethod needs printed
+ * message the processMethod needs printed (1 banned IP, 2 user frequency,
+ * 3 summary, 4 source IP frequency, 5 subnet frequency, 6 spraying)
  * @param line A string of the current login attempt report being assessed.
  * @param hackAtt An integer that counts the number of login attempts that have
  * been considered hacking that have been processed. 
@@ -271,50 +490,1189 @@ int processHelper(std::ostream& os, int reason, std::string line, int hackAtt,
         os << "Hacking due to banned IP. Line: " << line << "\n";
     } else if (reason == 2) {
         os << "Hacking due to frequency. Line: " << line << "\n";
+    } else if (reason == 4) {
+        os << "Hacking due to IP frequency. Line: " << line << "\n";
+    } else if (reason == 5) {
+        os << "Hacking due to subnet frequency. Line: " << line << "\n";
+    } else if (reason == 6) {
+        os << "Hacking due to password spraying. Line: " << line << "\n";
     } else if (reason == 3) {
         os << "Processed " << lineCount << " lines. Found " << hackAtt 
             << " possible hacking attempts.\n";
     }
     return 1;
 }
+/**
+ * Extracts the account name an sshd "Failed password" line was aimed at,
+ * e.g. "root" in "Failed password for invalid user root from ...".
+ * @param line A string of the current login attempt report being assessed.
+ * @param name Set to the account name on success.
+ * @return Returns true if the line named a target account.
+ */
+bool parseTargetUser(const std::string& line, std::string& name) {
+    size_t pos = line.find(" for ");
+    size_t end = line.find(" from ");
+    if (pos == std::string::npos || end == std::string::npos || end < pos) {
+        return false;
+    }
+    pos += 5;
+    if (line.compare(pos, 13, "invalid user ") == 0) {
+        pos += 13;
+    }
+    if (pos >= end) {
+        return false;
+    }
+    name = line.substr(pos, end - pos);
+    return true;
+}
+/**
+ * Converts an IPv4 address in host byte order to dotted-quad notation.
+ * @param ip The address to be converted.
+ * @return The address as a string, e.g. "128.199.152.105".
+ */
+std::string formatIP(uint32_t ip) {
+    return std::to_string(ip >> 24) + "." + std::to_string((ip >> 16) & 255)
+        + "." + std::to_string((ip >> 8) & 255) + "." + 
+        std::to_string(ip & 255);
+}
+/**
+ * Prints the current heavy hitters. Counts are upper bounds; the value in
+ * parentheses is the largest possible overcount.
+ * @param os A ostream object that prints results to the consol 
+ * @param k The number of entries to print for each list; 0 prints
+ * nothing, as the report is off.
+ * @param topIPs The heavy-hitter counters for source addresses.
+ * @param topUsers The heavy-hitter counters for targeted accounts.
+ */
+void printHeavyHitters(std::ostream& os, size_t k, const TopSources& topIPs,
+        const TopTargets& topUsers) {
+    if (k == 0) {
+        return;
+    }
+    os << "Top attacking IPs:\n";
+    for (const auto& e : topIPs.top(k)) {
+        os << "  " << formatIP(e.key) << " " << e.count << " (+/-" 
+           << e.error << ")\n";
+    }
+    os << "Most targeted users:\n";
+    for (const auto& e : topUsers.top(k)) {
+        os << "  " << e.key << " " << e.count << " (+/-" << e.error << ")\n";
+    }
+}
+/**
+ * @return The time of a log line to the second, from its full
+ * "Mmm dd hh:mm:ss" stamp, reusing the batch's last conversion when
+ * neighbouring lines share a timestamp.
+ */
+uint32_t lineTime(LineBatch& b, const std::string& line) {
+    if (line.compare(0, 15, b.lastStamp) != 0) {
+        b.lastStamp = line.substr(0, 15);
+        b.lastTime = toSeconds(b.lastStamp);
+    }
+    return b.lastTime;
+}
+/**
+ * Prefilter phase: drops the rows of lines that were not written by sshd
+ * before anything is parsed from them, keeping the order of the rest.
+ * Such a line is first checked against the lookups, as every line always
+ * was, and kept if it names a banned IP and no authorized user, so that
+ * its alert is printed in line order.
+ * @param b A batch whose line and fields columns hold b.size lines.
+ * @param filter Decides which lines are kept and counts the others.
+ * @param lookups The current authorized-user and banned-IP lookups.
+ * @return The number of lines dropped.
+ */
+size_t prefilterBatch(LineBatch& b, LinePrefilter& filter,
+        const Lookups& lookups) {
+    auto banned = [&lookups](const std::string& line) {
+        // Few lines are banned, so that scan comes first
+        return isBand(line, lookups) && !isAuth(line, lookups);
+    };
+    size_t kept = 0;
+    for (size_t i = 0; i < b.size; i++) {
+        if (!filter.keep(b.line[i], b.fields[i], banned)) {
+            continue;
+        }
+        if (kept != i) {
+            b.line[kept].swap(b.line[i]);
+            b.fields[kept] = b.fields[i];
+            b.offset[kept] = b.offset[i];
+        }
+        kept++;
+    }
+    const size_t dropped = b.size - kept;
+    b.size = kept;
+    return dropped;
+}
+/**
+ * Parse phase: fills the time, user, source, target and outcome columns
+ * of a batch from its lines and their scanned fields.
+ * @param b The batch whose line and fields columns have been filled.
+ */
+void parseBatch(LineBatch& b) {
+    for (size_t i = 0; i < b.size; i++) {
+        const std::string& line = b.line[i];
+        const LineFields& f = b.fields[i];
+        if (!b.timed) {
+            b.time[i] = lineTime(b, line);
+        }
+        if (f.sshd < 0) {
+            // Kept by prefilterBatch for its lookup hit alone
+            b.user[i].clear();
+            b.pid[i] = 0;
+            b.hasIP[i] = 0;
+            b.failed[i] = 0;
+            b.target[i].clear();
+            continue;
+        }
+        // The key is the whole PID, however many digits it has
+        const size_t key = f.sshd + 5, close = line.find(']', key);
+        b.user[i].assign(line, key, close == std::string::npos ? 5 :
+                close - key);
+        b.pid[i] = parsePid(line, key);
+        b.hasIP[i] = f.from >= 0 && parseIPv4(line, f.from, b.ip[i]);
+        b.failed[i] = f.failed >= 0;
+        if (!b.failed[i] || !parseTargetUser(line, b.target[i])) {
+            b.target[i].clear();
+        }
+    }
+}
+/**
+ * Lookup phase: marks authorized lines, and flags lines from banned IPs
+ * or learned bans with verdict 1.
+ * @param b The parsed batch.
+ * @param lookups The current authorized-user and banned-IP lookups.
+ * @param learned The bans learned from detections, or null.
+ */
+void checkLookupsBatch(LineBatch& b, const Lookups& lookups,
+        LearnedBans* learned) {
+    std::unique_lock<std::mutex> guard;
+    if (learned) {
+        guard = learned->lock();
+    }
+    for (size_t i = 0; i < b.size; i++) {
+        b.authorized[i] = isAuth(b.line[i], lookups);
+        b.verdict[i] = 0;
+        if (b.authorized[i]) {
+            continue;
+        }
+        // A learned ban is one hash probe; try it before the word scan
+        if (learned && b.hasIP[i] && learned->contains(b.ip[i],
+                    b.time[i])) {
+            learned->hit();
+            b.verdict[i] = 1;
+        } else if (isBand(b.line[i], lookups)) {
+            b.verdict[i] = 1;
+        }
+    }
+}
+/**
+ * @return Returns true if row i is subject to the window rules: it is
+ * an sshd line, not authorized, not already decided by a lookup, and not
+ * late.
+ */
+inline bool windowed(const LineBatch& b, size_t i) {
+    return b.fields[i].sshd >= 0 && !b.authorized[i] && b.verdict[i] == 0 &&
+        !b.late[i];
+}
+/**
+ * User frequency phase: runs the configured user rule (or the legacy
+ * checkLog rule) over every line not already decided by a lookup. Keys
+ * that parsed as a PID go to the rule's PID-indexed state. The rule
+ * state of the row cfg.prefetchDistance ahead is prefetched first, so
+ * with many users the cache misses of nearby rows overlap.
+ * @param b The batch after the lookup phase.
+ * @param st The detector whose user rule state is updated.
+ */
+void checkUserBatch(LineBatch& b, DetectorState& st) {
+    const size_t ahead = st.cfg.legacyFrequency ? 0 : st.cfg.prefetchDistance;
+    for (size_t i = 0; i < b.size; i++) {
+        size_t next = i + ahead;
+        if (ahead > 0 && next < b.size && windowed(b, next)) {
+            if (b.pid[next]) {
+                st.userRule->prefetchPid(b.pid[next], b.time[next]);
+            } else {
+                st.userRule->prefetch(b.user[next], b.time[next]);
+            }
+        }
+        b.userHit[i] = 0;
+        if (!windowed(b, i)) {
+            continue;
+        }
+        if (st.cfg.legacyFrequency) {
+            b.userHit[i] = checkLog(b.line[i], st.log, b.user[i]);
+        } else {
+            b.userHit[i] = (b.pid[i] ?
+                    st.userRule->recordPid(b.pid[i], b.time[i]) :
+                    st.userRule->record(b.user[i], b.time[i])) &&
+                b.failed[i];
+        }
+    }
+}
+/**
+ * Source frequency phase: with --source-rules, records failed attempts
+ * against the per-IP and per-subnet counters. Both counters are always
+ * updated so neither misses attempts. Rows ahead are prefetched as in
+ * checkUserBatch.
+ * @param b The batch after the lookup phase.
+ * @param st The detector whose source trackers are updated.
+ */
+void checkSourcesBatch(LineBatch& b, DetectorState& st) {
+    if (!st.cfg.sourceRules) {
+        std::fill(b.sourceHit.begin(), b.sourceHit.begin() + b.size, 0);
+        return;
+    }
+    const size_t ahead = st.cfg.prefetchDistance;
+    for (size_t i = 0; i < b.size; i++) {
+        size_t next = i + ahead;
+        if (ahead > 0 && next < b.size && b.hasIP[next] && b.failed[next]) {
+            st.ipRate.prefetch(b.ip[next]);
+            st.subnetRate.prefetch(b.ip[next] >> 8);
+        }
+        b.sourceHit[i] = 0;
+        if (!windowed(b, i) || !b.hasIP[i] || !b.failed[i]) {
+            continue;
+        }
+        bool ipHit = st.ipRate.record(b.ip[i], b.time[i]);
+        bool subnetHit = st.subnetRate.record(b.ip[i] >> 8, b.time[i]);
+        b.sourceHit[i] = ipHit ? 4 : (subnetHit ? 5 : 0);
+    }
+}
+/**
+ * Spray phase: with --spray, checks failed attempts for one account
+ * being attacked from many distinct source IPs.
+ * @param b The batch after the lookup phase.
+ * @param st The detector whose per-account estimators are updated.
+ */
+void checkSprayBatch(LineBatch& b, DetectorState& st) {
+    if (!st.cfg.sprayRule) {
+        std::fill(b.sprayHit.begin(), b.sprayHit.begin() + b.size, 0);
+        return;
+    }
+    for (size_t i = 0; i < b.size; i++) {
+        b.sprayHit[i] = 0;
+        if (!windowed(b, i) || !b.hasIP[i] || b.target[i].empty()) {
+            continue;
+        }
+        b.sprayHit[i] = st.spray.record(b.target[i], b.ip[i], b.time[i]);
+    }
+}
+/**
+ * @return The key an alert is suppressed under: the reason code followed
+ * by what the reason is about, as it is printed in a summary.
+ * @param b The batch after every rule has run.
+ * @param i The alerting row.
+ * @param reason The processHelper reason code of the alert.
+ */
+std::string alertKey(const LineBatch& b, size_t i, int reason) {
+    std::string key(1, static_cast<char>('0' + reason));
+    if (reason == 4 || (reason == 1 && b.hasIP[i])) {
+        key += "IP " + formatIP(b.ip[i]);
+    } else if (reason == 5) {
+        key += "subnet " + formatIP(b.ip[i] & 0xffffff00u) + "/24";
+    } else if (reason == 6) {
+        key += "account " + b.target[i];
+    } else {
+        key += "sshd[" + b.user[i] + "]";
+    }
+    return key;
+}
+/**
+ * Prints the summary of a closed suppression window.
+ * @param os An ostream object that prints results to the consol 
+ * @param key The alertKey the window was opened for.
+ * @param w The closed window.
+ */
+void printSuppressed(std::ostream& os, const std::string& key,
+        const AlertWindows::Window& w) {
+    static const char* const reasons[] = {"", "banned IP", "frequency", "",
+        "IP frequency", "subnet frequency", "password spraying"};
+    os << "Suppressed " << w.suppressed << " more alerts due to "
+       << reasons[key[0] - '0'] << " for " << key.substr(1)
+       << ". Last line: " << w.last << "\n";
+}
+/**
+ * Emit phase: walks the batch in line order, feeds the heavy-hitter
+ * counters, prints periodic snapshots and prints one alert per flagged
+ * line, choosing the reason by the same priority as before (lookups,
+ * then user frequency, then source frequency, then spraying). With
+ * --suppress, an alert inside its key's suppression window is counted
+ * but not printed, and with --sink alerts are published to the sinks.
+ * With --nft the source address of every alerting line is queued for
+ * blocking, whether or not its alert was suppressed, and with
+ * --learn-bans the sources of window-rule alerts are banned for the
+ * following lines, and checkpointed to --ban-state when a save is due.
+ * @param b The batch after every rule has run.
+ * @param st The detector whose counters are updated.
+ * @param os An ostream object that prints results to the consol 
+ */
+void emitBatch(const LineBatch& b, DetectorState& st, std::ostream& os) {
+    auto report = [&os](const std::string& key,
+            const AlertWindows::Window& w) { printSuppressed(os, key, w); };
+    for (size_t i = 0; i < b.size; i++) {
+        st.lineCount++;
+        if (st.cfg.topK > 0 && !b.authorized[i] && b.failed[i]) {
+            if (b.hasIP[i]) {
+                st.topIPs.add(b.ip[i]);
+            }
+            if (!b.target[i].empty()) {
+                st.topUsers.add(b.target[i]);
+            }
+        }
+        // Dropped lines are counted a batch at a time, so a multiple may
+        // be passed rather than met
+        if (st.cfg.topK > 0 && st.cfg.snapshotEvery > 0 &&
+            st.lineCount - st.snapshotAt >= st.cfg.snapshotEvery) {
+            st.snapshotAt = st.lineCount - st.lineCount %
+                st.cfg.snapshotEvery;
+            os << "Snapshot after " << st.lineCount << " lines.\n";
+            printHeavyHitters(os, st.cfg.topK, st.topIPs, st.topUsers);
+        }
+        int reason = b.verdict[i] != 0 ? b.verdict[i] :
+            b.userHit[i] ? 2 : b.sourceHit[i] != 0 ? b.sourceHit[i] :
+            b.sprayHit[i] ? 6 : 0;
+        if (b.authorized[i] || reason == 0) {
+            if (st.suppressor) {
+                st.suppressor->advance(b.time[i], report);
+            }
+            continue;
+        }
+        if (st.cfg.banAction && b.hasIP[i]) {
+            st.cfg.banAction->offer(b.ip[i]);
+        }
+        if (st.cfg.learnedBans && b.hasIP[i] && reason != 1) {
+            st.newBans.emplace_back(b.ip[i], b.time[i]);
+        }
+        if (st.suppressor && !st.suppressor->admit(alertKey(b, i,
+                        reason), b.time[i], b.line[i], report)) {
+            st.hackAtt++;
+        } else if (st.cfg.alerts) {
+            st.cfg.alerts->publish({b.time[i],
+                        static_cast<uint8_t>(reason), b.line[i]});
+            st.hackAtt++;
+        } else {
+            st.hackAtt += processHelper(os, reason, b.line[i], 0, 0);
+        }
+    }
+    if (!st.newBans.empty()) {
+        auto guard = st.cfg.learnedBans->lock();
+        for (const auto& ban : st.newBans) {
+            st.cfg.learnedBans->ban(ban.first, ban.second);
+        }
+        st.newBans.clear();
+        if (!st.cfg.learnedBanFile.empty()) {
+            st.cfg.learnedBans->checkpoint(st.cfg.learnedBanFile,
+                    st.cfg.banSaveEvery, st.cfg.banSaveCount);
+        }
+    }
+}
+/**
+ * @return The account row i of a parsed batch names, or "" if none. Any
+ * outcome counts, unlike the target column which only failed attempts
+ * fill.
+ * @param name Holds the account when it has to be parsed here.
+ */
+const std::string& lineAccount(const LineBatch& b, size_t i,
+        std::string& name) {
+    // Failed attempts were already parsed into the target column
+    if (!b.failed[i] && parseTargetUser(b.line[i], name)) {
+        return name;
+    }
+    return b.target[i];
+}
+/**
+ * Index phase: posts every sshd line under the account it names ("user:"
+ * key) and its source address ("ip:" key), whatever the outcome of the
+ * attempt, so that an incident can be looked up later without a rescan.
+ * @param b The parsed batch.
+ * @param st The detector whose index is being written.
+ */
+void indexBatch(const LineBatch& b, DetectorState& st) {
+    EventIndexWriter& index = *st.index;
+    std::string name, key;
+    for (size_t i = 0; i < b.size; i++) {
+        if (b.fields[i].sshd < 0) {
+            continue;
+        }
+        const std::string& user = lineAccount(b, i, name);
+        if (!user.empty()) {
+            key.assign("user:").append(user);
+            index.add(index.intern(key), b.time[i], b.offset[i]);
+        }
+        if (b.hasIP[i]) {
+            uint32_t* id = st.indexedIPs.find(b.ip[i]);
+            if (id == nullptr) {
+                id = &st.indexedIPs.insert(b.ip[i]);
+                *id = index.intern("ip:" + formatIP(b.ip[i]));
+            }
+            index.add(*id, b.time[i], b.offset[i]);
+        }
+    }
+}
+/**
+ * Export phase: appends every parsed sshd line to the columnar archive.
+ * @param b The parsed batch.
+ * @param archive The archive being written.
+ */
+void archiveBatch(const LineBatch& b, ArchiveWriter& archive) {
+    std::string name;
+    for (size_t i = 0; i < b.size; i++) {
+        if (b.fields[i].sshd < 0) {
+            continue;
+        }
+        uint8_t outcome = b.failed[i] ? kOutcomeFailed :
+            b.line[i].find("Accepted ") != std::string::npos ?
+            kOutcomeAccepted : kOutcomeOther;
+        archive.add(b.time[i], b.user[i], lineAccount(b, i, name),
+                b.ip[i], b.hasIP[i], outcome);
+    }
+}
+/**
+ * Runs the window rules over a batch whose lookup phase has run, and
+ * prints its alerts, in line order.
+ * @param b A batch whose parsed and lookup columns hold b.size lines.
+ * @param st The detector state carried between batches.
+ * @param os An ostream object that prints results to the consol 
+ */
+void runWindowRules(LineBatch& b, DetectorState& st, std::ostream& os) {
+    checkUserBatch(b, st);
+    checkSourcesBatch(b, st);
+    checkSprayBatch(b, st);
+    emitBatch(b, st, os);
+}
+/**
+ * Runs every detection phase over one batch of lines, in line order.
+ * @param b A batch whose line and fields columns hold b.size lines.
+ * @param st The detector state carried between batches.
+ * @param lookups The current authorized-user and banned-IP lookups.
+ * @param os An ostream object that prints results to the consol 
+ */
+void runPhases(LineBatch& b, DetectorState& st, const Lookups& lookups,
+        std::ostream& os) {
+    parseBatch(b);
+    if (st.index) {
+        indexBatch(b, st);
+    }
+    if (st.archive) {
+        archiveBatch(b, *st.archive);
+    }
+    checkLookupsBatch(b, lookups, st.cfg.learnedBans);
+    runWindowRules(b, st, os);
+}
+/**
+ * Runs every detection phase over one batch of lines. This is the batch
+ * API used by process(); callers fill the line and fields columns. Lines
+ * not written by sshd are dropped first. With --lateness the lines then
+ * pass through the event-time buffer, timed to the second by their full
+ * stamp, and only those the watermark has passed are processed, in time
+ * order, carrying the time they were ordered by; late lines are checked
+ * against the lookups but skip the window rules, whose decisions for
+ * that time are already final.
+ * @param b A batch whose line and fields columns hold b.size lines.
+ * @param st The detector state carried between batches.
+ * @param lookups The current authorized-user and banned-IP lookups.
+ * @param os An ostream object that prints results to the consol 
+ */
+void processBatch(LineBatch& b, DetectorState& st, const Lookups& lookups,
+        std::ostream& os) {
+    // Dropped lines still count towards the lines processed
+    st.lineCount += prefilterBatch(b, st.prefilter, lookups);
+    if (!st.pending) {
+        runPhases(b, st, lookups, os);
+        return;
+    }
+    LineBatch& ready = st.ready;
+    ready.size = 0;
+    auto release = [&ready](PendingLine& p) {
+        ready.append(p.line, p.fields, p.offset, p.time, false);
+    };
+    for (size_t i = 0; i < b.size; i++) {
+        // Converted once here; the rules see the time the watermark used
+        uint32_t t = lineTime(b, b.line[i]);
+        PendingLine p = {std::move(b.line[i]), b.fields[i], b.offset[i], t};
+        if (!st.pending->push(p.time, std::move(p), release)) {
+            st.lateLines++;
+            ready.append(p.line, p.fields, p.offset, p.time, true);
+        }
+    }
+    runPhases(ready, st, lookups, os);
+}
+/**
+ * Closes every open suppression window, printing its summary, waits for
+ * the alert sinks to write what was published, writes the last blocked
+ * addresses, saves the learned bans, and reports how many alerts were
+ * suppressed or dropped. Call once the input has ended.
+ * @param st The detector state carried between batches.
+ * @param os An ostream object that prints results to the consol 
+ */
+void finishAlerts(DetectorState& st, std::ostream& os) {
+    if (st.suppressor) {
+        st.suppressor->flush([&os](const std::string& key,
+                    const AlertWindows::Window& w) {
+            printSuppressed(os, key, w);
+        });
+        os << "Alerts suppressed: " << st.suppressor->suppressed() << "\n";
+    }
+    if (st.cfg.banAction) {
+        st.cfg.banAction->flush();
+        os << st.cfg.banAction->report() << "\n";
+    }
+    if (st.cfg.learnedBans) {
+        auto guard = st.cfg.learnedBans->lock();
+        if (!st.cfg.learnedBanFile.empty()) {
+            st.cfg.learnedBans->save(st.cfg.learnedBanFile);
+        }
+        os << st.cfg.learnedBans->report() << "\n";
+    }
+    if (st.cfg.alerts) {
+        st.cfg.alerts->drain();
+        for (const auto& sink : st.cfg.alerts->sinks()) {
+            os << "Alert sink " << sink->destination().name() << ": "
+               << sink->written() << " written, " << sink->drops()
+               << " dropped.\n";
+        }
+    }
+}
+/**
+ * Processes every line still held for the watermark, oldest first, and
+ * closes the suppression windows. Call once the input has ended.
+ * @param st The detector state carried between batches.
+ * @param lookups The current authorized-user and banned-IP lookups.
+ * @param os An ostream object that prints results to the consol 
+ */
+void finishBatches(DetectorState& st, const Lookups& lookups,
+        std::ostream& os) {
+    if (st.pending) {
+        LineBatch& ready = st.ready;
+        ready.size = 0;
+        st.pending->flush([&ready](PendingLine& p) {
+            ready.append(p.line, p.fields, p.offset, p.time, false);
+        });
+        runPhases(ready, st, lookups, os);
+        os << "Late lines skipped by the window rules: " << st.lateLines
+           << "\n";
+    }
+    if (st.prefilter.skipped() > 0) {
+        os << st.prefilter.report() << "\n";
+    }
+    finishAlerts(st, os);
+}
+/**
+ * Loads the authorized-user and banned-IP lookups named by cfg, and starts
+ * watching them for changes when --watch is given.
+ * @param cfg The detection parameters.
+ * @param readers The most threads that read the lookups at the same time.
+ */
+std::unique_ptr<LookupStore> openLookups(const DetectorConfig& cfg,
+        size_t readers = 1) {
+    const std::string image = cfg.lookupImage;
+    const bool filter = cfg.lookupFilter;
+    std::unique_ptr<LookupStore> lookups(new LookupStore([image, filter] {
+        std::unique_ptr<Lookups> next(new Lookups());
+        if (!image.empty()) {
+            next->image = std::make_shared<const LookupImage>(image);
+        } else {
+            next->authUser = loadLookup("authorized_users.txt");
+            next->banIP = loadLookup("banned_ips.txt");
+        }
+        if (filter && image.empty()) {
+            next->filter = buildLookupFilter(next->authUser, next->banIP);
+        }
+        return next;
+    }, readers));
+    if (cfg.watchLookups && image.empty()) {
+        lookups->watch(".", {"authorized_users.txt", "banned_ips.txt"});
+    } else if (cfg.watchLookups) {
+        size_t slash = image.rfind('/');
+        lookups->watch(slash == std::string::npos ? "." : 
+                image.substr(0, slash), {image.substr(slash + 1)});
+    }
+    return lookups;
+}
+/**
+ * Runs the detector over every line a line source hands out, in batches
+ * of cfg.batchSize, and prints the final summary.
+ * @param lines Any source with bool next(std::string&, LineFields&), such
+ * as BlockLineReader or MergedLines. An empty line ends the log.
+ * @param os An ostream object that prints results to the consol 
+ * @param cfg The detection parameters.
+ */
+template <typename LineSource>
+void detect(LineSource& lines, std::ostream& os, const DetectorConfig& cfg) {
+    std::unique_ptr<LookupStore> lookups = openLookups(cfg);
+    // Lock-free view of the lookups; refreshed between batches
+    LookupStore::Reader reader(*lookups);
+    DetectorState state(cfg);
+    LineBatch batch;
+    const size_t batchSize = std::max<size_t>(cfg.batchSize, 1);
+    batch.resize(batchSize);
+    for (bool more = true; more;) {
+        size_t n = 0;
+        // Nothing from the lookups is held while waiting for input
+        reader.offline();
+        while (n < batchSize && (more = lines.next(batch.line[n],
+                        batch.fields[n])) && !batch.line[n].empty()) {
+            batch.offset[n++] = lines.offset();
+        }
+        // An empty line ends the log just as it did with getline
+        more = more && n == batchSize;
+        batch.size = n;
+        reader.quiescent();
+        processBatch(batch, state, reader.get(), os);
+    }
+    finishBatches(state, reader.get(), os);
+    processHelper(os, 3, "", state.hackAtt, state.lineCount); 
+    printHeavyHitters(os, cfg.topK, state.topIPs, state.topUsers);
+    if (state.index) {
+        uint64_t bytes = state.index->write();
+        os << "Indexed " << state.index->size() << " postings in "
+           << cfg.indexFile << " (" << bytes << " bytes).\n";
+    }
+    if (state.archive) {
+        uint64_t bytes = state.archive->close();
+        os << "Archived " << state.archive->size() << " events in "
+           << cfg.exportFile << " (" << bytes << " bytes).\n";
+    }
+}
 /**
  * This method analyzes each login attempt for patterns or data that signal 
  * potential hacking. It also reads in the lines in question from a webpage.
+ * Lines are collected into batches of cfg.batchSize and handed to
+ * processBatch.
  * @param is An in stream of data that has been read from a webpage. 
  * @param os An ostream object that prints results to the consol 
+ * @param cfg The detection parameters.
  */
-void process(std::istream& is, std::ostream& os) {
-    const LookupMap authUser = loadLookup("authorized_users.txt");
-    const LookupMap banIP = loadLookup("banned_ips.txt");
-    LookupMap flagged;
-    LoginTimes log;
-    int lineCount = 0, hackAtt = 0; 
-    std::string user;
+void process(std::istream& is, std::ostream& os,
+        const DetectorConfig& cfg = DetectorConfig()) {
     // Loops removes all header lines
     for (std::string hdr; std::getline(is, hdr) &&
              !hdr.empty() && hdr != "\r";) {} 
-    // Loops through each line of input and calls proper assessing methods
-    for (std::string line; std::getline(is, line) && !line.empty();) {
-        lineCount++;
-        int temp = line.find("sshd");
-        user = line.substr(temp + 5, 5);
-        // os << user << "\n";
-        if (isAuth(line, authUser)) {
-            // all done
-        } else if (isBand(line, banIP)) {
-            hackAtt += processHelper(os, 1, line, 0, 0);
-            // end and print fail and add to bad test
-        } else if (isFlag(user, flagged)) {
-            hackAtt += processHelper(os, 1, line, 0, 0);            
-            // end and print fail and add to bad test
-        } else if (checkLog(line, log, user)) {
-            hackAtt += processHelper(os, 2, line, 0, 0);
-            // flagged[user] = true;
-            // end and print fail and add to bad test and add to flagged
-        }
-    }
-    processHelper(os, 3, user, hackAtt, lineCount); 
-    // user is simply being used as a place holder here
+    // Lines are split, and their fields located, a block at a time
+    BlockLineReader lines(is, bestScanner().mask);
+    detect(lines, os, cfg);
+}
+
+/**
+ * The single alert stream shared by every source. The text produced by
+ * one batch is written as a unit, with each line prefixed by its source,
+ * so lines from different sources never interleave mid-line.
+ */
+class AlertStream {
+public:
+    explicit AlertStream(std::ostream& os) : os(os) {}
+
+    /** Writes every line of text, each preceded by label. */
+    void write(const std::string& label, const std::string& text) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::istringstream lines(text);
+        for (std::string line; std::getline(lines, line);) {
+            os << label << line << '\n';
+        }
+    }
+
+private:
+    std::ostream& os;
+    std::mutex mutex;
+};
+
+/** The progress of one source handled by processSources. */
+struct SourceRun {
+    SourceRun(const std::string& source, DetectorState* shared,
+            const DetectorConfig& cfg) : label("[" + source + "] "),
+        lines(bestScanner().mask), own(shared ? nullptr :
+                new DetectorState(cfg)), state(shared ? shared : own.get()) {
+        batch.resize(std::max<size_t>(cfg.batchSize, 1));
+    }
+
+    std::string label;
+    LineBuffer lines;
+    LineBatch batch;
+    size_t pending = 0;  // Rows of batch filled so far
+    bool ended = false;  // An empty line ends a log, as in process()
+    bool failed = false;  // An exception ended this source early
+    std::unique_ptr<DetectorState> own;
+    DetectorState* state;
+};
+
+/**
+ * Runs processBatch over the rows a source has collected and writes the
+ * resulting alerts to the shared stream.
+ * @param run The source whose batch is full or whose input has ended.
+ * @param lookups The lookups shared by all sources.
+ * @param merged Guards the detector when all sources share one, or null.
+ * @param out The aggregated alert stream.
+ */
+void flushSource(SourceRun& run, LookupStore& lookups, std::mutex* merged,
+        AlertStream& out) {
+    if (run.pending == 0) {
+        return;
+    }
+    std::ostringstream alerts;
+    run.batch.size = run.pending;
+    run.pending = 0;
+    {
+        // Readers are claimed per batch since pool threads are shared
+        LookupStore::Reader reader(lookups);
+        std::unique_lock<std::mutex> lock;
+        if (merged != nullptr) {
+            lock = std::unique_lock<std::mutex>(*merged);
+        }
+        processBatch(run.batch, *run.state, reader.get(), alerts);
+    }
+    out.write(run.label, alerts.str());
+}
+
+/**
+ * Processes several log sources (URLs or files) concurrently on a thread
+ * pool and writes all alerts to one stream, labelled with their source.
+ * Each source gets its own detector state unless cfg.mergeHosts is set,
+ * in which case all sources feed one shared detector so that the
+ * frequency rules see attempts against every host.
+ * @param sources The URLs or file paths to be processed.
+ * @param os An ostream object that prints results to the consol 
+ * @param cfg The detection parameters.
+ */
+void processSources(const std::vector<std::string>& sources,
+        std::ostream& os, const DetectorConfig& cfg) {
+    const size_t threads = std::max<size_t>(cfg.jobs ? cfg.jobs :
+            std::thread::hardware_concurrency(), 1);
+    // Each pool thread holds at most one Reader at a time
+    std::unique_ptr<LookupStore> lookups = openLookups(cfg, threads);
+    AlertStream out(os);
+    std::unique_ptr<DetectorState> shared(cfg.mergeHosts ?
+            new DetectorState(cfg) : nullptr);
+    std::mutex merged;
+    std::vector<std::unique_ptr<SourceRun>> runs;
+    for (const auto& source : sources) {
+        runs.emplace_back(new SourceRun(source, shared.get(), cfg));
+    }
+    auto feed = [&](SourceRun& run, const char* data, size_t len, bool eof,
+            const std::string& error) {
+        if (eof) {
+            run.lines.finish();
+        } else {
+            run.lines.append(data, len);
+        }
+        while (!run.ended && run.lines.next(run.batch.line[run.pending],
+                    run.batch.fields[run.pending])) {
+            run.ended = run.batch.line[run.pending].empty();
+            run.batch.offset[run.pending] = run.lines.offset();
+            run.pending += !run.ended;
+            if (run.pending == run.batch.line.size()) {
+                flushSource(run, *lookups, shared ? &merged : nullptr, out);
+            }
+        }
+        if (!eof) {
+            return;
+        }
+        flushSource(run, *lookups, shared ? &merged : nullptr, out);
+        if (!error.empty()) {
+            out.write(run.label, "Error: " + error + "\n");
+        }
+        if (!shared) {
+            std::ostringstream summary;
+            {
+                LookupStore::Reader reader(*lookups);
+                finishBatches(*run.state, reader.get(), summary);
+            }
+            processHelper(summary, 3, "", run.state->hackAtt,
+                    run.state->lineCount);
+            printHeavyHitters(summary, cfg.topK, run.state->topIPs,
+                    run.state->topUsers);
+            out.write(run.label, summary.str());
+        }
+    };
+    fetchSources(sources, threads, [&](size_t id, const char* data,
+                size_t len, bool eof, const std::string& error) {
+        SourceRun& run = *runs[id];
+        if (run.failed) {
+            return;
+        }
+        // An exception leaving a pool thread would end the process, so it
+        // only ends the source that raised it
+        try {
+            feed(run, data, len, eof, error);
+        } catch (const std::exception& e) {
+            run.failed = true;
+            out.write(run.label, std::string("Error: ") + e.what() + "\n");
+        }
+    });
+    if (shared) {
+        LookupStore::Reader reader(*lookups);
+        finishBatches(*shared, reader.get(), os);
+        processHelper(os, 3, "", shared->hackAtt, shared->lineCount); 
+        printHeavyHitters(os, cfg.topK, shared->topIPs, shared->topUsers);
+    }
+}
+
+/**
+ * Prints the median, 99th percentile and largest of a set of latencies.
+ * @param os An ostream object that prints results to the consol 
+ * @param what The name of the measured quantity.
+ * @param ms The latencies in milliseconds; sorted here.
+ */
+void printLatency(std::ostream& os, const std::string& what,
+        std::vector<float>& ms) {
+    os << what << " latency: ";
+    if (ms.empty()) {
+        os << "none\n";
+        return;
+    }
+    std::sort(ms.begin(), ms.end());
+    os << "p50 " << ms[ms.size() / 2] << " ms, p99 "
+       << ms[ms.size() * 99 / 100] << " ms, max " << ms.back()
+       << " ms (" << ms.size() << ")\n";
+}
+
+/**
+ * Replays a captured log through the streaming ingest path with its
+ * original timing scaled by speed, as a load test. Lines are handed to
+ * the detector as they become due, exactly as processSources receives
+ * chunks from a live source; a partial batch is processed as soon as no
+ * more input is waiting, so alerts are not held back to fill a batch.
+ * Reports the latency from each line's due time until the detector has
+ * processed it, separately for lines that raised an alert, and the
+ * sustained throughput against the rate the replay offered.
+ * @param source The captured log file.
+ * @param speed How many times faster than real time; 0 = unpaced.
+ * @param os An ostream object that prints results to the consol 
+ * @param cfg The detection parameters.
+ */
+void paceReplay(const std::string& source, double speed, std::ostream& os,
+        const DetectorConfig& cfg) {
+    std::ifstream is(source);
+    if (!is.good()) {
+        throw std::runtime_error("Error opening file " + source);
+    }
+    std::unique_ptr<LookupStore> lookups = openLookups(cfg);
+    AlertStream out(os);
+    SourceRun run(source, nullptr, cfg);
+    run.label.clear();
+    using Clock = PacedLines::Clock;
+    // Due times of lines not processed yet, by offset; with --lateness
+    // lines may stay buffered across batches
+    std::unordered_map<uint64_t, Clock::time_point> due;
+    std::vector<float> lineMs, alertMs;
+    uint32_t first = 0, last = 0;
+    // Records the rows of the batch the rule phases just ran over
+    auto record = [&](const LineBatch& b) {
+        Clock::time_point now = Clock::now();
+        for (size_t i = 0; i < b.size; i++) {
+            auto it = due.find(b.offset[i]);
+            if (it == due.end()) {
+                continue;
+            }
+            float ms = std::chrono::duration<float, std::milli>(now -
+                    it->second).count();
+            due.erase(it);
+            lineMs.push_back(ms);
+            if (!b.authorized[i] && (b.verdict[i] || b.userHit[i] ||
+                        b.sourceHit[i] || b.sprayHit[i])) {
+                alertMs.push_back(ms);
+            }
+        }
+    };
+    auto flush = [&] {
+        if (run.pending > 0) {
+            flushSource(run, *lookups, nullptr, out);
+            record(run.state->pending ? run.state->ready : run.batch);
+        }
+    };
+    // The producer's last conversion, reused while lines share a stamp
+    // as lineTime does
+    std::string stamp;
+    uint32_t stampTime = 0;
+    Clock::time_point start = Clock::now();
+    {
+        PacedLines paced(is, [&](const std::string& line) {
+            if (line.compare(0, 15, stamp) != 0) {
+                stamp.assign(line, 0, 15);
+                stampTime = toSeconds(stamp);
+            }
+            first = first ? first : stampTime;
+            last = std::max(last, stampTime);
+            return stampTime;
+        }, speed);
+        PacedLines::Chunk chunk;
+        for (bool more = true; more;) {
+            // Only wait for input once everything received is processed
+            if (!paced.pop(chunk, run.pending == 0)) {
+                flush();
+                continue;
+            }
+            more = !chunk.eof;
+            if (more) {
+                run.lines.append(chunk.text.data(), chunk.text.size());
+            } else {
+                run.lines.finish();
+            }
+            LineBatch& b = run.batch;
+            while (run.lines.next(b.line[run.pending],
+                        b.fields[run.pending])) {
+                b.offset[run.pending] = run.lines.offset();
+                due[b.offset[run.pending]] = chunk.due;
+                if (++run.pending == b.line.size()) {
+                    flush();
+                }
+            }
+        }
+        flush();
+        std::ostringstream summary;
+        {
+            LookupStore::Reader reader(*lookups);
+            finishBatches(*run.state, reader.get(), summary);
+        }
+        record(run.state->ready);
+        out.write("", summary.str());
+        os << "Max delivery lag: " << paced.maxLag() * 1000 << " ms\n";
+    }
+    double sec = std::chrono::duration<double>(Clock::now() -
+            start).count();
+    processHelper(os, 3, "", run.state->hackAtt, run.state->lineCount);
+    printHeavyHitters(os, cfg.topK, run.state->topIPs, run.state->topUsers);
+    printLatency(os, "Line", lineMs);
+    printLatency(os, "Alert", alertMs);
+    os << "Sustained " << run.state->lineCount / sec << " lines/s over "
+       << sec << " s";
+    if (speed > 0 && last > first) {
+        os << " (offered " << run.state->lineCount * speed / (last - first)
+           << " lines/s at " << speed << "x)";
+    }
+    os << "\n";
+}
+
+/**
+ * Opens a source for reading: a local file, or an URL whose response
+ * headers have already been skipped.
+ * @param source An URL or a file path.
+ */
+std::unique_ptr<std::istream> openSource(const std::string& source) {
+    if (!isURL(source)) {
+        std::unique_ptr<std::istream> is(new std::ifstream(source));
+        if (!is->good()) {
+            throw std::runtime_error("Error opening file " + source);
+        }
+        return is;
+    }
+    std::string hostname, port, path;
+    std::tie(hostname, port, path) = breakDownURL(source);
+    std::unique_ptr<tcp::iostream> data(new tcp::iostream(hostname, port));
+    *data << "GET "   << path     << " HTTP/1.1\r\n"
+          << "Host: " << hostname << "\r\n"
+          << "Connection: Close\r\n\r\n";
+    for (std::string hdr; std::getline(*data, hdr) &&
+             !hdr.empty() && hdr != "\r";) {}
+    return std::unique_ptr<std::istream>(data.release());
+}
+
+/**
+ * The lines of one source: local files go through FileLineReader, so
+ * their reads are queued ahead with io_uring, and URLs through
+ * BlockLineReader over the response stream.
+ */
+class SourceLines {
+public:
+    /** @param source An URL or a file path. */
+    explicit SourceLines(const std::string& source) {
+        if (isURL(source)) {
+            stream = openSource(source);
+            reader.reset(new BlockLineReader(*stream, bestScanner().mask));
+        } else {
+            file.reset(new FileLineReader(source, bestScanner().mask));
+        }
+    }
+
+    bool next(std::string& line, LineFields& fields) {
+        return file ? file->next(line, fields) : reader->next(line, fields);
+    }
+
+    uint64_t offset() const {
+        return file ? file->offset() : reader->offset();
+    }
+
+private:
+    std::unique_ptr<std::istream> stream;
+    std::unique_ptr<BlockLineReader> reader;
+    std::unique_ptr<FileLineReader> file;
+};
+
+/**
+ * Interleaves several sources into one stream ordered by timestamp and
+ * runs a single detector over it, so the frequency rules count attempts
+ * against the same user or from the same source across all hosts.
+ * @param sources The URLs or file paths to be merged.
+ * @param os An ostream object that prints results to the consol 
+ * @param cfg The detection parameters; cfg.reorderDepth lines of each
+ * source are buffered to absorb local disorder.
+ */
+void mergeSources(const std::vector<std::string>& sources, std::ostream& os,
+        const DetectorConfig& cfg) {
+    std::vector<std::unique_ptr<SourceLines>> readers;
+    std::vector<SourceLines*> inputs;
+    for (const auto& source : sources) {
+        readers.emplace_back(new SourceLines(source));
+        inputs.push_back(readers.back().get());
+    }
+    MergedLines<SourceLines> merged(inputs, [](const std::string& stamp) {
+        return static_cast<uint32_t>(toSeconds(stamp));
+    }, cfg.reorderDepth);
+    detect(merged, os, cfg);
+}
+
+/**
+ * Answers a retrospective query from an event index: prints every line of
+ * the log posted under key with a timestamp between from and to, reading
+ * only those lines.
+ * @param indexFile An index written with --index.
+ * @param logFile The log the index was written from, as a local file.
+ * @param key "user:<account>" or "ip:<address>".
+ * @param from The first timestamp, e.g. "Aug 29 02:00:00".
+ * @param to The last timestamp, inclusive.
+ * @param os An ostream object that prints results to the consol 
+ */
+void queryIndex(const std::string& indexFile, const std::string& logFile,
+        const std::string& key, const std::string& from,
+        const std::string& to, std::ostream& os) {
+    auto start = std::chrono::steady_clock::now();
+    EventIndex index(indexFile);
+    std::ifstream log(logFile, std::ios::binary);
+    if (!log.good()) {
+        throw std::runtime_error("Error opening file " + logFile);
+    }
+    // Lines are indexed under the exact second of their stamp, so the
+    // index alone decides which fall in the range
+    std::vector<uint64_t> offsets;
+    index.find(key, toSeconds(from), toSeconds(to), [&offsets](
+                uint64_t offset, uint32_t) {
+        offsets.push_back(offset);
+    });
+    std::sort(offsets.begin(), offsets.end());
+    for (uint64_t offset : offsets) {
+        std::string line;
+        log.seekg(offset);
+        std::getline(log, line);
+        os << line << "\n";
+    }
+    size_t found = offsets.size();
+    double ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+    os << "Found " << found << " lines for " << key << " in " << ms
+       << " ms.\n";
+}
+
+/**
+ * Runs the detector over an archive written with --export instead of a
+ * text log. The columns go straight into the rule phases, so no line is
+ * scanned, split or timestamp-converted. The lookups are evaluated once
+ * per dictionary entry rather than once per line: an event is authorized
+ * if its account or pid is an authorized user, and banned if its address
+ * is banned (in the lookups or, with --learn-bans, learned). Each
+ * event's line is rebuilt from its columns for the alert text, as
+ * "<stamp> sshd[<pid>]: <outcome> for <account> from <address>".
+ * @param archiveFile An archive written with --export.
+ * @param from Only blocks and events from this time on are replayed.
+ * @param to Only blocks and events up to this time are replayed.
+ * @param os An ostream object that prints results to the consol 
+ * @param cfg The detection parameters.
+ */
+void replayArchive(const std::string& archiveFile, uint32_t from,
+        uint32_t to, std::ostream& os, const DetectorConfig& cfg) {
+    ArchiveReader archive(archiveFile);
+    std::unique_ptr<LookupStore> lookups = openLookups(cfg);
+    LookupStore::Reader reader(*lookups);
+    DetectorState state(cfg);
+    ArchiveBlock block;
+    LineBatch batch;
+    // Lookup results per dictionary id: -1 until first needed
+    const Lookups* cached = nullptr;
+    std::vector<int8_t> authorized, banned;
+    uint32_t stampTime = 0;
+    char stamp[32] = "";
+    static const char* const verbs[] = {"", "Failed password ",
+        "Accepted password ", ""};
+    LearnedBans* learned = cfg.learnedBans;
+    auto learnedBan = [learned](uint32_t ip, uint32_t time) {
+        if (!learned || !learned->contains(ip, time)) {
+            return false;
+        }
+        learned->hit();
+        return true;
+    };
+    // Offline while reading blocks; back online for each block's lookups
+    reader.offline();
+    while (archive.next(block, from, to)) {
+        std::unique_lock<std::mutex> guard;
+        if (learned) {
+            guard = learned->lock();
+        }
+        reader.quiescent();
+        const Lookups& current = reader.get();
+        if (&current != cached) {
+            cached = &current;
+            authorized.assign(archive.stringCount(), -1);
+            banned.assign(archive.addressCount(), -1);
+        }
+        auto isAuthorized = [&](uint32_t id) {
+            if (authorized[id] < 0) {
+                authorized[id] = id != 0 && isAuth(archive.string(id),
+                        current);
+            }
+            return authorized[id] != 0;
+        };
+        batch.resize(block.count);
+        size_t n = 0;
+        for (uint32_t i = 0; i < block.count; i++) {
+            if (block.time[i] < from || block.time[i] > to) {
+                continue;
+            }
+            if (n == 0 || block.time[i] != stampTime) {
+                stampTime = block.time[i];
+                time_t t = stampTime;
+                struct tm local;
+                strftime(stamp, sizeof(stamp), "%b %d %H:%M:%S",
+                        localtime_r(&t, &local));
+            }
+            const uint32_t address = block.address[i];
+            const std::string& account = archive.string(block.account[i]);
+            batch.time[n] = block.time[i];
+            batch.user[n] = archive.string(block.pid[i]);
+            batch.pid[n] = parsePid(batch.user[n], 0);
+            batch.hasIP[n] = address != 0;
+            batch.ip[n] = archive.address(address);
+            batch.failed[n] = block.outcome[i] == kOutcomeFailed;
+            batch.target[n] = batch.failed[n] ? account : std::string();
+            batch.late[n] = 0;
+            batch.authorized[n] = isAuthorized(block.account[i]) ||
+                isAuthorized(block.pid[i]);
+            if (address != 0 && banned[address] < 0) {
+                banned[address] = isBand(formatIP(batch.ip[n]), current);
+            }
+            batch.verdict[n] = !batch.authorized[n] && address != 0 &&
+                (banned[address] || learnedBan(batch.ip[n], block.time[i]));
+            std::string& line = batch.line[n];
+            line.assign(stamp).append(" sshd[").append(batch.user[n])
+                .append("]: ").append(verbs[block.outcome[i]]);
+            if (!account.empty()) {
+                line.append("for ").append(account).append(" ");
+            }
+            if (batch.hasIP[n]) {
+                line.append("from ").append(formatIP(batch.ip[n]));
+            }
+            n++;
+        }
+        batch.size = n;
+        if (guard.owns_lock()) {
+            guard.unlock();
+        }
+        reader.offline();
+        runWindowRules(batch, state, os);
+    }
+    finishAlerts(state, os);
+    processHelper(os, 3, "", state.hackAtt, state.lineCount); 
+    printHeavyHitters(os, cfg.topK, state.topIPs, state.topUsers);
+    os << "Replayed " << state.lineCount << " of " << archive.eventCount()
+       << " events; " << archive.skipped() << " blocks skipped.\n";
 }
 
 /**
@@ -322,17 +1680,287 @@ void process(std::istream& is, std::ostream& os) {
  * log entries from the given URL and detect potential hacking attempts.
  *
  * \param[in] argc The number of command-line arguments.  This program
- * requires exactly one command-line argument.
+ * requires one URL, optionally preceded by options.
+ *
+ * \param[in] argv The actual command-line arguments. Every non-option
+ * argument is a source: an URL or, when there are several sources, a
+ * local file. Several sources are read concurrently and their alerts are
+ * labelled with the source. Supported options are:
  *
- * \param[in] argv The actual command-line argument. This should be an URL.
+ *   --ring-frequency               Windowed user frequency rule over ring
+ *                                  buffers instead of checkLog.
+ *   --window <s>, --threshold <n>  Parameters of the windowed rule (the
+ *                                  threshold is at most 16); imply
+ *                                  --ring-frequency.
+ *   --approx                       Bounded-memory (sketch) frequency rule.
+ *   --legacy-frequency             The original checkLog frequency rule
+ *                                  (the default).
+ *   --source-rules                 Also flag sources with too many
+ *                                  failures per IP or per /24 subnet.
+ *   --spray                        Also flag accounts attacked from too
+ *                                  many distinct IPs.
+ *   --top <k>, --snapshot <lines>  Print the top k attacking IPs and
+ *                                  targeted users, at the end and every
+ *                                  so many lines (off by default).
+ *   --batch <lines>                Lines parsed per columnar batch.
+ *   --prefetch <rows>              Rows of rule state prefetched ahead.
+ *   --watch                        Reload the lookups when they change.
+ *   --jobs <n>                     Threads reading several sources.
+ *   --merge-hosts                  One detector shared by all sources.
+ *   --time-merge                   Interleave sources by timestamp into
+ *                                  one detector.
+ *   --reorder <lines>              Per-source reordering buffer depth.
+ *   --lateness <s>                 Order lines by event time, accepting
+ *                                  lines up to s seconds late.
+ *   --suppress <s>                 Print one alert per key per s seconds
+ *                                  and summarize the rest.
+ *   --sink <sink>                  Deliver alerts asynchronously to
+ *                                  stdout, file:<path>, syslog or
+ *                                  socket:<path>; may be repeated.
+ *   --backpressure <policy>        block (default), drop-oldest or
+ *                                  sample[:N] when a sink falls behind.
+ *   --alert-queue <n>              Alerts each sink's queue holds.
+ *   --nft <table>/<set>            Add the source of every alerting line
+ *                                  to an nftables set (inet family),
+ *                                  creating it if needed.
+ *   --nft-interval <ms>            Longest time a partial batch of
+ *                                  addresses waits (default 1000).
+ *   --nft-timeout <s>              Let blocked addresses expire; they
+ *                                  are blocked again if they return.
+ *   --learn-bans <s>               Ban the source of a window-rule alert
+ *                                  for s seconds after its last alert.
+ *   --ban-state <file>             Load learned bans from file and save
+ *                                  them back periodically and at the end.
+ *   --ban-save <s> <n>             Save learned bans once s seconds of
+ *                                  log time or n new bans have passed
+ *                                  (default 60 1000; 0 = never).
+ *   --index <file>                 Write an event index of the (single)
+ *                                  source while processing it.
+ *   --export <archive>             Also write the parsed events of the
+ *                                  (single) source to a columnar archive.
+ *   --replay <archive>             Run the detector over an archive.
+ *   --pace <speed>                 Load test: replay the (single) log
+ *                                  file with its timing scaled by speed
+ *                                  (0 = unpaced) and report latency and
+ *                                  throughput.
+ *   --replay-range <from> <to>     Replay only events between two
+ *                                  timestamps, e.g. "Aug 29 02:00:00".
+ *   --query <index> <log> <key> <from> <to>
+ *                                  Print the lines of log for key
+ *                                  ("user:root", "ip:1.2.3.4") between
+ *                                  two timestamps, using the index.
+ *   --compile-lookups <image>      Compile the lookup files and exit.
+ *   --lookup-image <image>         Map a compiled image at start-up.
+ *   --no-filter                    Look every word up exactly, without
+ *                                  the Bloom filter in front.
+ *   --bench <name>                 Run a built-in benchmark and exit.
+ *   --synthesize <log> <lines> <seed>
+ *                                  Write a reproducible synthetic
+ *                                  auth.log and exit (see CMakeLists.txt).
  */
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
+    DetectorConfig cfg;
+    std::vector<std::string> sources;
+    std::string replayFile;
+    uint32_t replayFrom = 0, replayTo = UINT32_MAX;
+    double paceSpeed = -1;
+    std::vector<std::string> sinks;
+    std::string backpressure = "block";
+    size_t alertQueue = 1 << 14;
+    std::string nftSet;
+    long nftInterval = 1000, nftTimeout = 0, learnTtl = 0;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--approx") {
+            cfg.approximate = true;
+            cfg.legacyFrequency = false;
+        } else if (arg == "--compile-lookups" && i + 1 < argc) {
+            compileLookupImage("authorized_users.txt", "banned_ips.txt",
+                    argv[i + 1]);
+            return 0;
+        } else if (arg == "--synthesize" && i + 3 < argc) {
+            writeSyntheticLog(argv[i + 1], std::stoul(argv[i + 2]),
+                    std::stoul(argv[i + 3]));
+            return 0;
+        } else if (arg == "--lookup-image" && i + 1 < argc) {
+            cfg.lookupImage = argv[++i];
+        } else if (arg == "--no-filter") {
+            cfg.lookupFilter = false;
+        } else if (arg == "--legacy-frequency") {
+            cfg.legacyFrequency = true;
+        } else if (arg == "--ring-frequency") {
+            cfg.legacyFrequency = false;
+        } else if (arg == "--window" && i + 1 < argc) {
+            cfg.userWindow = std::stol(argv[++i]);
+            cfg.legacyFrequency = false;
+        } else if (arg == "--threshold" && i + 1 < argc) {
+            cfg.userThreshold = std::stoi(argv[++i]);
+            cfg.legacyFrequency = false;
+        } else if (arg == "--batch" && i + 1 < argc) {
+            cfg.batchSize = std::stoul(argv[++i]);
+        } else if (arg == "--prefetch" && i + 1 < argc) {
+            cfg.prefetchDistance = std::stoul(argv[++i]);
+        } else if (arg == "--watch") {
+            cfg.watchLookups = true;
+        } else if (arg == "--jobs" && i + 1 < argc) {
+            cfg.jobs = std::stoul(argv[++i]);
+        } else if (arg == "--merge-hosts") {
+            cfg.mergeHosts = true;
+        } else if (arg == "--time-merge") {
+            cfg.timeMerge = true;
+        } else if (arg == "--reorder" && i + 1 < argc) {
+            cfg.reorderDepth = std::stoul(argv[++i]);
+        } else if (arg == "--lateness" && i + 1 < argc) {
+            cfg.allowedLateness = std::stol(argv[++i]);
+        } else if (arg == "--suppress" && i + 1 < argc) {
+            cfg.suppressWindow = std::stol(argv[++i]);
+        } else if (arg == "--sink" && i + 1 < argc) {
+            sinks.push_back(argv[++i]);
+        } else if (arg == "--backpressure" && i + 1 < argc) {
+            backpressure = argv[++i];
+        } else if (arg == "--alert-queue" && i + 1 < argc) {
+            alertQueue = std::stoul(argv[++i]);
+        } else if (arg == "--nft" && i + 1 < argc) {
+            nftSet = argv[++i];
+        } else if (arg == "--nft-interval" && i + 1 < argc) {
+            nftInterval = std::stol(argv[++i]);
+        } else if (arg == "--nft-timeout" && i + 1 < argc) {
+            nftTimeout = std::stol(argv[++i]);
+        } else if (arg == "--learn-bans" && i + 1 < argc) {
+            learnTtl = std::stol(argv[++i]);
+        } else if (arg == "--ban-state" && i + 1 < argc) {
+            cfg.learnedBanFile = argv[++i];
+        } else if (arg == "--ban-save" && i + 2 < argc) {
+            cfg.banSaveEvery = std::stol(argv[++i]);
+            cfg.banSaveCount = std::stoul(argv[++i]);
+        } else if (arg == "--index" && i + 1 < argc) {
+            cfg.indexFile = argv[++i];
+        } else if (arg == "--export" && i + 1 < argc) {
+            cfg.exportFile = argv[++i];
+        } else if (arg == "--pace" && i + 1 < argc) {
+            paceSpeed = std::stod(argv[++i]);
+        } else if (arg == "--replay" && i + 1 < argc) {
+            replayFile = argv[++i];
+        } else if (arg == "--replay-range" && i + 2 < argc) {
+            replayFrom = toSeconds(argv[i + 1]);
+            replayTo = toSeconds(argv[i + 2]);
+            i += 2;
+        } else if (arg == "--query" && i + 5 < argc) {
+            queryIndex(argv[i + 1], argv[i + 2], argv[i + 3], argv[i + 4],
+                    argv[i + 5], std::cout);
+            return 0;
+        } else if (arg == "--source-rules") {
+            cfg.sourceRules = true;
+        } else if (arg == "--spray") {
+            cfg.sprayRule = true;
+        } else if (arg == "--top" && i + 1 < argc) {
+            cfg.topK = std::stoul(argv[++i]);
+            cfg.topKCounters = std::max<size_t>(cfg.topKCounters, 
+                    cfg.topK * 8);
+        } else if (arg == "--snapshot" && i + 1 < argc) {
+            cfg.snapshotEvery = std::stoi(argv[++i]);
+        } else if (arg == "--bench" && i + 1 < argc) {
+            return runBenchmark(argv[i + 1], std::cout);
+        } else {
+            sources.push_back(arg);
+        }
+    }
+    if (cfg.userThreshold < 1 || cfg.userThreshold > kMaxRing) {
+        std::cout << "--threshold must be between 1 and " << kMaxRing
+                  << ".\n";
+        return 1;
+    }
+    // Declared before any detector so the sinks outlive them
+    AlertBus alerts;
+    if (!sinks.empty()) {
+        unsigned sampleEvery = 16;
+        Backpressure policy = parseBackpressure(backpressure, sampleEvery);
+        for (const auto& sink : sinks) {
+            alerts.add(std::unique_ptr<AlertChannel>(new AlertChannel(
+                                makeAlertSink(sink, std::cout), alertQueue,
+                                policy, sampleEvery)));
+        }
+        cfg.alerts = &alerts;
+    }
+    std::unique_ptr<NftSet> blocked;
+    std::unique_ptr<BanAction> blocker;
+    if (!nftSet.empty()) {
+        size_t slash = nftSet.find('/');
+        if (slash == std::string::npos) {
+            std::cout << "--nft needs <table>/<set>.\n";
+            return 1;
+        }
+        blocked.reset(new NftSet(nftSet.substr(0, slash),
+                        nftSet.substr(slash + 1), nftTimeout > 0));
+        blocker.reset(new BanAction(*blocked,
+                        std::chrono::milliseconds(nftInterval), 8192,
+                        std::max<long>(nftTimeout, 0)));
+        cfg.banAction = blocker.get();
+    }
+    std::unique_ptr<LearnedBans> learned;
+    if (learnTtl > 0) {
+        learned.reset(new LearnedBans(learnTtl, cfg.maxTrackedSources));
+        if (!cfg.learnedBanFile.empty()) {
+            std::cout << "Loaded " << learned->load(cfg.learnedBanFile)
+                      << " learned bans from " << cfg.learnedBanFile
+                      << ".\n";
+        }
+        cfg.learnedBans = learned.get();
+    }
+    if (!replayFile.empty()) {
+        replayArchive(replayFile, replayFrom, replayTo, std::cout, cfg);
+        return 0;
+    }
+    if (sources.empty()) {
         std::cout << "URL not specified. See video on setting command-line "
-                  << "arguments in NetBeans on Canvas.\n";
+                  << "arguments in NetBeans on Canvas.\n"
+                  << "Options: --approx (bounded-memory frequency rule), "
+                  << "--legacy-frequency, --ring-frequency, --window <s>, "
+                  << "--threshold <n>, --source-rules, --spray, "
+                  << "--top <k>, --snapshot <lines>, --batch <lines>, "
+                  << "--prefetch <rows>, --watch, --jobs <n>, "
+                  << "--merge-hosts, --time-merge, --reorder <lines>, "
+                  << "--lateness <s>, --suppress <s>, --sink <sink>, "
+                  << "--backpressure <policy>, --alert-queue <n>, "
+                  << "--nft <table>/<set>, --nft-interval <ms>, "
+                  << "--nft-timeout <s>, --learn-bans <s>, "
+                  << "--ban-state <file>, --ban-save <s> <n>, "
+                  << "--index <file>, "
+                  << "--export <archive>, --replay <archive>, "
+                  << "--replay-range <from> <to>, --pace <speed>, "
+                  << "--query <index> <log> <key> <from> <to>, "
+                  << "--compile-lookups <image>, --lookup-image <image>, "
+                  << "--no-filter, --bench <name>, "
+                  << "--synthesize <log> <lines> <seed>\n";
         return 1;
     }
-    const std::string url = argv[1];
+    if (paceSpeed >= 0) {
+        if (sources.size() > 1 || isURL(sources[0])) {
+            std::cout << "--pace needs a single log file.\n";
+            return 1;
+        }
+        paceReplay(sources[0], paceSpeed, std::cout, cfg);
+        return 0;
+    }
+    if (!cfg.indexFile.empty() || !cfg.exportFile.empty()) {
+        if (sources.size() > 1) {
+            std::cout << "--index and --export need a single source.\n";
+            return 1;
+        }
+        // Offsets are taken from the start of the log body
+        SourceLines lines(sources[0]);
+        detect(lines, std::cout, cfg);
+        return 0;
+    }
+    if (cfg.timeMerge) {
+        mergeSources(sources, std::cout, cfg);
+        return 0;
+    }
+    if (sources.size() > 1 || !isURL(sources[0])) {
+        processSources(sources, std::cout, cfg);
+        return 0;
+    }
+    const std::string& url = sources[0];
     // http://ceclnx01.cec.miamioh.edu/~raodm/ssh_logs/full_logs.txt
     // Need a tcp stream to create a network connection to the remote 
     // server and request the data from the remote server
@@ -344,7 +1972,7 @@ int main(int argc, char *argv[]) {
          << "Host: " << hostname << "\r\n"
          << "Connection: Close\r\n\r\n";
     std::ostream& os = std::cout;
-    process(data, os);
+    process(data, os, cfg);
     // Using helper methods, implement the necessary features for
     // this project.
 }
@@ -0,0 +1,105 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * A streaming top-K tracker using the Space-Saving algorithm.
+ *
+ * A fixed number of counters is kept in an array sorted by descending
+ * count. Adding one to a counter swaps it with the first counter of equal
+ * count, so the array stays sorted with O(1) work per update. An unseen
+ * key takes over the smallest counter (always the last one) and inherits
+ * its count as the error bound, which is what guarantees every key seen
+ * more than n/capacity times is retained.
+ */
+
+#ifndef TOP_K_H
+#define TOP_K_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+template <typename Key, typename Hash = std::hash<Key>>
+class SpaceSaving {
+public:
+    /** One reported heavy hitter. count - error is a guaranteed minimum. */
+    struct Entry {
+        Key key;
+        uint64_t count;
+        uint64_t error;
+    };
+
+    /**
+     * @param capacity The number of counters kept. Reporting the top k
+     * is accurate when capacity is several times k.
+     */
+    explicit SpaceSaving(size_t capacity) : capacity(capacity ? capacity : 1) {
+        counters.reserve(this->capacity);
+        index.reserve(this->capacity);
+    }
+
+    /** Counts one occurrence of key. */
+    void add(const Key& key) {
+        auto it = index.find(key);
+        size_t pos;
+        if (it != index.end()) {
+            pos = it->second;
+        } else if (counters.size() < capacity) {
+            // Still filling up: a counter of 0 belongs at the end
+            pos = counters.size();
+            counters.push_back(Entry{key, 0, 0});
+            index[key] = pos;
+            firstOf.emplace(0, pos);
+        } else {
+            // Replace the minimum; it keeps its count as the error bound
+            pos = counters.size() - 1;
+            index.erase(counters[pos].key);
+            counters[pos].key = key;
+            counters[pos].error = counters[pos].count;
+            index[key] = pos;
+        }
+        increment(pos);
+        total++;
+    }
+
+    /**
+     * @param k The number of entries wanted.
+     * @return Up to k entries ordered from the largest count down.
+     */
+    std::vector<Entry> top(size_t k) const {
+        size_t n = std::min(k, counters.size());
+        return std::vector<Entry>(counters.begin(), counters.begin() + n);
+    }
+
+    /** @return The number of occurrences counted so far. */
+    uint64_t count() const { return total; }
+
+private:
+    /** Adds one to the counter at pos while keeping the array sorted. */
+    void increment(size_t pos) {
+        uint64_t c = counters[pos].count;
+        size_t first = firstOf[c];
+        if (first != pos) {
+            std::swap(counters[pos], counters[first]);
+            index[counters[pos].key] = pos;
+            index[counters[first].key] = first;
+        }
+        // first moves into the group of count c + 1, which ends at first
+        if (first + 1 < counters.size() && counters[first + 1].count == c) {
+            firstOf[c] = first + 1;
+        } else {
+            firstOf.erase(c);
+        }
+        counters[first].count++;
+        firstOf.emplace(c + 1, first);
+    }
+
+    size_t capacity;
+    uint64_t total = 0;
+    std::vector<Entry> counters;
+    std::unordered_map<Key, size_t, Hash> index;
+    std::unordered_map<uint64_t, size_t> firstOf;
+};
+
+#endif  // TOP_K_H
@@ -0,0 +1,446 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * Reads a local file as a sequence of large blocks with several reads in
+ * flight, using io_uring where the kernel provides it.
+ *
+ * The block buffers are registered with the ring once, so the kernel
+ * pins them a single time instead of mapping user memory on every read,
+ * and reads are issued as IORING_OP_READ_FIXED. While the caller scans
+ * one block, the next depth - 1 reads are already queued; a block handed
+ * back with release() is immediately reused for the next unread part of
+ * the file, and its submission rides along with the next wait, so a
+ * block costs at most one system call. On kernels without io_uring (or
+ * where it is disabled) the same interface falls back to one pread per
+ * block. The ring is driven with raw system calls, so no liburing is
+ * needed.
+ */
+
+#ifndef URING_READER_H
+#define URING_READER_H
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "line_scanner.h"
+
+/** One block of a file, valid until it is given back with release(). */
+struct FileBlock {
+    const char* data = nullptr;
+    size_t len = 0;
+    uint64_t offset = 0;  // Where data starts in the file
+    int slot = -1;
+};
+
+class UringFileReader {
+public:
+    /**
+     * Opens a file and starts reading it.
+     * @param path The file to be read.
+     * @param blockSize The size of each read and buffer.
+     * @param depth The number of buffers, i.e. reads kept in flight.
+     * @param useUring Set to false to force the pread fallback.
+     */
+    explicit UringFileReader(const std::string& path,
+            size_t blockSize = 1 << 20, unsigned depth = 4,
+            bool useUring = true) : path(path),
+        blockSize(blockSize ? blockSize : 1), slots(depth ? depth : 1) {
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            throw std::runtime_error("Error opening file " + path);
+        }
+        fileSize = st.st_size;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        for (Slot& s : slots) {
+            void* p = nullptr;
+            if (posix_memalign(&p, 4096, this->blockSize) != 0) {
+                releaseAll();
+                throw std::runtime_error("Out of memory reading " + path);
+            }
+            s.buf = static_cast<char*>(p);
+        }
+        if (useUring && setupRing()) {
+            for (size_t i = 0; i < slots.size(); i++) {
+                queueRead(i);
+            }
+            enter(0);
+        }
+    }
+
+    ~UringFileReader() { releaseAll(); }
+    UringFileReader(const UringFileReader&) = delete;
+    UringFileReader& operator=(const UringFileReader&) = delete;
+
+    /** @return "io_uring" or "pread", whichever is in use. */
+    const char* backend() const { return ringFd >= 0 ? "io_uring" : "pread"; }
+
+    /**
+     * Waits for the next block of the file, in file order. Throws if the
+     * file cannot be read. No more than depth - 1 blocks may be held
+     * unreleased when this is called.
+     * @return Returns false at the end of the file.
+     */
+    bool next(FileBlock& block) {
+        if (ringFd < 0) {
+            return nextPread(block);
+        }
+        if (order.empty()) {
+            if (nextOffset < fileSize) {
+                throw std::logic_error("Every buffer of " + path +
+                        " is still held");
+            }
+            return false;
+        }
+        size_t s = order.front();
+        while (!slots[s].done) {
+            enter(1);
+        }
+        order.pop_front();
+        Slot& slot = slots[s];
+        if (slot.result < 0) {
+            throw std::runtime_error("Error reading file " + path + ": " +
+                    std::strerror(-slot.result));
+        }
+        size_t got = slot.result;
+        // Regular files only read short at the end; finish any other
+        // short read synchronously
+        while (got < slot.len) {
+            ssize_t n = pread(fd, slot.buf + got, slot.len - got,
+                    slot.offset + got);
+            if (n <= 0) {
+                break;
+            }
+            got += n;
+        }
+        block = {slot.buf, got, slot.offset, static_cast<int>(s)};
+        return got > 0;
+    }
+
+    /** Gives a block's buffer back so it can receive a later part. */
+    void release(const FileBlock& block) {
+        if (ringFd >= 0 && block.slot >= 0) {
+            queueRead(block.slot);
+        }
+    }
+
+private:
+    struct Slot {
+        char* buf = nullptr;
+        uint64_t offset = 0;
+        size_t len = 0;
+        int result = 0;
+        bool done = false;
+    };
+
+    bool nextPread(FileBlock& block) {
+        Slot& slot = slots[0];
+        size_t got = 0;
+        while (got < blockSize && nextOffset + got < fileSize) {
+            ssize_t n = pread(fd, slot.buf + got, blockSize - got,
+                    nextOffset + got);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                throw std::runtime_error("Error reading file " + path +
+                        ": " + std::strerror(errno));
+            }
+            if (n == 0) {
+                break;
+            }
+            got += n;
+        }
+        block = {slot.buf, got, nextOffset, 0};
+        nextOffset += got;
+        return got > 0;
+    }
+
+    /** Creates the ring and registers the buffers; false if unsupported. */
+    bool setupRing() {
+        struct io_uring_params p;
+        std::memset(&p, 0, sizeof(p));
+        int ring = syscall(__NR_io_uring_setup, slots.size(), &p);
+        if (ring < 0) {
+            return false;
+        }
+        sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        const bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) {
+            sqSize = cqSize = std::max(sqSize, cqSize);
+        }
+        sqRing = mmap(nullptr, sqSize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+        cqRing = single ? sqRing : mmap(nullptr, cqSize, PROT_READ |
+                PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring,
+                IORING_OFF_CQ_RING);
+        sqeSize = p.sq_entries * sizeof(struct io_uring_sqe);
+        void* s = mmap(nullptr, sqeSize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+        std::vector<struct iovec> iov;
+        for (Slot& slot : slots) {
+            iov.push_back({slot.buf, blockSize});
+        }
+        ringFd = ring;
+        if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || s == MAP_FAILED
+            || syscall(__NR_io_uring_register, ring, IORING_REGISTER_BUFFERS,
+                iov.data(), iov.size()) != 0) {
+            sqes = s == MAP_FAILED ? nullptr :
+                static_cast<struct io_uring_sqe*>(s);
+            closeRing();
+            return false;
+        }
+        char* sq = static_cast<char*>(sqRing);
+        char* cq = static_cast<char*>(cqRing);
+        sqTail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sqMask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+        cqHead = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+        sqes = static_cast<struct io_uring_sqe*>(s);
+        return true;
+    }
+
+    /** Queues a read of the next unread part of the file into slot s. */
+    void queueRead(size_t s) {
+        if (nextOffset >= fileSize) {
+            return;
+        }
+        Slot& slot = slots[s];
+        slot.offset = nextOffset;
+        slot.len = std::min<uint64_t>(blockSize, fileSize - nextOffset);
+        slot.done = false;
+        nextOffset += slot.len;
+        unsigned tail = *sqTail;
+        unsigned index = tail & sqMask;
+        struct io_uring_sqe* sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(slot.buf);
+        sqe->len = slot.len;
+        sqe->off = slot.offset;
+        sqe->buf_index = s;
+        sqe->user_data = s;
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        order.push_back(s);
+        unsubmitted++;
+    }
+
+    /** Submits queued reads, waits for at least wait completions, and
+     * records every completion that has arrived. */
+    void enter(unsigned wait) {
+        if (unsubmitted > 0 || wait > 0) {
+            int n = syscall(__NR_io_uring_enter, ringFd, unsubmitted, wait,
+                    wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (n < 0 && errno != EINTR) {
+                throw std::runtime_error("io_uring_enter failed reading " +
+                        path + ": " + std::strerror(errno));
+            }
+            unsubmitted -= n > 0 ? std::min<unsigned>(n, unsubmitted) : 0;
+        }
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const struct io_uring_cqe& cqe = cqes[head & cqMask];
+            Slot& slot = slots[cqe.user_data];
+            slot.result = cqe.res;
+            slot.done = true;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    void closeRing() {
+        if (sqes != nullptr) {
+            munmap(sqes, sqeSize);
+        }
+        if (cqRing != MAP_FAILED && cqRing != sqRing && cqRing != nullptr) {
+            munmap(cqRing, cqSize);
+        }
+        if (sqRing != MAP_FAILED && sqRing != nullptr) {
+            munmap(sqRing, sqSize);
+        }
+        close(ringFd);
+        ringFd = -1;
+        sqes = nullptr;
+        sqRing = cqRing = nullptr;
+    }
+
+    void releaseAll() {
+        if (ringFd >= 0) {
+            // The kernel may still be writing into the buffers
+            for (size_t s : order) {
+                while (!slots[s].done) {
+                    enter(1);
+                }
+            }
+            closeRing();
+        }
+        for (Slot& s : slots) {
+            free(s.buf);
+            s.buf = nullptr;
+        }
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    std::string path;
+    size_t blockSize;
+    std::vector<Slot> slots;
+    int fd = -1;
+    uint64_t fileSize = 0;
+    uint64_t nextOffset = 0;
+    std::deque<size_t> order;  // Slots with a read queued, in file order
+    unsigned unsubmitted = 0;
+    // The ring, when io_uring is available
+    int ringFd = -1;
+    void* sqRing = nullptr;
+    void* cqRing = nullptr;
+    size_t sqSize = 0, cqSize = 0, sqeSize = 0;
+    unsigned* sqTail = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned sqMask = 0;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned cqMask = 0;
+    struct io_uring_cqe* cqes = nullptr;
+    struct io_uring_sqe* sqes = nullptr;
+};
+
+/**
+ * Splits a local file read by UringFileReader into lines; a drop-in for
+ * BlockLineReader. Each block is scanned in place in its registered
+ * buffer and held until its lines have been handed out. Only the
+ * unterminated last line of a block is copied, and joined with the head
+ * of the next block.
+ */
+class FileLineReader {
+public:
+    /**
+     * @param path The file to be read.
+     * @param mask The block mask implementation, normally
+     * bestScanner().mask.
+     * @param blockSize The size of each read.
+     */
+    FileLineReader(const std::string& path, BlockMaskFn mask,
+            size_t blockSize = 1 << 20) : file(path, blockSize),
+        mask(mask) {}
+
+    /**
+     * Gets the next line (without its '\n') and its fields.
+     * @return Returns false once the file is exhausted.
+     */
+    bool next(std::string& line, LineFields& fields) {
+        while (index == lines.size()) {
+            if (!refill()) {
+                return false;
+            }
+        }
+        fields = lines[index];
+        // The first line may be the one carried over from the last block
+        bool carried = index++ == 0 && joined;
+        line.assign((carried ? tail.data() : block.data) + fields.begin,
+                fields.length);
+        lastOffset = carried ? tailOffset : block.offset + fields.begin;
+        return true;
+    }
+
+    /** @return The offset in the file of the last line returned. */
+    uint64_t offset() const { return lastOffset; }
+
+private:
+    /**
+     * Gives back the block whose lines were all handed out, keeping its
+     * unterminated last line, and scans the next block.
+     * @return Returns false once the file is exhausted.
+     */
+    bool refill() {
+        lines.clear();
+        index = 0;
+        if (joined) {
+            tail.clear();
+            joined = false;
+        }
+        if (held) {
+            if (tail.empty()) {
+                tailOffset = block.offset + rest;
+            }
+            tail.append(block.data + rest, block.len - rest);
+            file.release(block);
+            held = false;
+        }
+        if (eof) {
+            return false;
+        }
+        if (!file.next(block)) {
+            eof = true;
+            if (tail.empty()) {
+                return false;
+            }
+            // A final unterminated line
+            tail += '\n';
+            scanLines(tail.data(), tail.size(), lines, mask);
+            joined = true;
+            return true;
+        }
+        held = true;
+        size_t start = 0;
+        if (!tail.empty()) {
+            const char* nl = static_cast<const char*>(
+                    std::memchr(block.data, '\n', block.len));
+            if (nl == nullptr) {
+                // The whole block continues the carried line
+                rest = 0;
+                return true;
+            }
+            start = nl - block.data + 1;
+            tail.append(block.data, start);
+            scanLines(tail.data(), tail.size(), lines, mask);
+            joined = true;
+        }
+        size_t first = lines.size();
+        rest = start + scanLines(block.data + start, block.len - start,
+                lines, mask);
+        // scanLines reports offsets relative to where it started
+        for (size_t i = first; i < lines.size(); i++) {
+            lines[i].begin += start;
+        }
+        return true;
+    }
+
+    UringFileReader file;
+    BlockMaskFn mask;
+    FileBlock block;       // The block whose lines are being handed out
+    bool held = false;     // Whether block must still be released
+    size_t rest = 0;       // Where block's unterminated last line starts
+    std::vector<LineFields> lines;
+    size_t index = 0;
+    std::string tail;      // A line that began in an earlier block
+    uint64_t tailOffset = 0;
+    bool joined = false;   // Whether lines[0] is tail, now complete
+    bool eof = false;
+    uint64_t lastOffset = 0;
+};
+
+#endif  // URING_READER_H
@@ -0,0 +1,46 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * Variable-length integer encoding shared by the on-disk formats: the
+ * event index and the event archive. Small values take one byte, and
+ * signed deltas are zigzag encoded first so that small negative changes
+ * stay small too.
+ */
+
+#ifndef VARINT_H
+#define VARINT_H
+
+#include <cstdint>
+#include <vector>
+
+/** Appends v to out as a little-endian base-128 varint. */
+inline void putVarint(std::vector<uint8_t>& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back(static_cast<uint8_t>(v) | 0x80);
+        v >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(v));
+}
+
+/** Reads a varint written by putVarint and advances p past it. */
+inline uint64_t getVarint(const uint8_t*& p, const uint8_t* end) {
+    uint64_t v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = *p++;
+        v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+    return v;
+}
+
+/** Maps a signed delta to an unsigned one with small magnitudes first. */
+inline uint64_t zigzag(int64_t v) {
+    return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+inline int64_t unzigzag(uint64_t v) {
+    return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+}
+
+#endif  // VARINT_H
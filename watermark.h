@@ -0,0 +1,104 @@
+// Copyright [2021] <Copyright Strauchler>
+/**
+ * Event-time ordering for the sliding-window rules.
+ *
+ * The window rules assume attempts arrive in time order. Input merged
+ * from several hosts, or received over UDP, does not. A WatermarkBuffer
+ * holds each event until no earlier event can still arrive: the
+ * watermark trails the largest time seen by the allowed lateness, and
+ * every event older than the watermark is released in time order. Events
+ * sharing a second are released in the order given by Event's operator<
+ * rather than in arrival order. Because rules only ever see released
+ * events, their decisions are final and do not depend on how the input
+ * was shuffled within the lateness bound. Events that arrive after their
+ * second was released are reported as late instead.
+ *
+ * Events are kept in one bucket per second over a ring of lateness + 1
+ * buckets, so buffering is O(1) and releasing costs one sort of each
+ * second's events: O(1) amortized per second plus O(log b) per event for
+ * b events sharing a second.
+ */
+
+#ifndef WATERMARK_H
+#define WATERMARK_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+template <typename Event>
+class WatermarkBuffer {
+public:
+    /** @param lateness How many seconds an event may trail the newest. */
+    explicit WatermarkBuffer(long lateness) :
+        lateness(lateness > 0 ? lateness : 0), buckets(this->lateness + 1) {}
+
+    /**
+     * Buffers an event, first releasing every event that the new
+     * watermark has passed.
+     * @param time The event time in seconds.
+     * @param event The event, moved into the buffer.
+     * @param out Called with each released event, oldest first.
+     * @return Returns false if the event is late: its second was already
+     * released, so it was not buffered and out was not called for it.
+     */
+    template <typename Out>
+    bool push(uint32_t time, Event&& event, Out out) {
+        if (!started) {
+            started = true;
+            newest = time;
+            next = time > lateness ? time - lateness : 0;
+        }
+        if (time < next) {
+            return false;
+        }
+        if (time > newest) {
+            newest = time;
+            releaseBefore(time > lateness ? time - lateness : 0, out);
+        }
+        buckets[time % buckets.size()].push_back(std::move(event));
+        pending++;
+        return true;
+    }
+
+    /** Releases every buffered event, e.g. at the end of the input. */
+    template <typename Out>
+    void flush(Out out) {
+        releaseBefore(newest + 1, out);
+    }
+
+    /** @return The oldest event time still accepted. */
+    uint32_t watermark() const { return next; }
+
+    /** @return The number of events waiting for the watermark. */
+    size_t size() const { return pending; }
+
+private:
+    /** Releases the buckets for every second before end. */
+    template <typename Out>
+    void releaseBefore(uint32_t end, Out& out) {
+        // No more than one revolution can hold events
+        for (uint32_t t = next; t < end && pending > 0 &&
+                 t - next < buckets.size(); t++) {
+            auto& bucket = buckets[t % buckets.size()];
+            std::sort(bucket.begin(), bucket.end());
+            for (Event& event : bucket) {
+                out(event);
+            }
+            pending -= bucket.size();
+            bucket.clear();
+        }
+        next = end > next ? end : next;
+    }
+
+    uint32_t lateness;
+    std::vector<std::vector<Event>> buckets;
+    uint32_t newest = 0;
+    uint32_t next = 0;  // Events before this second have been released
+    size_t pending = 0;
+    bool started = false;
+};
+
+#endif  // WATERMARK_H